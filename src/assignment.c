@@ -0,0 +1,290 @@
+#include "assignment.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "contig_node_translator.h"
+#include "khash.h"
+
+KHASH_MAP_INIT_STR(tree_names, int)
+
+static int tree_add_node(prophex_tree_t* tree, int parent, int* capacity) {
+	if (tree->nodes_cnt == *capacity) {
+		*capacity = *capacity ? 2 * *capacity : 1024;
+		tree->names = realloc(tree->names, *capacity * sizeof(char*));
+		tree->parents = realloc(tree->parents, *capacity * sizeof(int));
+		tree->subtree_ends = realloc(tree->subtree_ends, *capacity * sizeof(int));
+	}
+	tree->names[tree->nodes_cnt] = NULL;
+	tree->parents[tree->nodes_cnt] = parent;
+	return tree->nodes_cnt++;
+}
+
+// reads the name of the node, then skips its branch length and comments
+static const char* parse_label(const char* s, char** name) {
+	while (isspace(*s)) {
+		++s;
+	}
+	const char* begin = s;
+	if (*s == '\'') {
+		begin = ++s;
+		while (*s && *s != '\'') {
+			++s;
+		}
+	} else {
+		while (*s && !isspace(*s) && !strchr("(),:;[", *s)) {
+			++s;
+		}
+	}
+	*name = malloc(s - begin + 1);
+	memcpy(*name, begin, s - begin);
+	(*name)[s - begin] = '\0';
+	if (*s == '\'') {
+		++s;
+	}
+	while (1) {
+		while (isspace(*s)) {
+			++s;
+		}
+		if (*s == ':') {
+			++s;
+			while (*s && !isspace(*s) && !strchr("(),;[", *s)) {
+				++s;
+			}
+		} else if (*s == '[') {
+			while (*s && *s != ']') {
+				++s;
+			}
+			if (*s) {
+				++s;
+			}
+		} else {
+			return s;
+		}
+	}
+}
+
+// nodes are created in pre-order: an inner node when its '(' is reached, a leaf when its name is
+static int parse_newick(const char* s, prophex_tree_t* tree) {
+	int capacity = 0, stack_capacity = 64, stack_cnt = 0;
+	int* stack = malloc(stack_capacity * sizeof(int));
+	int expect_node = 1;
+	while (1) {
+		while (isspace(*s)) {
+			++s;
+		}
+		if (expect_node) {
+			int v = tree_add_node(tree, stack_cnt ? stack[stack_cnt - 1] : -1, &capacity);
+			if (*s == '(') {
+				if (stack_cnt == stack_capacity) {
+					stack_capacity *= 2;
+					stack = realloc(stack, stack_capacity * sizeof(int));
+				}
+				stack[stack_cnt++] = v;
+				++s;
+				continue;
+			}
+			s = parse_label(s, &tree->names[v]);
+			tree->subtree_ends[v] = tree->nodes_cnt;
+			expect_node = 0;
+		} else if (*s == ',' && stack_cnt > 0) {
+			++s;
+			expect_node = 1;
+		} else if (*s == ')' && stack_cnt > 0) {
+			int v = stack[--stack_cnt];
+			s = parse_label(s + 1, &tree->names[v]);
+			tree->subtree_ends[v] = tree->nodes_cnt;
+		} else {
+			free(stack);
+			return (*s == ';' || *s == '\0') && stack_cnt == 0 ? 0 : -1;
+		}
+	}
+}
+
+prophex_tree_t* tree_load(const char* fn) {
+	FILE* fp = fopen(fn, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "[prophex:%s] can not open the tree %s\n", __func__, fn);
+		return NULL;
+	}
+	size_t len = 0, capacity = 1 << 16;
+	char* s = malloc(capacity);
+	size_t read;
+	while ((read = fread(s + len, 1, capacity - len - 1, fp)) > 0) {
+		len += read;
+		if (len + 1 == capacity) {
+			capacity *= 2;
+			s = realloc(s, capacity);
+		}
+	}
+	s[len] = '\0';
+	fclose(fp);
+	prophex_tree_t* tree = calloc(1, sizeof(prophex_tree_t));
+	if (parse_newick(s, tree) != 0) {
+		fprintf(stderr, "[prophex:%s] %s is not a tree in the Newick format\n", __func__, fn);
+		free(s);
+		tree_destroy(tree);
+		return NULL;
+	}
+	free(s);
+
+	khash_t(tree_names)* names = kh_init(tree_names);
+	int v, absent;
+	for (v = 0; v < tree->nodes_cnt; ++v) {
+		khint_t it = kh_put(tree_names, names, tree->names[v], &absent);
+		if (absent) {
+			kh_val(names, it) = v;
+		}
+	}
+	tree->index_nodes_cnt = get_nodes_count();
+	tree->index_nodes = malloc(tree->index_nodes_cnt * sizeof(int));
+	int missing_cnt = 0, node;
+	for (node = 0; node < tree->index_nodes_cnt; ++node) {
+		khint_t it = kh_get(tree_names, names, get_node_name(node));
+		tree->index_nodes[node] = it != kh_end(names) ? kh_val(names, it) : -1;
+		missing_cnt += it == kh_end(names);
+	}
+	kh_destroy(tree_names, names);
+	if (missing_cnt > 0) {
+		fprintf(stderr, "[prophex:%s] %d of %d nodes of the index are not in the tree, their k-mers are not used for assignment\n", __func__,
+		        missing_cnt, tree->index_nodes_cnt);
+	}
+	fprintf(stderr, "[prophex:%s] tree with %d nodes loaded from %s\n", __func__, tree->nodes_cnt, fn);
+	return tree;
+}
+
+void tree_destroy(prophex_tree_t* tree) {
+	if (!tree) {
+		return;
+	}
+	int v;
+	for (v = 0; v < tree->nodes_cnt; ++v) {
+		free(tree->names[v]);
+	}
+	free(tree->names);
+	free(tree->parents);
+	free(tree->subtree_ends);
+	free(tree->index_nodes);
+	free(tree);
+}
+
+void assignment_aux_destroy(assignment_aux_t* aux) {
+	free(aux->events);
+	free(aux->intervals);
+	free(aux->coverage);
+}
+
+// events are (pre-order position, first k-mer of the streak, number of its k-mers, +1 / -1)
+#define EVENT_INTS 4
+
+static int compare_first_int(const void* a, const void* b) {
+	int x = *(const int*)a, y = *(const int*)b;
+	return (x > y) - (x < y);
+}
+
+static void add_event(assignment_aux_t* aux, int* events_cnt, int position, int kmer_start, int kmers_cnt, int delta) {
+	if (*events_cnt == aux->events_capacity) {
+		aux->events_capacity = aux->events_capacity ? 2 * aux->events_capacity : 256;
+		aux->events = realloc(aux->events, aux->events_capacity * EVENT_INTS * sizeof(int));
+	}
+	int* event = aux->events + EVENT_INTS * (*events_cnt)++;
+	event[0] = position;
+	event[1] = kmer_start;
+	event[2] = kmers_cnt;
+	event[3] = delta;
+}
+
+void assign_read(const prophex_tree_t* tree, const read_streaks_t* streaks, int l_seq, int kmer_length, int measure, assignment_aux_t* aux,
+                 read_assignment_t* assignment) {
+	assignment->node = -1;
+	assignment->h1 = 0;
+	assignment->c1 = 0;
+	// every streak hits the subtrees of its nodes, nested ones are merged
+	int events_cnt = 0;
+	int kmer_start = 0;
+	int i;
+	for (i = streaks->cnt - 1; i >= 0; --i) {
+		int kmers_cnt = streaks->kmers_cnts[i];
+		kmer_start += kmers_cnt;
+		if (streaks->is_ambiguous[i] || kmers_cnt == 0) {
+			continue;
+		}
+		int nodes_cnt = streaks->offsets[i + 1] - streaks->offsets[i];
+		if (2 * nodes_cnt > aux->intervals_capacity) {
+			aux->intervals_capacity = 2 * nodes_cnt;
+			aux->intervals = realloc(aux->intervals, aux->intervals_capacity * sizeof(int));
+		}
+		int intervals_cnt = 0, j;
+		for (j = 0; j < nodes_cnt; ++j) {
+			int32_t node = streaks->nodes[streaks->offsets[i] + j];
+			int v = node < tree->index_nodes_cnt ? tree->index_nodes[node] : -1;
+			if (v >= 0) {
+				aux->intervals[2 * intervals_cnt] = v;
+				aux->intervals[2 * intervals_cnt + 1] = tree->subtree_ends[v];
+				++intervals_cnt;
+			}
+		}
+		qsort(aux->intervals, intervals_cnt, 2 * sizeof(int), compare_first_int);
+		for (j = 0; j < intervals_cnt;) {
+			int begin = aux->intervals[2 * j], end = aux->intervals[2 * j + 1];
+			for (++j; j < intervals_cnt && aux->intervals[2 * j] < end; ++j) {
+				if (aux->intervals[2 * j + 1] > end) {
+					end = aux->intervals[2 * j + 1];
+				}
+			}
+			add_event(aux, &events_cnt, begin, kmer_start - kmers_cnt, kmers_cnt, 1);
+			add_event(aux, &events_cnt, end, kmer_start - kmers_cnt, kmers_cnt, -1);
+		}
+	}
+	if (events_cnt == 0) {
+		return;
+	}
+	qsort(aux->events, events_cnt, EVENT_INTS * sizeof(int), compare_first_int);
+	if (l_seq > aux->coverage_capacity) {
+		aux->coverage_capacity = l_seq;
+		aux->coverage = realloc(aux->coverage, aux->coverage_capacity * sizeof(int));
+	}
+	memset(aux->coverage, 0, l_seq * sizeof(int));
+
+	// sweep over the nodes in pre-order, h1 and c1 change only at the events; best nodes are first_best, ..., last_best
+	// (possibly with worse ones between them, which does not change their lowest common ancestor)
+	int h1 = 0, c1 = 0, best = 0, first_best = -1, last_best = -1;
+	int e = 0;
+	while (e < events_cnt) {
+		int position = aux->events[EVENT_INTS * e];
+		for (; e < events_cnt && aux->events[EVENT_INTS * e] == position; ++e) {
+			const int* event = aux->events + EVENT_INTS * e;
+			int b, end = event[1] + event[2] - 1 + kmer_length;
+			h1 += event[3] * event[2];
+			for (b = event[1]; b < end; ++b) {
+				if (event[3] > 0) {
+					c1 += aux->coverage[b]++ == 0;
+				} else {
+					c1 -= --aux->coverage[b] == 0;
+				}
+			}
+		}
+		if (e == events_cnt) {
+			break;
+		}
+		int value = measure == ASSIGN_C1 ? c1 : h1;
+		if (value > 0 && value >= best) {
+			if (value > best) {
+				best = value;
+				first_best = position;
+				assignment->h1 = h1;
+				assignment->c1 = c1;
+			}
+			last_best = aux->events[EVENT_INTS * e] - 1;
+		}
+	}
+	if (first_best < 0) {
+		return;
+	}
+	// the lowest common ancestor of nodes is the one of the first and the last of them in pre-order
+	int v = last_best;
+	while (v > first_best || tree->subtree_ends[v] <= first_best) {
+		v = tree->parents[v];
+	}
+	assignment->node = v;
+}
@@ -0,0 +1,60 @@
+/*
+    Assignment of reads to the nodes of a ProPhyle tree (query -A), computed from the streaks of k-mer matches.
+    Licence: MIT
+
+    k-mers of a node are shared by all genomes below it, so a k-mer matching a node hits the node and all its
+    descendants. For every node v, h1 is the number of k-mers of the read hitting v and c1 the number of bases of the
+    read covered by them. The read is assigned to the lowest common ancestor of the nodes with the highest h1 (or c1),
+    it is unassigned if no k-mer hits a node of the tree.
+*/
+
+#ifndef ASSIGNMENT_H
+#define ASSIGNMENT_H
+
+#include <stdint.h>
+#include "binary_output.h"
+
+// assignment measure (query -M)
+#define ASSIGN_H1 0
+#define ASSIGN_C1 1
+
+// nodes are numbered in pre-order, so the subtree of node v is v, ..., subtree_ends[v] - 1
+typedef struct {
+	int nodes_cnt;
+	char** names;
+	int* parents;
+	int* subtree_ends;
+	// tree node of every node of the index, -1 for those missing in the tree
+	int* index_nodes;
+	int index_nodes_cnt;
+} prophex_tree_t;
+
+typedef struct {
+	// tree node, -1 for an unassigned read
+	int node;
+	int h1;
+	int c1;
+} read_assignment_t;
+
+// buffers of one thread
+typedef struct {
+	// (pre-order position, first k-mer of the streak, number of its k-mers, +1 / -1) at the borders of the subtrees hit
+	// by the streaks
+	int* events;
+	int events_capacity;
+	int* intervals;
+	int intervals_capacity;
+	int* coverage;
+	int coverage_capacity;
+} assignment_aux_t;
+
+// loads a tree in the Newick format (branch lengths and [...] comments are skipped) and maps the nodes of the index
+// to its nodes by name, returns NULL if the tree can not be read
+prophex_tree_t* tree_load(const char* fn);
+void tree_destroy(prophex_tree_t* tree);
+void assignment_aux_destroy(assignment_aux_t* aux);
+// streaks of the read are in the order they are built (from the end of the read)
+void assign_read(const prophex_tree_t* tree, const read_streaks_t* streaks, int l_seq, int kmer_length, int measure, assignment_aux_t* aux,
+                 read_assignment_t* assignment);
+
+#endif  // ASSIGNMENT_H
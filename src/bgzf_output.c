@@ -0,0 +1,154 @@
+#define _GNU_SOURCE
+#include "bgzf_output.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+// data of a block, so that even an incompressible block fits into the 64 kB limit of BGZF
+#define BGZF_BLOCK_DATA_SIZE 0xff00
+#define BGZF_MAX_BLOCK_SIZE 0x10000
+#define BGZF_HEADER_SIZE 18
+#define BGZF_TRAILER_SIZE 8
+// blocks compressed together by the threads, per thread
+#define BGZF_OUTPUT_BLOCKS_PER_THREAD 4
+
+extern void kt_for(int n_threads, void (*func)(void*, int, int), void* data, int n);
+
+// the empty block marking the end of a BGZF file
+static const uint8_t bgzf_eof_block[28] = {0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 0x06, 0, 0x42, 0x43,
+                                           0x02, 0,    0x1b, 0,    0x03, 0, 0, 0, 0, 0, 0,    0,    0, 0};
+
+typedef struct {
+	FILE* out;
+	int n_threads;
+	int max_blocks;
+	// data waiting for compression, block i is data[i * BGZF_BLOCK_DATA_SIZE], ...
+	char* data;
+	size_t len;
+	// compressed blocks
+	uint8_t* blocks;
+	int* block_sizes;
+	z_stream* streams;
+	int blocks_cnt;
+	int failed;
+} bgzf_output_t;
+
+static void put_u16(uint8_t* p, uint16_t x) {
+	p[0] = x;
+	p[1] = x >> 8;
+}
+
+static void put_u32(uint8_t* p, uint32_t x) {
+	put_u16(p, x);
+	put_u16(p + 2, x >> 16);
+}
+
+static void compress_block(void* data, int i, int tid) {
+	bgzf_output_t* output = (bgzf_output_t*)data;
+	z_stream* zs = &output->streams[tid];
+	const char* block_data = output->data + (size_t)i * BGZF_BLOCK_DATA_SIZE;
+	size_t len = output->len - (size_t)i * BGZF_BLOCK_DATA_SIZE;
+	if (len > BGZF_BLOCK_DATA_SIZE) {
+		len = BGZF_BLOCK_DATA_SIZE;
+	}
+	uint8_t* block = output->blocks + (size_t)i * BGZF_MAX_BLOCK_SIZE;
+	deflateReset(zs);
+	zs->next_in = (Bytef*)block_data;
+	zs->avail_in = len;
+	zs->next_out = block + BGZF_HEADER_SIZE;
+	zs->avail_out = BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE - BGZF_TRAILER_SIZE;
+	if (deflate(zs, Z_FINISH) != Z_STREAM_END) {
+		output->failed = 1;
+		output->block_sizes[i] = 0;
+		return;
+	}
+	int block_size = BGZF_HEADER_SIZE + zs->total_out + BGZF_TRAILER_SIZE;
+	// gzip header with the BC extra subfield holding the block size - 1
+	memcpy(block, bgzf_eof_block, BGZF_HEADER_SIZE);
+	put_u16(block + 16, block_size - 1);
+	put_u32(block + block_size - 8, crc32(crc32(0L, Z_NULL, 0), (const Bytef*)block_data, len));
+	put_u32(block + block_size - 4, len);
+	output->block_sizes[i] = block_size;
+}
+
+// compresses all data waiting, the last block may be partial
+static void compress_and_write(bgzf_output_t* output) {
+	int blocks_cnt = (output->len + BGZF_BLOCK_DATA_SIZE - 1) / BGZF_BLOCK_DATA_SIZE;
+	kt_for(output->n_threads < blocks_cnt ? output->n_threads : blocks_cnt, compress_block, output, blocks_cnt);
+	int i;
+	for (i = 0; i < blocks_cnt && !output->failed; ++i) {
+		if (fwrite(output->blocks + (size_t)i * BGZF_MAX_BLOCK_SIZE, 1, output->block_sizes[i], output->out) != (size_t)output->block_sizes[i]) {
+			output->failed = 1;
+		}
+	}
+	output->len = 0;
+}
+
+static ssize_t bgzf_output_write(void* cookie, const char* buf, size_t size) {
+	bgzf_output_t* output = (bgzf_output_t*)cookie;
+	size_t capacity = (size_t)output->max_blocks * BGZF_BLOCK_DATA_SIZE;
+	size_t done = 0;
+	while (done < size) {
+		size_t len = size - done < capacity - output->len ? size - done : capacity - output->len;
+		memcpy(output->data + output->len, buf + done, len);
+		output->len += len;
+		done += len;
+		if (output->len == capacity) {
+			compress_and_write(output);
+		}
+	}
+	return output->failed ? -1 : (ssize_t)size;
+}
+
+static int bgzf_output_close(void* cookie) {
+	bgzf_output_t* output = (bgzf_output_t*)cookie;
+	if (output->len > 0) {
+		compress_and_write(output);
+	}
+	if (!output->failed && fwrite(bgzf_eof_block, 1, sizeof(bgzf_eof_block), output->out) != sizeof(bgzf_eof_block)) {
+		output->failed = 1;
+	}
+	int failed = output->failed || fflush(output->out) != 0;
+	if (failed) {
+		fprintf(stderr, "[prophex:%s] the output could not be compressed or written\n", __func__);
+	}
+	int i;
+	for (i = 0; i < output->n_threads; ++i) {
+		deflateEnd(&output->streams[i]);
+	}
+	free(output->streams);
+	free(output->data);
+	free(output->blocks);
+	free(output->block_sizes);
+	free(output);
+	return failed ? EOF : 0;
+}
+
+FILE* bgzf_output_open(FILE* out, int n_threads, int level) {
+	bgzf_output_t* output = calloc(1, sizeof(bgzf_output_t));
+	output->out = out;
+	output->n_threads = n_threads;
+	output->max_blocks = BGZF_OUTPUT_BLOCKS_PER_THREAD * n_threads;
+	output->data = malloc((size_t)output->max_blocks * BGZF_BLOCK_DATA_SIZE);
+	output->blocks = malloc((size_t)output->max_blocks * BGZF_MAX_BLOCK_SIZE);
+	output->block_sizes = malloc(output->max_blocks * sizeof(int));
+	output->streams = calloc(n_threads, sizeof(z_stream));
+	int i;
+	for (i = 0; i < n_threads; ++i) {
+		deflateInit2(&output->streams[i], level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+	}
+	cookie_io_functions_t functions = {NULL, bgzf_output_write, NULL, bgzf_output_close};
+	FILE* stream = fopencookie(output, "w", functions);
+	if (stream == NULL) {
+		for (i = 0; i < n_threads; ++i) {
+			deflateEnd(&output->streams[i]);
+		}
+		free(output->streams);
+		free(output->data);
+		free(output->blocks);
+		free(output->block_sizes);
+		free(output);
+	}
+	return stream;
+}
@@ -0,0 +1,17 @@
+/*
+    Compressed output of query (query -z): the output is written in BGZF blocks (readable by gzip, zcat, bgzip and
+    htslib) which are compressed by several threads and written in order.
+    Licence: MIT
+*/
+
+#ifndef BGZF_OUTPUT_H
+#define BGZF_OUTPUT_H
+
+#include <stdio.h>
+
+// returns a stream whose data are compressed and written to out; the blocks are compressed once there are enough of
+// them for all threads, closing the stream writes the rest and the end-of-file block, out is flushed but not closed;
+// returns NULL if the stream can not be created
+FILE* bgzf_output_open(FILE* out, int n_threads, int level);
+
+#endif  // BGZF_OUTPUT_H
@@ -0,0 +1,235 @@
+#include "binary_output.h"
+#include <stdlib.h>
+#include <string.h>
+#include "contig_node_translator.h"
+
+void read_streaks_clear(read_streaks_t* streaks) {
+	if (streaks->capacity == 0) {
+		streaks->capacity = 16;
+		streaks->offsets = malloc((streaks->capacity + 1) * sizeof(size_t));
+		streaks->kmers_cnts = malloc(streaks->capacity * sizeof(int32_t));
+		streaks->is_ambiguous = malloc(streaks->capacity * sizeof(int8_t));
+	}
+	streaks->cnt = 0;
+	streaks->nodes_cnt = 0;
+	streaks->offsets[0] = 0;
+}
+
+void read_streaks_add(read_streaks_t* streaks, const int32_t* nodes, int nodes_cnt, int kmers_cnt, int is_ambiguous) {
+	if (streaks->cnt == streaks->capacity) {
+		streaks->capacity *= 2;
+		streaks->offsets = realloc(streaks->offsets, (streaks->capacity + 1) * sizeof(size_t));
+		streaks->kmers_cnts = realloc(streaks->kmers_cnts, streaks->capacity * sizeof(int32_t));
+		streaks->is_ambiguous = realloc(streaks->is_ambiguous, streaks->capacity * sizeof(int8_t));
+	}
+	if (is_ambiguous) {
+		nodes_cnt = 0;
+	}
+	if (streaks->nodes_cnt + nodes_cnt > streaks->nodes_capacity) {
+		while (streaks->nodes_cnt + nodes_cnt > streaks->nodes_capacity) {
+			streaks->nodes_capacity = streaks->nodes_capacity ? 2 * streaks->nodes_capacity : 64;
+		}
+		streaks->nodes = realloc(streaks->nodes, streaks->nodes_capacity * sizeof(int32_t));
+	}
+	memcpy(streaks->nodes + streaks->nodes_cnt, nodes, nodes_cnt * sizeof(int32_t));
+	streaks->nodes_cnt += nodes_cnt;
+	streaks->kmers_cnts[streaks->cnt] = kmers_cnt;
+	streaks->is_ambiguous[streaks->cnt] = is_ambiguous;
+	streaks->offsets[++streaks->cnt] = streaks->nodes_cnt;
+}
+
+void read_streaks_destroy(read_streaks_t* streaks) {
+	free(streaks->nodes);
+	free(streaks->offsets);
+	free(streaks->kmers_cnts);
+	free(streaks->is_ambiguous);
+}
+
+static void buf_reserve(binary_output_t* output, size_t len) {
+	if (output->buf_len + len > output->buf_capacity) {
+		while (output->buf_len + len > output->buf_capacity) {
+			output->buf_capacity = output->buf_capacity ? 2 * output->buf_capacity : 1 << 16;
+		}
+		output->buf = realloc(output->buf, output->buf_capacity);
+	}
+}
+
+static void buf_append(binary_output_t* output, const void* data, size_t len) {
+	buf_reserve(output, len);
+	memcpy(output->buf + output->buf_len, data, len);
+	output->buf_len += len;
+}
+
+static void buf_append_u32(binary_output_t* output, uint32_t x) { buf_append(output, &x, sizeof(uint32_t)); }
+
+// unsigned LEB128: 7 bits per byte from the lowest ones, the highest bit is set in all bytes but the last
+static size_t varint_length(uint64_t x) {
+	size_t len = 1;
+	while (x >= 0x80) {
+		x >>= 7;
+		++len;
+	}
+	return len;
+}
+
+static void buf_append_varint(binary_output_t* output, uint64_t x) {
+	buf_reserve(output, 10);
+	while (x >= 0x80) {
+		output->buf[output->buf_len++] = (char)(x | 0x80);
+		x >>= 7;
+	}
+	output->buf[output->buf_len++] = (char)x;
+}
+
+static void buf_append_record_header(binary_output_t* output, char type, uint64_t size) {
+	buf_append(output, &type, 1);
+	buf_append_varint(output, size);
+}
+
+static uint32_t hash_nodes(const int32_t* nodes, int nodes_cnt) {
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ nodes_cnt;
+	int i;
+	for (i = 0; i < nodes_cnt; ++i) {
+		h = (h ^ (uint32_t)nodes[i]) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	return (uint32_t)h;
+}
+
+static int set_equals(const binary_output_t* output, uint32_t id, const int32_t* nodes, int nodes_cnt) {
+	size_t begin = output->set_offsets[id - 2], end = output->set_offsets[id - 1];
+	return end - begin == (size_t)nodes_cnt && memcmp(output->set_nodes + begin, nodes, nodes_cnt * sizeof(int32_t)) == 0;
+}
+
+static void table_insert(binary_output_t* output, uint32_t id) {
+	size_t begin = output->set_offsets[id - 2];
+	uint32_t mask = output->table_capacity - 1;
+	uint32_t i = hash_nodes(output->set_nodes + begin, output->set_offsets[id - 1] - begin) & mask;
+	while (output->table[i]) {
+		i = (i + 1) & mask;
+	}
+	output->table[i] = id;
+}
+
+// returns the ID of the node set, a new set is added to the dictionary and its record is written
+static uint32_t node_set_id(binary_output_t* output, const int32_t* nodes, int nodes_cnt) {
+	if (nodes_cnt == 0) {
+		return BINARY_OUTPUT_EMPTY_SET;
+	}
+	uint32_t mask = output->table_capacity - 1;
+	uint32_t i = hash_nodes(nodes, nodes_cnt) & mask;
+	while (output->table[i]) {
+		if (set_equals(output, output->table[i], nodes, nodes_cnt)) {
+			return output->table[i];
+		}
+		i = (i + 1) & mask;
+	}
+	if (output->sets_cnt == output->sets_capacity) {
+		output->sets_capacity *= 2;
+		output->set_offsets = realloc(output->set_offsets, (output->sets_capacity + 1) * sizeof(size_t));
+	}
+	if (output->set_nodes_cnt + nodes_cnt > output->set_nodes_capacity) {
+		while (output->set_nodes_cnt + nodes_cnt > output->set_nodes_capacity) {
+			output->set_nodes_capacity *= 2;
+		}
+		output->set_nodes = realloc(output->set_nodes, output->set_nodes_capacity * sizeof(int32_t));
+	}
+	memcpy(output->set_nodes + output->set_nodes_cnt, nodes, nodes_cnt * sizeof(int32_t));
+	output->set_nodes_cnt += nodes_cnt;
+	output->set_offsets[++output->sets_cnt] = output->set_nodes_cnt;
+	uint32_t id = output->sets_cnt + 1;
+	output->table[i] = id;
+	// the table is kept at most half full
+	if (2 * output->sets_cnt > output->table_capacity) {
+		free(output->table);
+		output->table_capacity *= 2;
+		output->table = calloc(output->table_capacity, sizeof(uint32_t));
+		uint32_t set_id;
+		for (set_id = 2; set_id <= id; ++set_id) {
+			table_insert(output, set_id);
+		}
+	}
+	// the nodes are sorted, so they are stored as differences from the previous ones
+	size_t size = varint_length(nodes_cnt);
+	int j;
+	for (j = 0; j < nodes_cnt; ++j) {
+		size += varint_length(nodes[j] - (j > 0 ? nodes[j - 1] : 0));
+	}
+	buf_append_record_header(output, 'S', size);
+	buf_append_varint(output, nodes_cnt);
+	for (j = 0; j < nodes_cnt; ++j) {
+		buf_append_varint(output, nodes[j] - (j > 0 ? nodes[j - 1] : 0));
+	}
+	return id;
+}
+
+binary_output_t* binary_output_init(FILE* out, int with_names, int kmer_length) {
+	binary_output_t* output = calloc(1, sizeof(binary_output_t));
+	output->out = out;
+	output->with_names = with_names;
+	output->sets_capacity = 1024;
+	output->set_offsets = malloc((output->sets_capacity + 1) * sizeof(size_t));
+	output->set_offsets[0] = 0;
+	output->set_nodes_capacity = 1024;
+	output->set_nodes = malloc(output->set_nodes_capacity * sizeof(int32_t));
+	output->table_capacity = 2048;
+	output->table = calloc(output->table_capacity, sizeof(uint32_t));
+	buf_append(output, BINARY_OUTPUT_MAGIC, 8);
+	buf_append_u32(output, with_names ? BINARY_OUTPUT_NAMES : 0);
+	buf_append_u32(output, kmer_length);
+	int nodes_cnt = get_nodes_count();
+	buf_append_u32(output, nodes_cnt);
+	int node;
+	for (node = 0; node < nodes_cnt; ++node) {
+		buf_append(output, get_node_name(node), get_node_name_length(node) + 1);
+	}
+	return output;
+}
+
+void binary_output_read(binary_output_t* output, const char* name, int l_seq, const read_streaks_t* streaks) {
+	// the sets are looked up first, so that the records of new ones precede the record of the read
+	uint32_t* ids = malloc((streaks->cnt + 1) * sizeof(uint32_t));
+	int i;
+	for (i = 0; i < streaks->cnt; ++i) {
+		if (streaks->is_ambiguous[i]) {
+			ids[i] = BINARY_OUTPUT_AMBIGUOUS_SET;
+		} else {
+			ids[i] = node_set_id(output, streaks->nodes + streaks->offsets[i], streaks->offsets[i + 1] - streaks->offsets[i]);
+		}
+	}
+	size_t name_len = output->with_names ? strlen(name) : 0;
+	size_t size = varint_length(l_seq) + varint_length(streaks->cnt);
+	for (i = 0; i < streaks->cnt; ++i) {
+		size += varint_length(ids[i]) + varint_length(streaks->kmers_cnts[i]);
+	}
+	if (output->with_names) {
+		size += varint_length(name_len) + name_len;
+	}
+	buf_append_record_header(output, 'R', size);
+	buf_append_varint(output, l_seq);
+	buf_append_varint(output, streaks->cnt);
+	// streaks are stored from the end of the read
+	for (i = streaks->cnt - 1; i >= 0; --i) {
+		buf_append_varint(output, ids[i]);
+		buf_append_varint(output, streaks->kmers_cnts[i]);
+	}
+	if (output->with_names) {
+		buf_append_varint(output, name_len);
+		buf_append(output, name, name_len);
+	}
+	free(ids);
+}
+
+void binary_output_flush(binary_output_t* output) {
+	fwrite(output->buf, 1, output->buf_len, output->out);
+	output->buf_len = 0;
+}
+
+void binary_output_destroy(binary_output_t* output) {
+	binary_output_flush(output);
+	free(output->set_nodes);
+	free(output->set_offsets);
+	free(output->table);
+	free(output->buf);
+	free(output);
+}
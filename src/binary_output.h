@@ -0,0 +1,72 @@
+/*
+    Binary output of query (query -B): a record per read with node-set IDs and lengths of its streaks, node sets are
+    written once to a dictionary interleaved with the reads.
+    Licence: MIT
+
+    The stream starts with a header of little-endian integers:
+        char[8] magic "PXSTR001", uint32 flags (bit 0: reads have names), int32 k, int32 number of nodes n,
+        n zero-terminated node names (node i is the i-th of them).
+    Records follow, each is a type byte, the payload size and the payload; all their numbers are unsigned LEB128 varints:
+        'S' node set, it gets the next free ID (starting from 2): number of nodes m, the first node and the differences
+            of the m - 1 next ones from their predecessors (the nodes are sorted);
+        'R' read: read length, number of streaks s, (node-set ID, number of k-mers)[s] and, with names, the name length and
+            the name (not zero-terminated).
+    Node set 0 is the empty one (0 in the text output) and 1 marks k-mers with an ambiguous base (A in the text output).
+    Every node set is written before the first read using it. A read shorter than k has no streaks (0:0 in the text output).
+    Readers should skip records of unknown types.
+*/
+
+#ifndef BINARY_OUTPUT_H
+#define BINARY_OUTPUT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define BINARY_OUTPUT_MAGIC "PXSTR001"
+#define BINARY_OUTPUT_NAMES 0x1
+#define BINARY_OUTPUT_EMPTY_SET 0
+#define BINARY_OUTPUT_AMBIGUOUS_SET 1
+
+// streaks of one read, in the order they are built (from the end of the read): streak i has kmers_cnts[i] k-mers with
+// the nodes nodes[offsets[i]], ..., nodes[offsets[i + 1] - 1], or an ambiguous base if is_ambiguous[i]
+typedef struct {
+	int32_t* nodes;
+	size_t nodes_cnt;
+	size_t nodes_capacity;
+	size_t* offsets;
+	int32_t* kmers_cnts;
+	int8_t* is_ambiguous;
+	int cnt;
+	int capacity;
+} read_streaks_t;
+
+void read_streaks_clear(read_streaks_t* streaks);
+void read_streaks_add(read_streaks_t* streaks, const int32_t* nodes, int nodes_cnt, int kmers_cnt, int is_ambiguous);
+void read_streaks_destroy(read_streaks_t* streaks);
+
+typedef struct {
+	FILE* out;
+	int with_names;
+	// node sets of the dictionary, set i has ID i + 2 and the nodes set_nodes[set_offsets[i]], ..., set_nodes[set_offsets[i + 1] - 1]
+	int32_t* set_nodes;
+	size_t set_nodes_cnt;
+	size_t set_nodes_capacity;
+	size_t* set_offsets;
+	uint32_t sets_cnt;
+	uint32_t sets_capacity;
+	// open addressing hash table of the sets, holds their IDs (0 for free cells)
+	uint32_t* table;
+	uint32_t table_capacity;
+	// records of the reads written since the last flush
+	char* buf;
+	size_t buf_len;
+	size_t buf_capacity;
+} binary_output_t;
+
+// writes the header of the stream
+binary_output_t* binary_output_init(FILE* out, int with_names, int kmer_length);
+void binary_output_read(binary_output_t* output, const char* name, int l_seq, const read_streaks_t* streaks);
+void binary_output_flush(binary_output_t* output);
+void binary_output_destroy(binary_output_t* output);
+
+#endif  // BINARY_OUTPUT_H
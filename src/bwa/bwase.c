@@ -111,10 +111,13 @@ int bwa_approx_mapQ(const bwa_seq_t *p, int mm)
 
 bwtint_t bwa_sa2pos(const bntseq_t *bns, const bwt_t *bwt, bwtint_t sapos, int ref_len, int *strand)
 {
-	bwtint_t pos_f;
+	return bwa_sa_value2pos(bns, bwt_sa(bwt, sapos), ref_len, strand); // position on the forward-reverse coordinate
+}
+
+bwtint_t bwa_sa_value2pos(const bntseq_t *bns, bwtint_t pos_f, int ref_len, int *strand)
+{
 	int is_rev;
 	*strand = 0; // initialise strand to 0 otherwise we could return without setting it
-	pos_f = bwt_sa(bwt, sapos); // position on the forward-reverse coordinate
 	if (pos_f < bns->l_pac && bns->l_pac < pos_f + ref_len) return (bwtint_t)-1;
 	pos_f = bns_depos(bns, pos_f, &is_rev); // position on the forward strand; this may be the first base or the last base
 	*strand = !is_rev;
@@ -21,6 +21,8 @@ extern "C" {
 	int64_t pos_end(const bwa_seq_t *p);
 	//
 	bwtint_t bwa_sa2pos(const bntseq_t *bns, const bwt_t *bwt, bwtint_t sapos, int len, int *strand);
+	// the same for the SA value of the row, on the forward-reverse coordinate
+	bwtint_t bwa_sa_value2pos(const bntseq_t *bns, bwtint_t pos_f, int len, int *strand);
 
 #ifdef __cplusplus
 }
@@ -50,14 +50,107 @@ void bwt_gen_cnt_table(bwt_t *bwt)
 	}
 }
 
+/**************************
+ * Run-length encoded BWT *
+ **************************/
+
+bwt_rl_t *bwt_rl_build(const bwt_t *bwt)
+{
+	bwt_rl_t *rl = (bwt_rl_t*)calloc(1, sizeof(bwt_rl_t));
+	bwtint_t i, m = 0, *starts = 0;
+	for (i = 0; i < bwt->seq_len; ++i) {
+		if (i == 0 || bwt_B0(bwt, i) != bwt_B0(bwt, i - 1)) {
+			if (rl->n_runs == m) {
+				m = m? m << 1 : 1024;
+				starts = (bwtint_t*)realloc(starts, (m + 1) * sizeof(bwtint_t));
+				rl->chars = (uint8_t*)realloc(rl->chars, (m + 3) >> 2);
+				memset(rl->chars + ((rl->n_runs + 3) >> 2), 0, ((m + 3) >> 2) - ((rl->n_runs + 3) >> 2));
+			}
+			starts[rl->n_runs] = i;
+			rl->chars[rl->n_runs >> 2] |= bwt_B0(bwt, i) << ((rl->n_runs & 3) << 1);
+			++rl->n_runs;
+		}
+	}
+	if (starts == 0) starts = (bwtint_t*)malloc(sizeof(bwtint_t));
+	starts[rl->n_runs] = bwt->seq_len;
+	rl->rl32 = bwt->seq_len < UINT32_MAX;
+	if (rl->rl32) { // narrowed in place
+		uint32_t *starts32 = (uint32_t*)starts;
+		for (i = 0; i <= rl->n_runs; ++i) starts32[i] = starts[i];
+	}
+	rl->starts = starts;
+	return rl;
+}
+
+void bwt_rl_index(bwt_rl_t *rl, bwtint_t seq_len)
+{
+	bwtint_t r, i, c[4] = {0, 0, 0, 0};
+	int j;
+	for (r = 0; r < rl->n_runs; ++r) {
+		if ((r & ((1U<<RLBWT_CNT_SHIFT) - 1)) == 0) {
+			for (j = 0; j < 4; ++j) {
+				if (rl->rl32) ((uint32_t*)rl->cnt)[(r >> RLBWT_CNT_SHIFT) * 4 + j] = c[j];
+				else ((bwtint_t*)rl->cnt)[(r >> RLBWT_CNT_SHIFT) * 4 + j] = c[j];
+			}
+		}
+		c[bwt_rl_char(rl, r)] += bwt_rl_start(rl, r+1) - bwt_rl_start(rl, r);
+	}
+	for (i = r = 0; i < (seq_len >> RLBWT_DIR_SHIFT) + 1; ++i) {
+		while (r + 1 < rl->n_runs && bwt_rl_start(rl, r+1) <= i << RLBWT_DIR_SHIFT) ++r;
+		rl->dir[i] = r;
+	}
+	rl->dir[i] = rl->n_runs;
+}
+
+// the run containing position k of the $-removed BWT
+static inline bwtint_t bwt_rl_run(const bwt_rl_t *rl, bwtint_t k)
+{
+	// the runs containing the sampled positions around k, the last one is n_runs for the end of the BWT
+	bwtint_t lo = rl->dir[k >> RLBWT_DIR_SHIFT], hi = rl->dir[(k >> RLBWT_DIR_SHIFT) + 1];
+	while (lo < hi) {
+		bwtint_t mid = (lo + hi + 1) >> 1;
+		if (bwt_rl_start(rl, mid) <= k) lo = mid;
+		else hi = mid - 1;
+	}
+	return lo;
+}
+
+// occurrences of the four characters up to position k of the $-removed BWT, inclusive
+static inline void bwt_rl_occ4(const bwt_rl_t *rl, bwtint_t k, bwtint_t cnt[4])
+{
+	bwtint_t run = bwt_rl_run(rl, k), r;
+	int j;
+	for (j = 0; j < 4; ++j) cnt[j] = bwt_rl_cnt(rl, (run >> RLBWT_CNT_SHIFT) * 4 + j);
+	for (r = run >> RLBWT_CNT_SHIFT << RLBWT_CNT_SHIFT; r < run; ++r)
+		cnt[bwt_rl_char(rl, r)] += bwt_rl_start(rl, r+1) - bwt_rl_start(rl, r);
+	cnt[bwt_rl_char(rl, run)] += k - bwt_rl_start(rl, run) + 1;
+}
+
+static inline bwtint_t bwt_rl_occ(const bwt_rl_t *rl, bwtint_t k, ubyte_t c)
+{
+	bwtint_t run = bwt_rl_run(rl, k), r, n = bwt_rl_cnt(rl, (run >> RLBWT_CNT_SHIFT) * 4 + c);
+	for (r = run >> RLBWT_CNT_SHIFT << RLBWT_CNT_SHIFT; r < run; ++r)
+		if (bwt_rl_char(rl, r) == c) n += bwt_rl_start(rl, r+1) - bwt_rl_start(rl, r);
+	return bwt_rl_char(rl, run) == c? n + k - bwt_rl_start(rl, run) + 1 : n;
+}
+
 static inline bwtint_t bwt_invPsi(const bwt_t *bwt, bwtint_t k) // compute inverse CSA
 {
 	bwtint_t x = k - (k > bwt->primary);
-	x = bwt_B0(bwt, x);
+	x = bwt->rl? bwt_rl_char(bwt->rl, bwt_rl_run(bwt->rl, x)) : bwt_B0(bwt, x);
 	x = bwt->L2[x] + bwt_occ(bwt, k, x);
 	return k == bwt->primary? 0 : x;
 }
 
+// number of marked rows before row k
+static inline bwtint_t bwt_sa_rank(const uint64_t *m, bwtint_t k)
+{
+	const uint64_t *p = m + (k>>8) * 5;
+	bwtint_t r = p[0], j, w = k>>6 & 3;
+	for (j = 0; j < w; ++j) r += __builtin_popcountll(p[1 + j]);
+	return r + __builtin_popcountll(p[1 + w] & ((1ULL << (k & 63)) - 1));
+}
+
 // bwt->bwt and bwt->occ must be precalculated
 void bwt_cal_sa(bwt_t *bwt, int intv)
 {
@@ -83,49 +176,408 @@ void bwt_cal_sa(bwt_t *bwt, int intv)
 	bwt->sa[0] = (bwtint_t)-1; // before this line, bwt->sa[0] = bwt->seq_len
 }
 
-bwtint_t bwt_sa(const bwt_t *bwt, bwtint_t k)
+// samples rows whose SA value is a multiple of intv, so that any row is at most intv - 1 LF steps from a sample
+void bwt_cal_sa_text_order(bwt_t *bwt, int intv)
+{
+	bwtint_t isa, sa, i, n = 0, n_rows = bwt->seq_len + 1, *rows, *values;
+	xassert(bwt->bwt || bwt->rl, "bwt_t::bwt is not initialized.");
+
+	if (bwt->sa) free(bwt->sa);
+	if (bwt->sa_marks) free(bwt->sa_marks);
+	bwt->sa_intv = intv;
+	bwt->sa_marks = (uint64_t*)calloc(bwt_sa_marks_words(n_rows), sizeof(uint64_t));
+	// positions 0, intv, ... up to seq_len and the row of seq_len, which is always sampled
+	rows = (bwtint_t*)malloc((bwt->seq_len / intv + 2) * sizeof(bwtint_t));
+	values = (bwtint_t*)malloc((bwt->seq_len / intv + 2) * sizeof(bwtint_t));
+	isa = 0; sa = bwt->seq_len;
+	for (i = 0; i < n_rows; ++i) {
+		if (isa == 0 || sa % intv == 0) {
+			bwt->sa_marks[(isa>>8) * 5 + 1 + (isa>>6 & 3)] |= 1ULL << (isa & 63);
+			rows[n] = isa; values[n++] = sa;
+		}
+		--sa;
+		isa = bwt_invPsi(bwt, isa);
+	}
+	for (i = 0, sa = 0; i < bwt_sa_marks_words(n_rows); i += 5) {
+		bwt->sa_marks[i] = sa;
+		sa += __builtin_popcountll(bwt->sa_marks[i + 1]) + __builtin_popcountll(bwt->sa_marks[i + 2])
+			+ __builtin_popcountll(bwt->sa_marks[i + 3]) + __builtin_popcountll(bwt->sa_marks[i + 4]);
+	}
+	bwt->n_sa = n;
+	bwt->sa = (bwtint_t*)malloc(n * sizeof(bwtint_t));
+	for (i = 0; i < n; ++i)
+		bwt->sa[bwt_sa_rank(bwt->sa_marks, rows[i])] = values[i];
+	bwt->sa[0] = (bwtint_t)-1; // the row of seq_len is the first marked one
+	free(rows); free(values);
+}
+
+// value of the j-th SA sample
+static inline bwtint_t bwt_sa_value(const bwt_t *bwt, bwtint_t j)
+{
+	/* without setting bwt->sa[0] = -1, the SA value of a row should be
+	   (steps + bwt->sa[j]) % (bwt->seq_len + 1) */
+	if (bwt->sa_width) {
+		// the sample may span two words, the second shift is split so that it is not by 64 bits for an aligned sample
+		bwtint_t bit = j * bwt->sa_width;
+		const uint64_t *p = (const uint64_t*)bwt->sa + (bit >> 6);
+		uint64_t x = (p[0] >> (bit & 63) | p[1] << 1 << (63 - (bit & 63))) & ((1ULL << bwt->sa_width) - 1);
+		return x - 1;
+	}
+	if (bwt->sa32) {
+		uint32_t x = ((const uint32_t*)bwt->sa)[j];
+		return x == UINT32_MAX? (bwtint_t)-1 : x;
+	}
+	return bwt->sa[j];
+}
+
+bwtint_t bwt_sa_sample(const bwt_t *bwt, bwtint_t j)
+{
+	return bwt_sa_value(bwt, j);
+}
+
+bwtint_t bwt_sa_sampled(const bwt_t *bwt, bwtint_t k, bwtint_t *j)
 {
 	bwtint_t sa = 0, mask = bwt->sa_intv - 1;
-	while (k & mask) {
-		++sa;
-		k = bwt_invPsi(bwt, k);
+	if (bwt->sa_marks) {
+		while (!bwt_sa_marked(bwt->sa_marks, k)) {
+			++sa;
+			k = bwt_invPsi(bwt, k);
+		}
+		*j = bwt_sa_rank(bwt->sa_marks, k);
+	} else {
+		while (k & mask) {
+			++sa;
+			k = bwt_invPsi(bwt, k);
+		}
+		*j = k / bwt->sa_intv;
 	}
-	/* without setting bwt->sa[0] = -1, the following line should be
-	   changed to (sa + bwt->sa[k/bwt->sa_intv]) % (bwt->seq_len + 1) */
-	return sa + bwt->sa[k/bwt->sa_intv];
+	return sa + bwt_sa_value(bwt, *j);
+}
+
+bwtint_t bwt_sa(const bwt_t *bwt, bwtint_t k)
+{
+	bwtint_t j;
+	return bwt_sa_sampled(bwt, k, &j);
 }
 
+// fetches what the next LF step from row k and the check whether k is sampled will read
+static inline void bwt_sa_prefetch_step(const bwt_t *bwt, bwtint_t k)
+{
+	if (bwt->sa_marks) __builtin_prefetch(&bwt->sa_marks[(k>>8) * 5]);
+	if (bwt->rl) return;
+	k -= (k > bwt->primary);
+	__builtin_prefetch(bwt_occ_intv(bwt, k));
+	__builtin_prefetch(&bwt_bwt(bwt, k));
+}
+
+static inline void bwt_sa_prefetch_sample(const bwt_t *bwt, bwtint_t j)
+{
+	if (bwt->sa_width) __builtin_prefetch((const uint64_t*)bwt->sa + (j * bwt->sa_width >> 6));
+	else if (bwt->sa32) __builtin_prefetch((const uint32_t*)bwt->sa + j);
+	else __builtin_prefetch(bwt->sa + j);
+}
+
+void bwt_sa_batch(const bwt_t *bwt, bwtint_t k, int n, bwtint_t *sa, bwtint_t *j)
+{
+	bwtint_t mask = bwt->sa_intv - 1, rows[BWT_SA_BATCH];
+	int active[BWT_SA_BATCH], i, a, m, n_rows, n_active, start;
+	for (start = 0; start < n; start += BWT_SA_BATCH) {
+		n_rows = n - start < BWT_SA_BATCH? n - start : BWT_SA_BATCH;
+		for (i = 0; i < n_rows; ++i) {
+			rows[i] = k + start + i;
+			sa[start + i] = 0;
+			active[i] = i;
+			bwt_sa_prefetch_step(bwt, rows[i]);
+		}
+		// every round moves each walk that has not reached a sample by one LF step, the memory accesses of the next
+		// round are requested right after the step, so they are served while the other walks are moved
+		for (n_active = n_rows; n_active > 0;) {
+			for (a = 0, m = 0; a < n_active; ++a) {
+				i = active[a];
+				if (bwt->sa_marks? bwt_sa_marked(bwt->sa_marks, rows[i]) : !(rows[i] & mask)) {
+					j[start + i] = bwt->sa_marks? bwt_sa_rank(bwt->sa_marks, rows[i]) : rows[i] / bwt->sa_intv;
+					bwt_sa_prefetch_sample(bwt, j[start + i]);
+					continue;
+				}
+				++sa[start + i];
+				rows[i] = bwt_invPsi(bwt, rows[i]);
+				bwt_sa_prefetch_step(bwt, rows[i]);
+				active[m++] = i;
+			}
+			n_active = m;
+		}
+	}
+	for (i = 0; i < n; ++i)
+		sa[i] += bwt_sa_value(bwt, j[i]);
+}
+
+/************************
+ * Occ counting kernels *
+ ************************/
+
+/* A kernel counts the occurrences of c, or of all four characters, among the first n characters of the BWT
+ * words starting at p, where 0 < n <= the length of an Occ block. The scalar kernels are the original BWA bit
+ * tricks; the others are selected by bwt_occ_set_kernel() according to the CPU features. */
+typedef bwtint_t (*occ_count_f)(const bwt_t *bwt, const uint32_t *p, bwtint_t n, ubyte_t c);
+typedef void (*occ_count4_f)(const bwt_t *bwt, const uint32_t *p, bwtint_t n, bwtint_t cnt[4]);
+
+// bits 0, 2, 4, ... of the result are set where a 2-bit character of y equals c
+#define __occ_match(y, c, ones) (((c)&2? (y) : ~(y)) >> 1 & ((c)&1? (y) : ~(y)) & (ones))
+
 static inline int __occ_aux(uint64_t y, int c)
 {
 	// reduce nucleotide counting to bits counting
-	y = ((c&2)? y : ~y) >> 1 & ((c&1)? y : ~y) & 0x5555555555555555ull;
+	y = __occ_match(y, c, 0x5555555555555555ull);
 	// count the number of 1s in y
 	y = (y & 0x3333333333333333ull) + (y >> 2 & 0x3333333333333333ull);
 	return ((y + (y >> 4)) & 0xf0f0f0f0f0f0f0full) * 0x101010101010101ull >> 56;
 }
 
+static bwtint_t occ_count_scalar(const bwt_t *bwt, const uint32_t *p, bwtint_t n, ubyte_t c)
+{
+	bwtint_t cnt = 0;
+	const uint32_t *end = p + ((n - 1) >> 5 << 1);
+	for (; p < end; p += 2) cnt += __occ_aux((uint64_t)p[0]<<32 | p[1], c);
+	cnt += __occ_aux(((uint64_t)p[0]<<32 | p[1]) & ~((1ull<<((-n&31)<<1)) - 1), c);
+	if (c == 0) cnt -= -n&31; // corrected for the masked bits
+	return cnt;
+}
+
+#define __occ_aux4(bwt, b)											\
+	((bwt)->cnt_table[(b)&0xff] + (bwt)->cnt_table[(b)>>8&0xff]		\
+	 + (bwt)->cnt_table[(b)>>16&0xff] + (bwt)->cnt_table[(b)>>24])
+
+#define __occ_add4(cnt, x) ((cnt)[0] += (x)&0xff, (cnt)[1] += (x)>>8&0xff, (cnt)[2] += (x)>>16&0xff, (cnt)[3] += (x)>>24&0xff)
+
+static void occ_count4_scalar(const bwt_t *bwt, const uint32_t *p, bwtint_t n, bwtint_t cnt[4])
+{
+	bwtint_t x = 0;
+	uint32_t tmp;
+	const uint32_t *end = p + ((n - 1) >> 4);
+	int i = 0;
+	for (; p < end; ++p) {
+		x += __occ_aux4(bwt, *p);
+		if (++i == 8) { // flush the 8-bit counters before they can overflow in blocks longer than 128
+			__occ_add4(cnt, x);
+			x = 0; i = 0;
+		}
+	}
+	tmp = *p & ~((1U<<((-n&15)<<1)) - 1);
+	x += __occ_aux4(bwt, tmp) - (-n&15);
+	__occ_add4(cnt, x);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BWT_OCC_X86
+
+__attribute__((target("popcnt")))
+static bwtint_t occ_count_popcnt(const bwt_t *bwt, const uint32_t *p, bwtint_t n, ubyte_t c)
+{
+	bwtint_t cnt = 0;
+	uint64_t y;
+	const uint32_t *end = p + ((n - 1) >> 5 << 1);
+	for (; p < end; p += 2) {
+		y = (uint64_t)p[0]<<32 | p[1];
+		cnt += __builtin_popcountll(__occ_match(y, c, 0x5555555555555555ull));
+	}
+	y = (uint64_t)p[0]<<32 | p[1];
+	return cnt + __builtin_popcountll(__occ_match(y, c, 0x5555555555555555ull) & ~((1ull<<((-n&31)<<1)) - 1));
+}
+
+__attribute__((target("popcnt")))
+static void occ_count4_popcnt(const bwt_t *bwt, const uint32_t *p, bwtint_t n, bwtint_t cnt[4])
+{
+	uint64_t y, mask = ~0ull;
+	const uint32_t *end = p + ((n - 1) >> 5 << 1);
+	for (; p <= end; p += 2) {
+		if (p == end) mask = ~((1ull<<((-n&31)<<1)) - 1);
+		y = (uint64_t)p[0]<<32 | p[1];
+		cnt[0] += __builtin_popcountll(__occ_match(y, 0, mask & 0x5555555555555555ull));
+		cnt[1] += __builtin_popcountll(__occ_match(y, 1, mask & 0x5555555555555555ull));
+		cnt[2] += __builtin_popcountll(__occ_match(y, 2, mask & 0x5555555555555555ull));
+		cnt[3] += __builtin_popcountll(__occ_match(y, 3, mask & 0x5555555555555555ull));
+	}
+}
+
+/* The vector kernels take 8 (AVX2) or 16 (AVX-512) BWT words at a time, each lane of 32 bits holding 16
+ * characters. Lanes past the n-th character are neither loaded nor counted, so reads stay within the block. */
+
+__attribute__((target("avx2")))
+static inline __m256i occ_popcnt8_avx2(__m256i v)
+{ // number of set bits in every byte
+	const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0f);
+	return _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(v, low)), _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i occ_lanes_avx2(bwtint_t n, __m256i *load_mask)
+{ // bit masks of the characters to count in each lane, out of the first n
+	const __m256i first = _mm256_setr_epi32(0, 16, 32, 48, 64, 80, 96, 112);
+	__m256i t = _mm256_sub_epi32(_mm256_set1_epi32(n < 128? (int)n : 128), first);
+	t = _mm256_min_epi32(_mm256_max_epi32(t, _mm256_setzero_si256()), _mm256_set1_epi32(16));
+	*load_mask = _mm256_cmpgt_epi32(t, _mm256_setzero_si256());
+	return _mm256_sllv_epi32(_mm256_set1_epi32(-1), _mm256_slli_epi32(_mm256_sub_epi32(_mm256_set1_epi32(16), t), 1));
+}
+
+__attribute__((target("avx2")))
+static inline bwtint_t occ_hsum_avx2(__m256i acc)
+{
+	__m128i x = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	return _mm_cvtsi128_si64(x) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(x, x));
+}
+
+__attribute__((target("avx2")))
+static bwtint_t occ_count_avx2(const bwt_t *bwt, const uint32_t *p, bwtint_t n, ubyte_t c)
+{
+	const __m256i ones = _mm256_set1_epi32(0x55555555), zero = _mm256_setzero_si256();
+	__m256i acc = zero;
+	for (;; p += 8, n -= 128) {
+		__m256i load_mask, mask = occ_lanes_avx2(n, &load_mask);
+		__m256i v = _mm256_maskload_epi32((const int*)p, load_mask);
+		__m256i m = _mm256_and_si256(__occ_match(v, c, ones), mask);
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(occ_popcnt8_avx2(m), zero));
+		if (n <= 128) break;
+	}
+	return occ_hsum_avx2(acc);
+}
+
+__attribute__((target("avx2")))
+static void occ_count4_avx2(const bwt_t *bwt, const uint32_t *p, bwtint_t n, bwtint_t cnt[4])
+{
+	const __m256i ones = _mm256_set1_epi32(0x55555555), zero = _mm256_setzero_si256();
+	__m256i acc[4] = {zero, zero, zero, zero};
+	int c;
+	for (;; p += 8, n -= 128) {
+		__m256i load_mask, mask = occ_lanes_avx2(n, &load_mask);
+		__m256i v = _mm256_maskload_epi32((const int*)p, load_mask);
+		__m256i hi = _mm256_srli_epi32(v, 1), nv = _mm256_xor_si256(v, _mm256_set1_epi32(-1)), nhi = _mm256_srli_epi32(nv, 1);
+		__m256i m[4];
+		m[0] = _mm256_and_si256(nhi, nv); m[1] = _mm256_and_si256(nhi, v);
+		m[2] = _mm256_and_si256(hi, nv);  m[3] = _mm256_and_si256(hi, v);
+		for (c = 0; c < 4; ++c)
+			acc[c] = _mm256_add_epi64(acc[c], _mm256_sad_epu8(occ_popcnt8_avx2(_mm256_and_si256(_mm256_and_si256(m[c], ones), mask)), zero));
+		if (n <= 128) break;
+	}
+	for (c = 0; c < 4; ++c) cnt[c] += occ_hsum_avx2(acc[c]);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i occ_popcnt8_avx512(__m512i v)
+{ // number of set bits in every byte
+	const __m512i lut = _mm512_broadcast_i32x4(_mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4));
+	const __m512i low = _mm512_set1_epi8(0x0f);
+	return _mm512_add_epi8(_mm512_shuffle_epi8(lut, _mm512_and_si512(v, low)), _mm512_shuffle_epi8(lut, _mm512_and_si512(_mm512_srli_epi16(v, 4), low)));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i occ_lanes_avx512(bwtint_t n, __mmask16 *load_mask)
+{ // bit masks of the characters to count in each lane, out of the first n
+	const __m512i first = _mm512_setr_epi32(0, 16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240);
+	__m512i t = _mm512_sub_epi32(_mm512_set1_epi32(n < 256? (int)n : 256), first);
+	t = _mm512_min_epi32(_mm512_max_epi32(t, _mm512_setzero_si512()), _mm512_set1_epi32(16));
+	*load_mask = _mm512_cmpgt_epi32_mask(t, _mm512_setzero_si512());
+	return _mm512_sllv_epi32(_mm512_set1_epi32(-1), _mm512_slli_epi32(_mm512_sub_epi32(_mm512_set1_epi32(16), t), 1));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static bwtint_t occ_count_avx512(const bwt_t *bwt, const uint32_t *p, bwtint_t n, ubyte_t c)
+{
+	const __m512i ones = _mm512_set1_epi32(0x55555555), zero = _mm512_setzero_si512();
+	__m512i acc = zero;
+	for (;; p += 16, n -= 256) {
+		__mmask16 load_mask;
+		__m512i mask = occ_lanes_avx512(n, &load_mask);
+		__m512i v = _mm512_maskz_loadu_epi32(load_mask, p);
+		__m512i m = _mm512_and_si512(__occ_match(v, c, ones), mask);
+		acc = _mm512_add_epi64(acc, _mm512_sad_epu8(occ_popcnt8_avx512(m), zero));
+		if (n <= 256) break;
+	}
+	return _mm512_reduce_add_epi64(acc);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void occ_count4_avx512(const bwt_t *bwt, const uint32_t *p, bwtint_t n, bwtint_t cnt[4])
+{
+	const __m512i ones = _mm512_set1_epi32(0x55555555), zero = _mm512_setzero_si512();
+	__m512i acc[4] = {zero, zero, zero, zero};
+	int c;
+	for (;; p += 16, n -= 256) {
+		__mmask16 load_mask;
+		__m512i mask = occ_lanes_avx512(n, &load_mask);
+		__m512i v = _mm512_maskz_loadu_epi32(load_mask, p);
+		__m512i hi = _mm512_srli_epi32(v, 1), nv = _mm512_xor_si512(v, _mm512_set1_epi32(-1)), nhi = _mm512_srli_epi32(nv, 1);
+		__m512i m[4];
+		m[0] = _mm512_and_si512(nhi, nv); m[1] = _mm512_and_si512(nhi, v);
+		m[2] = _mm512_and_si512(hi, nv);  m[3] = _mm512_and_si512(hi, v);
+		for (c = 0; c < 4; ++c)
+			acc[c] = _mm512_add_epi64(acc[c], _mm512_sad_epu8(occ_popcnt8_avx512(_mm512_and_si512(_mm512_and_si512(m[c], ones), mask)), zero));
+		if (n <= 256) break;
+	}
+	for (c = 0; c < 4; ++c) cnt[c] += _mm512_reduce_add_epi64(acc[c]);
+}
+#endif
+
+typedef struct {
+	const char *name;
+	occ_count_f count;
+	occ_count4_f count4;
+} occ_kernel_t;
+
+/* From the most preferred one. Blocks of at most 512 characters are too short for the vector kernels to pay
+ * off in the memory-bound backward search, so they are used only on request. */
+static const occ_kernel_t occ_kernels[] = {
+#ifdef BWT_OCC_X86
+	{ "popcnt", occ_count_popcnt, occ_count4_popcnt },
+	{ "avx2", occ_count_avx2, occ_count4_avx2 },
+	{ "avx512", occ_count_avx512, occ_count4_avx512 },
+#endif
+	{ "scalar", occ_count_scalar, occ_count4_scalar },
+};
+
+static const occ_kernel_t *occ_kernel = &occ_kernels[sizeof(occ_kernels) / sizeof(occ_kernel_t) - 1];
+
+static int occ_kernel_supported(const occ_kernel_t *kernel)
+{
+#ifdef BWT_OCC_X86
+	__builtin_cpu_init();
+	if (strcmp(kernel->name, "avx512") == 0) return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+	if (strcmp(kernel->name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+	if (strcmp(kernel->name, "popcnt") == 0) return __builtin_cpu_supports("popcnt");
+#endif
+	return 1;
+}
+
+int bwt_occ_set_kernel(const char *name)
+{
+	int i, n = sizeof(occ_kernels) / sizeof(occ_kernel_t);
+	for (i = 0; i < n; ++i) {
+		if (name && strcmp(occ_kernels[i].name, name) != 0) continue;
+		if (!occ_kernel_supported(&occ_kernels[i])) continue;
+		occ_kernel = &occ_kernels[i];
+		return 0;
+	}
+	return -1;
+}
+
+const char *bwt_occ_kernel_name(void)
+{
+	return occ_kernel->name;
+}
+
 bwtint_t bwt_occ(const bwt_t *bwt, bwtint_t k, ubyte_t c)
 {
-	bwtint_t n;
-	uint32_t *p, *end;
+	uint32_t *p;
 
 	if (k == bwt->seq_len) return bwt->L2[c+1] - bwt->L2[c];
 	if (k == (bwtint_t)(-1)) return 0;
 	k -= (k >= bwt->primary); // because $ is not in bwt
+	if (bwt->rl) return bwt_rl_occ(bwt->rl, k, c);
 
-	// retrieve Occ at k/OCC_INTERVAL
-	n = ((bwtint_t*)(p = bwt_occ_intv(bwt, k)))[c];
-	p += sizeof(bwtint_t); // jump to the start of the first BWT cell
-
-	// calculate Occ up to the last k/32
-	end = p + (((k>>5) - ((k&~OCC_INTV_MASK)>>5))<<1);
-	for (; p < end; p += 2) n += __occ_aux((uint64_t)p[0]<<32 | p[1], c);
-
-	// calculate Occ
-	n += __occ_aux(((uint64_t)p[0]<<32 | p[1]) & ~((1ull<<((~k&31)<<1)) - 1), c);
-	if (c == 0) n -= ~k&31; // corrected for the masked bits
-
-	return n;
+	// Occ at the start of the block of k, plus the occurrences within the block up to k
+	p = bwt_occ_intv(bwt, k);
+	return bwt_occ_cnt(bwt, p, c) + occ_kernel->count(bwt, p + bwt_occ_cnt_words(bwt), (k&bwt_occ_intv_mask(bwt)) + 1, c);
 }
 
 // an analogy to bwt_occ() but more efficient, requiring k <= l
@@ -134,55 +586,35 @@ void bwt_2occ(const bwt_t *bwt, bwtint_t k, bwtint_t l, ubyte_t c, bwtint_t *ok,
 	bwtint_t _k, _l;
 	_k = (k >= bwt->primary)? k-1 : k;
 	_l = (l >= bwt->primary)? l-1 : l;
-	if (_l/OCC_INTERVAL != _k/OCC_INTERVAL || k == (bwtint_t)(-1) || l == (bwtint_t)(-1)) {
+	if (bwt->rl || _l>>bwt->occ_intv_shift != _k>>bwt->occ_intv_shift || k == (bwtint_t)(-1) || l == (bwtint_t)(-1)) {
 		*ok = bwt_occ(bwt, k, c);
 		*ol = bwt_occ(bwt, l, c);
 	} else {
-		bwtint_t m, n, i, j;
+		bwtint_t n;
 		uint32_t *p;
-		if (k >= bwt->primary) --k;
-		if (l >= bwt->primary) --l;
-		n = ((bwtint_t*)(p = bwt_occ_intv(bwt, k)))[c];
-		p += sizeof(bwtint_t);
-		// calculate *ok
-		j = k >> 5 << 5;
-		for (i = k/OCC_INTERVAL*OCC_INTERVAL; i < j; i += 32, p += 2)
-			n += __occ_aux((uint64_t)p[0]<<32 | p[1], c);
-		m = n;
-		n += __occ_aux(((uint64_t)p[0]<<32 | p[1]) & ~((1ull<<((~k&31)<<1)) - 1), c);
-		if (c == 0) n -= ~k&31; // corrected for the masked bits
-		*ok = n;
-		// calculate *ol
-		j = l >> 5 << 5;
-		for (; i < j; i += 32, p += 2)
-			m += __occ_aux((uint64_t)p[0]<<32 | p[1], c);
-		m += __occ_aux(((uint64_t)p[0]<<32 | p[1]) & ~((1ull<<((~l&31)<<1)) - 1), c);
-		if (c == 0) m -= ~l&31; // corrected for the masked bits
-		*ol = m;
+		p = bwt_occ_intv(bwt, _k);
+		n = bwt_occ_cnt(bwt, p, c);
+		p += bwt_occ_cnt_words(bwt);
+		*ok = n + occ_kernel->count(bwt, p, (_k&bwt_occ_intv_mask(bwt)) + 1, c);
+		*ol = n + occ_kernel->count(bwt, p, (_l&bwt_occ_intv_mask(bwt)) + 1, c);
 	}
 }
 
-#define __occ_aux4(bwt, b)											\
-	((bwt)->cnt_table[(b)&0xff] + (bwt)->cnt_table[(b)>>8&0xff]		\
-	 + (bwt)->cnt_table[(b)>>16&0xff] + (bwt)->cnt_table[(b)>>24])
-
 void bwt_occ4(const bwt_t *bwt, bwtint_t k, bwtint_t cnt[4])
 {
-	bwtint_t x;
-	uint32_t *p, tmp, *end;
+	uint32_t *p;
 	if (k == (bwtint_t)(-1)) {
 		memset(cnt, 0, 4 * sizeof(bwtint_t));
 		return;
 	}
 	k -= (k >= bwt->primary); // because $ is not in bwt
+	if (bwt->rl) {
+		bwt_rl_occ4(bwt->rl, k, cnt);
+		return;
+	}
 	p = bwt_occ_intv(bwt, k);
-	memcpy(cnt, p, 4 * sizeof(bwtint_t));
-	p += sizeof(bwtint_t); // sizeof(bwtint_t) = 4*(sizeof(bwtint_t)/sizeof(uint32_t))
-	end = p + ((k>>4) - ((k&~OCC_INTV_MASK)>>4)); // this is the end point of the following loop
-	for (x = 0; p < end; ++p) x += __occ_aux4(bwt, *p);
-	tmp = *p & ~((1U<<((~k&15)<<1)) - 1);
-	x += __occ_aux4(bwt, tmp) - (~k&15);
-	cnt[0] += x&0xff; cnt[1] += x>>8&0xff; cnt[2] += x>>16&0xff; cnt[3] += x>>24;
+	cnt[0] = bwt_occ_cnt(bwt, p, 0); cnt[1] = bwt_occ_cnt(bwt, p, 1); cnt[2] = bwt_occ_cnt(bwt, p, 2); cnt[3] = bwt_occ_cnt(bwt, p, 3);
+	occ_kernel->count4(bwt, p + bwt_occ_cnt_words(bwt), (k&bwt_occ_intv_mask(bwt)) + 1, cnt);
 }
 
 // an analogy to bwt_occ4() but more efficient, requiring k <= l
@@ -191,31 +623,17 @@ void bwt_2occ4(const bwt_t *bwt, bwtint_t k, bwtint_t l, bwtint_t cntk[4], bwtin
 	bwtint_t _k, _l;
 	_k = k - (k >= bwt->primary);
 	_l = l - (l >= bwt->primary);
-	if (_l>>OCC_INTV_SHIFT != _k>>OCC_INTV_SHIFT || k == (bwtint_t)(-1) || l == (bwtint_t)(-1)) {
+	if (bwt->rl || _l>>bwt->occ_intv_shift != _k>>bwt->occ_intv_shift || k == (bwtint_t)(-1) || l == (bwtint_t)(-1)) {
 		bwt_occ4(bwt, k, cntk);
 		bwt_occ4(bwt, l, cntl);
 	} else {
-		bwtint_t x, y;
-		uint32_t *p, tmp, *endk, *endl;
-		k -= (k >= bwt->primary); // because $ is not in bwt
-		l -= (l >= bwt->primary);
-		p = bwt_occ_intv(bwt, k);
-		memcpy(cntk, p, 4 * sizeof(bwtint_t));
-		p += sizeof(bwtint_t); // sizeof(bwtint_t) = 4*(sizeof(bwtint_t)/sizeof(uint32_t))
-		// prepare cntk[]
-		endk = p + ((k>>4) - ((k&~OCC_INTV_MASK)>>4));
-		endl = p + ((l>>4) - ((l&~OCC_INTV_MASK)>>4));
-		for (x = 0; p < endk; ++p) x += __occ_aux4(bwt, *p);
-		y = x;
-		tmp = *p & ~((1U<<((~k&15)<<1)) - 1);
-		x += __occ_aux4(bwt, tmp) - (~k&15);
-		// calculate cntl[] and finalize cntk[]
-		for (; p < endl; ++p) y += __occ_aux4(bwt, *p);
-		tmp = *p & ~((1U<<((~l&15)<<1)) - 1);
-		y += __occ_aux4(bwt, tmp) - (~l&15);
+		uint32_t *p;
+		p = bwt_occ_intv(bwt, _k);
+		cntk[0] = bwt_occ_cnt(bwt, p, 0); cntk[1] = bwt_occ_cnt(bwt, p, 1); cntk[2] = bwt_occ_cnt(bwt, p, 2); cntk[3] = bwt_occ_cnt(bwt, p, 3);
 		memcpy(cntl, cntk, 4 * sizeof(bwtint_t));
-		cntk[0] += x&0xff; cntk[1] += x>>8&0xff; cntk[2] += x>>16&0xff; cntk[3] += x>>24;
-		cntl[0] += y&0xff; cntl[1] += y>>8&0xff; cntl[2] += y>>16&0xff; cntl[3] += y>>24;
+		p += bwt_occ_cnt_words(bwt);
+		occ_kernel->count4(bwt, p, (_k&bwt_occ_intv_mask(bwt)) + 1, cntk);
+		occ_kernel->count4(bwt, p, (_l&bwt_occ_intv_mask(bwt)) + 1, cntl);
 	}
 }
 
@@ -455,6 +873,7 @@ bwt_t *bwt_restore_bwt(const char *fn)
 	err_fread_noeof(bwt->L2+1, sizeof(bwtint_t), 4, fp);
 	fread_fix(fp, bwt->bwt_size<<2, bwt->bwt);
 	bwt->seq_len = bwt->L2[4];
+	bwt->occ_intv_shift = OCC_INTV_SHIFT;
 	err_fclose(fp);
 	bwt_gen_cnt_table(bwt);
 
@@ -464,6 +883,6 @@ bwt_t *bwt_restore_bwt(const char *fn)
 void bwt_destroy(bwt_t *bwt)
 {
 	if (bwt == 0) return;
-	free(bwt->sa); free(bwt->bwt);
+	free(bwt->sa); free(bwt->sa_marks); free(bwt->bwt);
 	free(bwt);
 }
@@ -31,7 +31,7 @@
 #include <stdint.h>
 #include <stddef.h>
 
-// requirement: (OCC_INTERVAL%16 == 0); please DO NOT change this line because some part of the code assume OCC_INTERVAL=0x80
+// default Occ sampling interval of BWA; bwt_t::occ_intv_shift gives the interval of a loaded BWT (at least 32)
 #define OCC_INTV_SHIFT 7
 #define OCC_INTERVAL   (1LL<<OCC_INTV_SHIFT)
 #define OCC_INTV_MASK  (OCC_INTERVAL - 1)
@@ -43,18 +43,45 @@ typedef unsigned char ubyte_t;
 
 typedef uint64_t bwtint_t;
 
+// every 2^RLBWT_CNT_SHIFT-th run of a run-length encoded BWT stores the counts of characters before it, and every
+// 2^RLBWT_DIR_SHIFT-th position the run containing it
+#define RLBWT_CNT_SHIFT 4
+#define RLBWT_DIR_SHIFT 12
+
+// run-length encoded $-removed BWT, for texts made of many similar sequences
+typedef struct {
+	bwtint_t n_runs;
+	int rl32; // starts and cnt are stored in 32 bits (for seq_len < 2^32)
+	void *starts; // position of the first character of every run, followed by seq_len
+	uint8_t *chars; // character of every run, 4 per byte
+	void *cnt; // four counts for every 2^RLBWT_CNT_SHIFT-th run
+	bwtint_t *dir; // run containing every 2^RLBWT_DIR_SHIFT-th position, followed by n_runs
+} bwt_rl_t;
+
+#define bwt_rl_char(rl, r) ((rl)->chars[(r)>>2] >> (((r)&3)<<1) & 3)
+#define bwt_rl_start(rl, r) ((rl)->rl32? (bwtint_t)((const uint32_t*)(rl)->starts)[r] : ((const bwtint_t*)(rl)->starts)[r])
+#define bwt_rl_cnt(rl, i) ((rl)->rl32? (bwtint_t)((const uint32_t*)(rl)->cnt)[i] : ((const bwtint_t*)(rl)->cnt)[i])
+#define bwt_rl_word(rl) ((rl)->rl32? sizeof(uint32_t) : sizeof(bwtint_t))
+
 typedef struct {
 	bwtint_t primary; // S^{-1}(0), or the primary index of BWT
 	bwtint_t L2[5]; // C(), cumulative count
 	bwtint_t seq_len; // sequence length
 	bwtint_t bwt_size; // size of bwt, about seq_len/4
 	uint32_t *bwt; // BWT
+	int occ32; // Occ counters are stored in 32 bits (possible for seq_len < 2^32)
+	int occ_intv_shift; // Occ counters are stored every 2^occ_intv_shift bases
+	int klcp_k; // if non-zero, every Occ block ends with the k-LCP bits of its positions for this k (interleaved layout)
+	bwt_rl_t *rl; // if not NULL, the BWT is run-length encoded and bwt is not used
 	// occurance array, separated to two parts
 	uint32_t cnt_table[256];
 	// suffix array
 	int sa_intv;
 	bwtint_t n_sa;
 	bwtint_t *sa;
+	int sa32; // SA samples are stored in 32 bits, sa then points to uint32_t values
+	int sa_width; // if non-zero, SA samples plus one are bit-packed in this many bits, sa then points to 64-bit words
+	uint64_t *sa_marks; // if not NULL, SA is sampled every sa_intv text positions instead of rows, sampled rows are marked here
 } bwt_t;
 
 typedef struct {
@@ -63,14 +90,25 @@ typedef struct {
 
 typedef struct { size_t n, m; bwtintv_t *a; } bwtintv_v;
 
-/* For general OCC_INTERVAL, the following is correct:
-#define bwt_bwt(b, k) ((b)->bwt[(k)/OCC_INTERVAL * (OCC_INTERVAL/(sizeof(uint32_t)*8/2) + sizeof(bwtint_t)/4*4) + sizeof(bwtint_t)/4*4 + (k)%OCC_INTERVAL/16])
-#define bwt_occ_intv(b, k) ((b)->bwt + (k)/OCC_INTERVAL * (OCC_INTERVAL/(sizeof(uint32_t)*8/2) + sizeof(bwtint_t)/4*4)
-*/
+// number of rows located together by bwt_sa_batch
+#define BWT_SA_BATCH 32
+
+// rows of text-order SA samples are marked in blocks of 256 rows, each of five words: the number of marks before the
+// block, then the marks of the rows; a sample is found by the rank of its row among the marked ones
+#define bwt_sa_marks_words(n_rows) (((n_rows) + 255) / 256 * 5)
+#define bwt_sa_marked(m, k) ((m)[((k)>>8) * 5 + 1 + ((k)>>6 & 3)] >> ((k) & 63) & 1)
 
-// The following two lines are ONLY correct when OCC_INTERVAL==0x80
-#define bwt_bwt(b, k) ((b)->bwt[((k)>>7<<4) + sizeof(bwtint_t) + (((k)&0x7f)>>4)])
-#define bwt_occ_intv(b, k) ((b)->bwt + ((k)>>7<<4))
+// number of 32-bit words taken by the four Occ counters at the start of every block
+#define bwt_occ_cnt_words(b) (sizeof(bwtint_t) >> (b)->occ32)
+#define bwt_occ_cnt(b, p, c) ((b)->occ32? (bwtint_t)(p)[c] : ((const bwtint_t*)(p))[c])
+#define bwt_occ_intv_mask(b) ((1ULL<<(b)->occ_intv_shift) - 1)
+// number of 32-bit words of a block: Occ counters followed by 2^occ_intv_shift bases of BWT, 16 per word,
+// and in the interleaved layout by 2^occ_intv_shift k-LCP bits, 32 per word
+#define bwt_occ_bwt_words(b) (1U<<(b)->occ_intv_shift>>4)
+#define bwt_occ_block_words(b) (bwt_occ_cnt_words(b) + bwt_occ_bwt_words(b) + ((b)->klcp_k? 1U<<(b)->occ_intv_shift>>5 : 0))
+
+#define bwt_bwt(b, k) (bwt_occ_intv(b, k)[bwt_occ_cnt_words(b) + (((k)&bwt_occ_intv_mask(b))>>4)])
+#define bwt_occ_intv(b, k) ((b)->bwt + ((k)>>(b)->occ_intv_shift) * bwt_occ_block_words(b))
 
 /* retrieve a character from the $-removed BWT string. Note that
  * bwt_t::bwt is not exactly the BWT string and therefore this macro is
@@ -94,12 +132,29 @@ extern "C" {
 	void bwt_bwtgen(const char *fn_pac, const char *fn_bwt); // from BWT-SW
 	void bwt_bwtgen2(const char *fn_pac, const char *fn_bwt, int block_size); // from BWT-SW
 	void bwt_cal_sa(bwt_t *bwt, int intv);
+	void bwt_cal_sa_text_order(bwt_t *bwt, int intv);
 
 	void bwt_bwtupdate_core(bwt_t *bwt);
 
+	// builds the run-length encoding of a BWT with Occ counters; rl->cnt and rl->dir are computed by bwt_rl_index()
+	bwt_rl_t *bwt_rl_build(const bwt_t *bwt);
+	void bwt_rl_index(bwt_rl_t *rl, bwtint_t seq_len);
+
 	bwtint_t bwt_occ(const bwt_t *bwt, bwtint_t k, ubyte_t c);
 	void bwt_occ4(const bwt_t *bwt, bwtint_t k, bwtint_t cnt[4]);
 	bwtint_t bwt_sa(const bwt_t *bwt, bwtint_t k);
+	// the same as bwt_sa, also giving the number of the SA sample reached from row k
+	bwtint_t bwt_sa_sampled(const bwt_t *bwt, bwtint_t k, bwtint_t *j);
+	bwtint_t bwt_sa_sample(const bwt_t *bwt, bwtint_t j);
+	// bwt_sa_sampled for rows k, ..., k + n - 1, whose LF walks advance together in groups of BWT_SA_BATCH rows
+	void bwt_sa_batch(const bwt_t *bwt, bwtint_t k, int n, bwtint_t *sa, bwtint_t *j);
+
+	/**
+	 * Select the kernel counting characters within Occ blocks: "avx512", "avx2", "popcnt" or "scalar",
+	 * or the preferred one supported by the CPU for NULL. Returns -1 if the kernel is not supported.
+	 */
+	int bwt_occ_set_kernel(const char *name);
+	const char *bwt_occ_kernel_name(void);
 
 	// more efficient version of bwt_occ/bwt_occ4 for retrieving two close Occ values
 	void bwt_gen_cnt_table(bwt_t *bwt);
@@ -1,17 +1,142 @@
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 #include "bwa.h"
+#include "bwa_utils.h"
 #include "contig_node_translator.h"
 #include "khash.h"
 #include "kstring.h"
+#include "numa_utils.h"
 #include "prophex_utils.h"
 #include "utils.h"
 
 KHASH_MAP_INIT_STR(str, int)
 
+// .bwt files with a non-BWA layout of Occ counters start with this number ("PXBWT032") in place of the primary index,
+// followed by the width of Occ counters in bits (lower 16 bits), the k of k-LCP bits interleaved with the BWT (next
+// 16 bits, 0 if none) and their sampling interval (upper 32 bits, 0 for 128); the rest of the file is as in BWA
+#define PROPHEX_BWT_MAGIC 0x3233305457425850ULL
+
+// .bann files hold the annotations of .ann and .amb in binary form, so that they are loaded with one read: the magic
+// number "PXANN001", l_pac (64 bits), seed, numbers of contigs, holes and nodes (32 bits), size of the node names
+// (64 bits); then offsets (64 bits), lengths, numbers of ambiguous bases and node numbers (32 bits) of the contigs,
+// offsets (64 bits), lengths (32 bits) and characters of the holes, and the zero-terminated node names
+#define PROPHEX_BANN_MAGIC 0x3130304e4e415850ULL
+
+// .rlbwt files (prophex rlbwt) hold the run-length encoded BWT: the magic number "PXRLBWT1", the primary index, L2[1..4],
+// the number of runs, then the starting positions of the runs followed by seq_len (in 32 bits if seq_len < 2^32), and the
+// characters of the runs, 4 per byte
+#define PROPHEX_RLBWT_MAGIC 0x315457424c525850ULL
+
+// .sa files with bit-packed samples start with this number ("PXPSA001") and the width of samples in bits, followed by
+// the BWA header and the 64-bit words of samples plus one (0 for the sample of the primary row, which is -1)
+#define PROPHEX_PACKED_SA_MAGIC 0x3130304153505850ULL
+// and those sampled at text positions with "PXTSA001", the width and the number of samples, with the marks of the
+// sampled rows between the header and the samples
+#define PROPHEX_TEXT_SA_MAGIC 0x3130304153545850ULL
+// .san files start with this number ("PXSAN001")
+#define PROPHEX_SA_CONTIGS_MAGIC 0x3130304e41535850ULL
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define HUGE_PAGE_2M (1ULL << 21)
+#define HUGE_PAGE_1G (1ULL << 30)
+
+// index arrays allocated while huge pages are enabled, with their backing
+typedef struct index_block_s {
+	void* ptr;
+	size_t mapped_size;  // 0 if allocated by posix_memalign
+	const char* backing;
+	struct index_block_s* next;
+} index_block_t;
+
+static int index_huge_pages = 0;
+static index_block_t* index_blocks = NULL;
+static pthread_mutex_t index_blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void index_set_huge_pages(int huge_pages) { index_huge_pages = huge_pages; }
+
+static void* index_mmap_hugetlb(size_t size, size_t page_size, int page_shift, size_t* mapped_size) {
+#ifdef MAP_HUGETLB
+	*mapped_size = (size + page_size - 1) & ~(page_size - 1);
+	void* p = mmap(NULL, *mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (page_shift << MAP_HUGE_SHIFT), -1, 0);
+	return p == MAP_FAILED ? NULL : p;
+#else
+	return NULL;
+#endif
+}
+
+void* index_malloc(size_t size) {
+	void* p = NULL;
+	if (!index_huge_pages || size < HUGE_PAGE_2M) {
+		// cache-line aligned, as required by the interleaved BWT layout
+		xassert(posix_memalign(&p, 64, size) == 0, "[prophex] can not allocate memory for the index");
+		return p;
+	}
+	index_block_t* block = calloc(1, sizeof(index_block_t));
+	// reserved huge pages first (1 GB ones only for arrays of at least that size), then transparent huge pages
+	if (size >= HUGE_PAGE_1G && (p = index_mmap_hugetlb(size, HUGE_PAGE_1G, 30, &block->mapped_size)) != NULL) {
+		block->backing = "hugetlb-1G";
+	} else if ((p = index_mmap_hugetlb(size, HUGE_PAGE_2M, 21, &block->mapped_size)) != NULL) {
+		block->backing = "hugetlb-2M";
+	} else {
+		size_t rounded_size = (size + HUGE_PAGE_2M - 1) & ~(HUGE_PAGE_2M - 1);
+		xassert(posix_memalign(&p, HUGE_PAGE_2M, rounded_size) == 0, "[prophex] can not allocate memory for the index");
+		block->mapped_size = 0;
+#ifdef MADV_HUGEPAGE
+		block->backing = madvise(p, rounded_size, MADV_HUGEPAGE) == 0 ? "thp" : "normal";
+#else
+		block->backing = "normal";
+#endif
+	}
+	block->ptr = p;
+	pthread_mutex_lock(&index_blocks_lock);
+	block->next = index_blocks;
+	index_blocks = block;
+	pthread_mutex_unlock(&index_blocks_lock);
+	return p;
+}
+
+// removes the block of p from the list, returns NULL if p was allocated without huge pages enabled
+static index_block_t* index_block_take(const void* p, int remove) {
+	pthread_mutex_lock(&index_blocks_lock);
+	index_block_t** b = &index_blocks;
+	while (*b && (*b)->ptr != p) {
+		b = &(*b)->next;
+	}
+	index_block_t* block = *b;
+	if (block && remove) {
+		*b = block->next;
+	}
+	pthread_mutex_unlock(&index_blocks_lock);
+	return block;
+}
+
+void index_free(void* p) {
+	if (p == NULL) {
+		return;
+	}
+	index_block_t* block = index_block_take(p, 1);
+	if (block && block->mapped_size) {
+		munmap(p, block->mapped_size);
+	} else {
+		free(p);
+	}
+	free(block);
+}
+
+const char* index_pages_backing(const void* p) {
+	index_block_t* block = index_block_take(p, 0);
+	return block ? block->backing : "normal";
+}
+
 void bwa_destroy_unused_fields(bwaidx_t* idx) {
 	int64_t i;
 	for (i = 0; i < idx->bns->n_seqs; ++i) {
@@ -40,7 +165,7 @@ void bwa_idx_destroy_without_bns_name_and_anno(bwaidx_t* idx) {
 		return;
 	if (idx->mem == 0) {
 		if (idx->bwt)
-			bwt_destroy(idx->bwt);
+			bwt_destroy_index(idx->bwt);
 		if (idx->bns)
 			bns_destroy_without_names_and_anno(idx->bns);
 	} else {
@@ -116,6 +241,8 @@ bntseq_t* bns_restore_core_partial(const char* ann_filename, const char* amb_fil
 	long long xx;
 	int i;
 	int scanres;
+	// contigs of several indexes (shards) are numbered consecutively
+	int contig_offset = get_contigs_count();
 	bns = (bntseq_t*)calloc(1, sizeof(bntseq_t));
 	{  // read .ann
 		fp = xopen(fname = ann_filename, "r");
@@ -133,7 +260,7 @@ bntseq_t* bns_restore_core_partial(const char* ann_filename, const char* amb_fil
 			if (scanres != 2)
 				goto badread;
 
-			add_contig(str, i);
+			add_contig(str, contig_offset + i);
 
 			// read fasta comments
 			while (q - str < sizeof(str) - 1 && (c = fgetc(fp)) != '\n' && c != EOF)
@@ -197,10 +324,123 @@ bntseq_t* bns_restore_ann_only(const char* prefix) {
 	return bns;
 }
 
+void bns_dump_binary(const char* prefix) {
+	bntseq_t* bns = bns_restore(prefix);
+	int32_t* contig_nodes = malloc(bns->n_seqs * sizeof(int32_t));
+	kstring_t names = {0, 0, 0};
+	int32_t nodes_cnt = 0;
+	int i, prev_name = 0;
+	for (i = 0; i < bns->n_seqs; ++i) {
+		// the node name is the contig name before '@', as in add_contig
+		const char* name = bns->anns[i].name;
+		size_t length = strcspn(name, "@");
+		if (nodes_cnt == 0 || strlen(names.s + prev_name) != length || strncmp(names.s + prev_name, name, length) != 0) {
+			prev_name = names.l;
+			kputsn(name, length, &names);
+			kputc('\0', &names);
+			++nodes_cnt;
+		}
+		contig_nodes[i] = nodes_cnt - 1;
+	}
+	char* fn = malloc(strlen(prefix) + 6);
+	FILE* fp = xopen(strcat(strcpy(fn, prefix), ".bann"), "wb");
+	uint64_t magic = PROPHEX_BANN_MAGIC, names_size = names.l;
+	err_fwrite(&magic, sizeof(uint64_t), 1, fp);
+	err_fwrite(&bns->l_pac, sizeof(int64_t), 1, fp);
+	err_fwrite(&bns->seed, sizeof(uint32_t), 1, fp);
+	err_fwrite(&bns->n_seqs, sizeof(int32_t), 1, fp);
+	err_fwrite(&bns->n_holes, sizeof(int32_t), 1, fp);
+	err_fwrite(&nodes_cnt, sizeof(int32_t), 1, fp);
+	err_fwrite(&names_size, sizeof(uint64_t), 1, fp);
+	for (i = 0; i < bns->n_seqs; ++i)
+		err_fwrite(&bns->anns[i].offset, sizeof(int64_t), 1, fp);
+	for (i = 0; i < bns->n_seqs; ++i)
+		err_fwrite(&bns->anns[i].len, sizeof(int32_t), 1, fp);
+	for (i = 0; i < bns->n_seqs; ++i)
+		err_fwrite(&bns->anns[i].n_ambs, sizeof(int32_t), 1, fp);
+	err_fwrite(contig_nodes, sizeof(int32_t), bns->n_seqs, fp);
+	for (i = 0; i < bns->n_holes; ++i)
+		err_fwrite(&bns->ambs[i].offset, sizeof(int64_t), 1, fp);
+	for (i = 0; i < bns->n_holes; ++i)
+		err_fwrite(&bns->ambs[i].len, sizeof(int32_t), 1, fp);
+	for (i = 0; i < bns->n_holes; ++i)
+		err_fwrite(&bns->ambs[i].amb, 1, 1, fp);
+	err_fwrite(names.s, 1, names.l, fp);
+	err_fflush(fp);
+	err_fclose(fp);
+	free(fn);
+	free(names.s);
+	free(contig_nodes);
+	bns_destroy(bns);
+}
+
+// returns 0 if there is no .bann file or it is older than .ann, so that the text annotations are to be parsed
+bntseq_t* bns_restore_binary(const char* prefix) {
+	struct stat bann_st, ann_st;
+	char* fn = malloc(strlen(prefix) + 6);
+	strcat(strcpy(fn, prefix), ".ann");
+	int has_ann = stat(fn, &ann_st) == 0;
+	strcat(strcpy(fn, prefix), ".bann");
+	if (stat(fn, &bann_st) != 0 ||
+	    (has_ann && (ann_st.st_mtim.tv_sec > bann_st.st_mtim.tv_sec ||
+	                 (ann_st.st_mtim.tv_sec == bann_st.st_mtim.tv_sec && ann_st.st_mtim.tv_nsec > bann_st.st_mtim.tv_nsec)))) {
+		free(fn);
+		return 0;
+	}
+	FILE* fp = xopen(fn, "rb");
+	uint64_t magic, names_size;
+	int32_t nodes_cnt;
+	bntseq_t* bns = calloc(1, sizeof(bntseq_t));
+	err_fread_noeof(&magic, sizeof(uint64_t), 1, fp);
+	xassert(magic == PROPHEX_BANN_MAGIC, "[prophex] unsupported .bann file");
+	err_fread_noeof(&bns->l_pac, sizeof(int64_t), 1, fp);
+	err_fread_noeof(&bns->seed, sizeof(uint32_t), 1, fp);
+	err_fread_noeof(&bns->n_seqs, sizeof(int32_t), 1, fp);
+	err_fread_noeof(&bns->n_holes, sizeof(int32_t), 1, fp);
+	err_fread_noeof(&nodes_cnt, sizeof(int32_t), 1, fp);
+	err_fread_noeof(&names_size, sizeof(uint64_t), 1, fp);
+	size_t seqs_size = (size_t)bns->n_seqs * (sizeof(int64_t) + 3 * sizeof(int32_t));
+	size_t holes_size = (size_t)bns->n_holes * (sizeof(int64_t) + sizeof(int32_t) + 1);
+	char* buf = malloc(seqs_size + holes_size + names_size);
+	err_fread_noeof(buf, 1, seqs_size + holes_size + names_size, fp);
+	err_fclose(fp);
+	const int64_t* offsets = (const int64_t*)buf;
+	const int32_t* lens = (const int32_t*)(offsets + bns->n_seqs);
+	const int32_t* n_ambs = lens + bns->n_seqs;
+	const int32_t* contig_nodes = n_ambs + bns->n_seqs;
+	bns->anns = calloc(bns->n_seqs, sizeof(bntann1_t));
+	int i;
+	for (i = 0; i < bns->n_seqs; ++i) {
+		bns->anns[i].offset = offsets[i];
+		bns->anns[i].len = lens[i];
+		bns->anns[i].n_ambs = n_ambs[i];
+	}
+	const char* holes = buf + seqs_size;
+	bns->ambs = bns->n_holes ? calloc(bns->n_holes, sizeof(bntamb1_t)) : 0;
+	for (i = 0; i < bns->n_holes; ++i) {
+		memcpy(&bns->ambs[i].offset, holes + i * sizeof(int64_t), sizeof(int64_t));
+		memcpy(&bns->ambs[i].len, holes + bns->n_holes * sizeof(int64_t) + i * sizeof(int32_t), sizeof(int32_t));
+		bns->ambs[i].amb = holes[bns->n_holes * (sizeof(int64_t) + sizeof(int32_t)) + i];
+	}
+	// the node names are kept for the whole run
+	char* names = malloc(names_size);
+	memcpy(names, buf + seqs_size + holes_size, names_size);
+	add_contigs(contig_nodes, bns->n_seqs, names, nodes_cnt);
+	free(buf);
+	strcat(strcpy(fn, prefix), ".pac");
+	bns->fp_pac = xopen(fn, "rb");
+	free(fn);
+	return bns;
+}
+
 bntseq_t* bns_restore_partial(const char* prefix) {
 	char ann_filename[1024], amb_filename[1024], pac_filename[1024], alt_filename[1024];
 	FILE* fp;
 	bntseq_t* bns;
+	// .bann lacks the contig names, which are needed to mark the alternative contigs
+	if (access(strcat(strcpy(alt_filename, prefix), ".alt"), F_OK) != 0 && (bns = bns_restore_binary(prefix)) != 0) {
+		return bns;
+	}
 	strcat(strcpy(ann_filename, prefix), ".ann");
 	strcat(strcpy(amb_filename, prefix), ".amb");
 	strcat(strcpy(pac_filename, prefix), ".pac");
@@ -239,7 +479,408 @@ bntseq_t* bns_restore_partial(const char* prefix) {
 	return bns;
 }
 
-bwt_t* bwa_idx_load_bwt_with_time(const char* hint, int need_log, FILE* log_file) {
+// files larger than this are read in chunks of this size by several threads, which keeps the storage queue full
+#define INDEX_READ_CHUNK (64ULL << 20)
+#define INDEX_READ_THREADS 4
+
+typedef struct {
+	int fd;
+	off_t offset;
+	size_t size;
+	char* a;
+	numa_policy_t policy;
+} index_read_t;
+
+static void index_read_chunk(void* data, int i, int tid) {
+	index_read_t* r = (index_read_t*)data;
+	// the pages are first touched here, they must be placed as requested by the thread which allocated them
+	numa_set_memory_policy(&r->policy);
+	size_t from = i * INDEX_READ_CHUNK;
+	size_t to = from + INDEX_READ_CHUNK < r->size ? from + INDEX_READ_CHUNK : r->size;
+	while (from < to) {
+		ssize_t x = pread(r->fd, r->a + from, to - from, r->offset + from);
+		if (x < 0 && errno == EINTR) {
+			continue;
+		}
+		if (x <= 0) {
+			err_fatal(__func__, "Error reading the index: %s", x < 0 ? strerror(errno) : "Unexpected end of file");
+		}
+		from += x;
+	}
+}
+
+void index_read(FILE* fp, size_t size, void* a) {
+	extern void kt_for(int n_threads, void (*func)(void*, int, int), void* data, int n);
+	index_read_t r;
+	r.fd = fileno(fp);
+	r.offset = err_ftell(fp);
+	r.size = size;
+	r.a = a;
+	numa_get_memory_policy(&r.policy);
+	int chunks_cnt = (size + INDEX_READ_CHUNK - 1) / INDEX_READ_CHUNK;
+	if (chunks_cnt > 1) {
+		kt_for(chunks_cnt < INDEX_READ_THREADS ? chunks_cnt : INDEX_READ_THREADS, index_read_chunk, &r, chunks_cnt);
+	} else if (chunks_cnt == 1) {
+		index_read_chunk(&r, 0, 0);
+	}
+	err_fseek(fp, r.offset + size, SEEK_SET);
+}
+
+static bwt_t* bwt_restore_rlbwt(FILE* fp) {
+	bwt_t* bwt = calloc(1, sizeof(bwt_t));
+	bwt_rl_t* rl = calloc(1, sizeof(bwt_rl_t));
+	err_fread_noeof(&bwt->primary, sizeof(bwtint_t), 1, fp);
+	err_fread_noeof(bwt->L2 + 1, sizeof(bwtint_t), 4, fp);
+	err_fread_noeof(&rl->n_runs, sizeof(bwtint_t), 1, fp);
+	bwt->seq_len = bwt->L2[4];
+	bwt->occ_intv_shift = OCC_INTV_SHIFT;
+	rl->rl32 = bwt->seq_len < UINT32_MAX;
+	rl->starts = index_malloc((rl->n_runs + 1) * bwt_rl_word(rl));
+	index_read(fp, (rl->n_runs + 1) * bwt_rl_word(rl), rl->starts);
+	rl->chars = index_malloc((rl->n_runs + 3) >> 2);
+	index_read(fp, (rl->n_runs + 3) >> 2, rl->chars);
+	rl->cnt = index_malloc(((rl->n_runs >> RLBWT_CNT_SHIFT) + 1) * 4 * bwt_rl_word(rl));
+	rl->dir = index_malloc(((bwt->seq_len >> RLBWT_DIR_SHIFT) + 2) * sizeof(bwtint_t));
+	bwt_rl_index(rl, bwt->seq_len);
+	bwt->rl = rl;
+	err_fclose(fp);
+	bwt_gen_cnt_table(bwt);
+	return bwt;
+}
+
+void bwt_dump_rlbwt(const char* fn, const bwt_t* bwt) {
+	FILE* fp = xopen(fn, "wb");
+	uint64_t magic = PROPHEX_RLBWT_MAGIC;
+	err_fwrite(&magic, sizeof(uint64_t), 1, fp);
+	err_fwrite(&bwt->primary, sizeof(bwtint_t), 1, fp);
+	err_fwrite(bwt->L2 + 1, sizeof(bwtint_t), 4, fp);
+	err_fwrite(&bwt->rl->n_runs, sizeof(bwtint_t), 1, fp);
+	err_fwrite(bwt->rl->starts, bwt_rl_word(bwt->rl), bwt->rl->n_runs + 1, fp);
+	err_fwrite(bwt->rl->chars, 1, (bwt->rl->n_runs + 3) >> 2, fp);
+	err_fflush(fp);
+	err_fclose(fp);
+}
+
+size_t bwt_rl_size(const bwt_t* bwt) {
+	const bwt_rl_t* rl = bwt->rl;
+	return (rl->n_runs + 1) * bwt_rl_word(rl) + ((rl->n_runs + 3) >> 2) + ((rl->n_runs >> RLBWT_CNT_SHIFT) + 1) * 4 * bwt_rl_word(rl) +
+	       ((bwt->seq_len >> RLBWT_DIR_SHIFT) + 2) * sizeof(bwtint_t);
+}
+
+bwt_t* bwt_restore_bwt_any_width(const char* fn) {
+	FILE* fp = xopen(fn, "rb");
+	bwt_t* bwt;
+	uint64_t magic, occ_layout = 64;
+	size_t header_size = 0;
+	err_fread_noeof(&magic, sizeof(uint64_t), 1, fp);
+	if (magic == PROPHEX_RLBWT_MAGIC) {
+		return bwt_restore_rlbwt(fp);
+	}
+	bwt = calloc(1, sizeof(bwt_t));
+	if (magic == PROPHEX_BWT_MAGIC) {
+		err_fread_noeof(&occ_layout, sizeof(uint64_t), 1, fp);
+		header_size = sizeof(uint64_t) * 2;
+	}
+	uint32_t occ_bits = occ_layout & 0xffff, occ_intv = occ_layout >> 32;
+	xassert(occ_bits == 32 || occ_bits == 64, "[prophex] unsupported width of Occ counters in the BWT file");
+	bwt->occ32 = occ_bits == 32;
+	bwt->klcp_k = occ_layout >> 16 & 0xffff;
+	bwt->occ_intv_shift = OCC_INTV_SHIFT;
+	if (occ_intv) {
+		for (bwt->occ_intv_shift = 5; (1U << bwt->occ_intv_shift) < occ_intv; ++bwt->occ_intv_shift)
+			;
+		xassert(1U << bwt->occ_intv_shift == occ_intv, "[prophex] unsupported Occ sampling interval in the BWT file");
+	}
+	err_fseek(fp, 0, SEEK_END);
+	bwt->bwt_size = (err_ftell(fp) - header_size - sizeof(bwtint_t) * 5) >> 2;
+	bwt->bwt = index_malloc(bwt->bwt_size * 4);
+	err_fseek(fp, header_size, SEEK_SET);
+	err_fread_noeof(&bwt->primary, sizeof(bwtint_t), 1, fp);
+	err_fread_noeof(bwt->L2 + 1, sizeof(bwtint_t), 4, fp);
+	index_read(fp, bwt->bwt_size << 2, bwt->bwt);
+	bwt->seq_len = bwt->L2[4];
+	err_fclose(fp);
+	bwt_gen_cnt_table(bwt);
+	return bwt;
+}
+
+void bwt_dump_bwt_compact(const char* fn, const bwt_t* bwt) {
+	if (!bwt->occ32 && bwt->occ_intv_shift == OCC_INTV_SHIFT && !bwt->klcp_k) {
+		bwt_dump_bwt(fn, bwt);
+		return;
+	}
+	FILE* fp = xopen(fn, "wb");
+	uint64_t occ_intv = bwt->occ_intv_shift == OCC_INTV_SHIFT ? 0 : 1ULL << bwt->occ_intv_shift;
+	uint64_t header[2] = {PROPHEX_BWT_MAGIC, (occ_intv << 32) | (uint64_t)bwt->klcp_k << 16 | (bwt->occ32 ? 32 : 64)};
+	err_fwrite(header, sizeof(uint64_t), 2, fp);
+	err_fwrite(&bwt->primary, sizeof(bwtint_t), 1, fp);
+	err_fwrite(bwt->L2 + 1, sizeof(bwtint_t), 4, fp);
+	err_fwrite(bwt->bwt, 4, bwt->bwt_size, fp);
+	err_fflush(fp);
+	err_fclose(fp);
+}
+
+// 2-bit character at position k of the BWT without Occ counters, as written by bwtgen
+#define bwt_B00(b, k) ((b)->bwt[(k) >> 4] >> ((~(k)&0xf) << 1) & 3)
+
+void bwt_build_occ(bwt_t* bwt, int occ_intv_shift, int occ32) {
+	bwt->occ32 = occ32 && bwt->seq_len < UINT32_MAX;
+	bwt->occ_intv_shift = occ_intv_shift;
+	bwtint_t occ_intv = 1ULL << occ_intv_shift;
+	bwtint_t n_occ = (bwt->seq_len + occ_intv - 1) / occ_intv + 1;
+	bwtint_t cnt_words = bwt_occ_cnt_words(bwt);
+	bwt->bwt_size += n_occ * cnt_words;
+	uint32_t* buf = calloc(bwt->bwt_size, 4);
+	bwtint_t i, k, c[4] = {0, 0, 0, 0};
+	for (i = k = 0; i <= bwt->seq_len; ++i) {
+		if (i % occ_intv == 0 || i == bwt->seq_len) {
+			int j;
+			for (j = 0; j < 4; ++j) {
+				if (bwt->occ32) {
+					buf[k + j] = c[j];
+				} else {
+					memcpy(buf + k + 2 * j, &c[j], sizeof(bwtint_t));
+				}
+			}
+			k += cnt_words;
+		}
+		if (i == bwt->seq_len) {
+			break;
+		}
+		if (i % 16 == 0) {
+			buf[k++] = bwt->bwt[i / 16];
+		}
+		++c[bwt_B00(bwt, i)];
+	}
+	xassert(k == bwt->bwt_size, "[prophex] inconsistent bwt_size");
+	free(bwt->bwt);
+	bwt->bwt = buf;
+}
+
+// number of 64-bit words of bit-packed SA samples, with one more so that every sample can be read from two words
+#define packed_sa_words(n_sa, width) (((n_sa) * (width) + 63) / 64 + 1)
+
+bwt_sa_t* bwt_restore_sa_only(const char* fn) {
+	FILE* fp = xopen(fn, "rb");
+	bwt_sa_t* sa = calloc(1, sizeof(bwt_sa_t));
+	bwtint_t skipped[4];
+	uint64_t width = 0, n_sa = 0;
+	size_t header_size = sizeof(bwtint_t) * 7;
+	err_fread_noeof(&sa->primary, sizeof(bwtint_t), 1, fp);
+	if (sa->primary == PROPHEX_PACKED_SA_MAGIC) {
+		err_fread_noeof(&width, sizeof(uint64_t), 1, fp);
+		err_fread_noeof(&sa->primary, sizeof(bwtint_t), 1, fp);
+		header_size += sizeof(uint64_t) * 2;
+	} else if (sa->primary == PROPHEX_TEXT_SA_MAGIC) {
+		err_fread_noeof(&width, sizeof(uint64_t), 1, fp);
+		err_fread_noeof(&n_sa, sizeof(uint64_t), 1, fp);
+		err_fread_noeof(&sa->primary, sizeof(bwtint_t), 1, fp);
+	}
+	err_fread_noeof(skipped, sizeof(bwtint_t), 4, fp);
+	err_fread_noeof(&sa->sa_intv, sizeof(bwtint_t), 1, fp);
+	err_fread_noeof(&sa->seq_len, sizeof(bwtint_t), 1, fp);
+	sa->n_sa = (sa->seq_len + sa->sa_intv) / sa->sa_intv;
+	if (n_sa) {
+		sa->n_sa = n_sa;
+		sa->sa_marks = index_malloc(bwt_sa_marks_words(sa->seq_len + 1) * sizeof(uint64_t));
+		index_read(fp, bwt_sa_marks_words(sa->seq_len + 1) * sizeof(uint64_t), sa->sa_marks);
+	}
+	if (width) {
+		sa->sa_width = width;
+		sa->sa = index_malloc(packed_sa_words(sa->n_sa, width) * sizeof(uint64_t));
+		index_read(fp, packed_sa_words(sa->n_sa, width) * sizeof(uint64_t), sa->sa);
+		err_fclose(fp);
+		return sa;
+	}
+	// the width of SA samples is told by the file size, the header is the same for both widths
+	err_fseek(fp, 0, SEEK_END);
+	sa->sa32 = err_ftell(fp) == header_size + sizeof(uint32_t) * (sa->n_sa - 1);
+	err_fseek(fp, header_size, SEEK_SET);
+	if (sa->sa32) {
+		uint32_t* sa32 = index_malloc(sa->n_sa * sizeof(uint32_t));
+		sa32[0] = UINT32_MAX;
+		index_read(fp, sizeof(uint32_t) * (sa->n_sa - 1), sa32 + 1);
+		sa->sa = (bwtint_t*)sa32;
+	} else {
+		sa->sa = index_malloc(sa->n_sa * sizeof(bwtint_t));
+		sa->sa[0] = -1;
+		index_read(fp, sizeof(bwtint_t) * (sa->n_sa - 1), sa->sa + 1);
+	}
+	err_fclose(fp);
+	return sa;
+}
+
+void bwt_attach_sa(bwt_t* bwt, bwt_sa_t* sa) {
+	xassert(sa->primary == bwt->primary, "SA-BWT inconsistency: primary is not the same.");
+	xassert(sa->seq_len == bwt->seq_len, "SA-BWT inconsistency: seq_len is not the same.");
+	bwt->sa_intv = sa->sa_intv;
+	bwt->n_sa = sa->n_sa;
+	bwt->sa32 = sa->sa32;
+	bwt->sa_width = sa->sa_width;
+	bwt->sa_marks = sa->sa_marks;
+	bwt->sa = sa->sa;
+	free(sa);
+}
+
+void bwt_restore_sa_any_width(const char* fn, bwt_t* bwt) { bwt_attach_sa(bwt, bwt_restore_sa_only(fn)); }
+
+static void bwt_dump_sa_packed(const char* fn, const bwt_t* bwt) {
+	uint64_t width, i;
+	for (width = 1; (bwt->seq_len + 1) >> width; ++width)
+		;
+	uint64_t* words = calloc(packed_sa_words(bwt->n_sa, width), sizeof(uint64_t));
+	for (i = 0; i < bwt->n_sa; ++i) {
+		uint64_t x = bwt->sa[i] + 1, bit = i * width;  // the sample of the primary row, -1, becomes 0
+		words[bit >> 6] |= x << (bit & 63);
+		if ((bit & 63) + width > 64) {
+			words[(bit >> 6) + 1] |= x >> (64 - (bit & 63));
+		}
+	}
+	FILE* fp = xopen(fn, "wb");
+	uint64_t header[3] = {PROPHEX_PACKED_SA_MAGIC, width, bwt->n_sa};
+	bwtint_t sa_intv = bwt->sa_intv;
+	if (bwt->sa_marks) {
+		header[0] = PROPHEX_TEXT_SA_MAGIC;
+		err_fwrite(header, sizeof(uint64_t), 3, fp);
+	} else {
+		err_fwrite(header, sizeof(uint64_t), 2, fp);
+	}
+	err_fwrite(&bwt->primary, sizeof(bwtint_t), 1, fp);
+	err_fwrite(bwt->L2 + 1, sizeof(bwtint_t), 4, fp);
+	err_fwrite(&sa_intv, sizeof(bwtint_t), 1, fp);
+	err_fwrite(&bwt->seq_len, sizeof(bwtint_t), 1, fp);
+	if (bwt->sa_marks) {
+		err_fwrite(bwt->sa_marks, sizeof(uint64_t), bwt_sa_marks_words(bwt->seq_len + 1), fp);
+	}
+	err_fwrite(words, sizeof(uint64_t), packed_sa_words(bwt->n_sa, width), fp);
+	err_fflush(fp);
+	err_fclose(fp);
+	free(words);
+}
+
+void bwt_dump_sa_compact(const char* fn, const bwt_t* bwt, int packed) {
+	// text-order samples are always bit-packed, the marks of their rows already take more than the samples
+	if (packed || bwt->sa_marks) {
+		bwt_dump_sa_packed(fn, bwt);
+		return;
+	}
+	if (!bwt->occ32) {
+		bwt_dump_sa(fn, bwt);
+		return;
+	}
+	FILE* fp = xopen(fn, "wb");
+	bwtint_t sa_intv = bwt->sa_intv;
+	err_fwrite(&bwt->primary, sizeof(bwtint_t), 1, fp);
+	err_fwrite(bwt->L2 + 1, sizeof(bwtint_t), 4, fp);
+	err_fwrite(&sa_intv, sizeof(bwtint_t), 1, fp);
+	err_fwrite(&bwt->seq_len, sizeof(bwtint_t), 1, fp);
+	bwtint_t i;
+	for (i = 1; i < bwt->n_sa; ++i) {
+		uint32_t x = bwt->sa[i];
+		err_fwrite(&x, sizeof(uint32_t), 1, fp);
+	}
+	err_fflush(fp);
+	err_fclose(fp);
+}
+
+void bwa_bwtupdate_compact(const char* fn_bwt, int occ_intv_shift) {
+	bwt_t* bwt = bwt_restore_bwt(fn_bwt);
+	bwt_build_occ(bwt, occ_intv_shift, 1);
+	bwt_dump_bwt_compact(fn_bwt, bwt);
+	bwt_destroy(bwt);
+}
+
+void bwa_bwt2sa_compact(const char* fn_bwt, const char* fn_sa, int sa_intv, int packed, int text_order) {
+	bwt_t* bwt = bwt_restore_bwt_any_width(fn_bwt);
+	if (text_order) {
+		bwt_cal_sa_text_order(bwt, sa_intv);
+	} else {
+		bwt_cal_sa(bwt, sa_intv);
+	}
+	bwt_dump_sa_compact(fn_sa, bwt, packed);
+	bwt_destroy(bwt);
+}
+
+void sa_contigs_dump(const char* prefix) {
+	char* fn = malloc(strlen(prefix) + 5);
+	bwt_sa_t* sa = bwt_restore_sa_only(strcat(strcpy(fn, prefix), ".sa"));
+	bntseq_t* bns = bns_restore(prefix);
+	// only the samples are read, from a BWT without its text
+	bwt_t* bwt = calloc(1, sizeof(bwt_t));
+	bwt->primary = sa->primary;
+	bwt->seq_len = sa->seq_len;
+	int text_order = sa->sa_marks != NULL;
+	bwt_attach_sa(bwt, sa);
+	int32_t* contigs = malloc(bwt->n_sa * sizeof(int32_t));
+	// as at query time, the forward strand takes the whole BWT of a forward-only index and half of it otherwise
+	const bntann1_t* last_ann = &bns->anns[bns->n_seqs - 1];
+	bns->l_pac = bwt->seq_len == last_ann->offset + last_ann->len ? bwt->seq_len : bwt->seq_len / 2;
+	bwtint_t j;
+	for (j = 0; j < bwt->n_sa; ++j) {
+		bwtint_t x = bwt_sa_sample(bwt, j);
+		// positions on the reverse strand belong to the contig of their complement, the sample of the primary row is -1,
+		// positions reached from it are at the start of the reference
+		if (x == (bwtint_t)-1) {
+			contigs[j] = 0;
+		} else {
+			contigs[j] = bns_pos2rid(bns, x < bns->l_pac ? x : (bns->l_pac << 1) - 1 - x);
+		}
+	}
+	uint64_t header[5] = {PROPHEX_SA_CONTIGS_MAGIC, bwt->n_sa, bwt->seq_len, bwt->sa_intv, text_order};
+	FILE* fp = xopen(strcat(strcpy(fn, prefix), ".san"), "wb");
+	err_fwrite(header, sizeof(uint64_t), 5, fp);
+	err_fwrite(contigs, sizeof(int32_t), bwt->n_sa, fp);
+	err_fflush(fp);
+	err_fclose(fp);
+	free(contigs);
+	bwt_destroy_index(bwt);
+	bns_destroy(bns);
+	free(fn);
+}
+
+sa_contigs_t* sa_contigs_restore(const char* fn) {
+	FILE* fp = xopen(fn, "rb");
+	uint64_t header[5];
+	err_fread_noeof(header, sizeof(uint64_t), 5, fp);
+	xassert(header[0] == PROPHEX_SA_CONTIGS_MAGIC, "[prophex] .san file is corrupted");
+	sa_contigs_t* sa_contigs = malloc(sizeof(sa_contigs_t));
+	sa_contigs->n_sa = header[1];
+	sa_contigs->seq_len = header[2];
+	sa_contigs->sa_intv = header[3];
+	sa_contigs->text_order = header[4];
+	sa_contigs->contigs = index_malloc(sa_contigs->n_sa * sizeof(int32_t));
+	index_read(fp, sa_contigs->n_sa * sizeof(int32_t), sa_contigs->contigs);
+	err_fclose(fp);
+	return sa_contigs;
+}
+
+int sa_contigs_match(const sa_contigs_t* sa_contigs, const bwt_t* bwt) {
+	return sa_contigs->n_sa == bwt->n_sa && sa_contigs->seq_len == bwt->seq_len && sa_contigs->sa_intv == bwt->sa_intv &&
+	       sa_contigs->text_order == (bwt->sa_marks != NULL);
+}
+
+void sa_contigs_destroy(sa_contigs_t* sa_contigs) {
+	if (sa_contigs == NULL) {
+		return;
+	}
+	index_free(sa_contigs->contigs);
+	free(sa_contigs);
+}
+
+char* index_infer_prefix(const char* hint) {
+	char* prefix = bwa_idx_infer_prefix(hint);
+	if (prefix == 0) {
+		struct stat st;
+		char* fn = malloc(strlen(hint) + 7);
+		if (stat(strcat(strcpy(fn, hint), ".rlbwt"), &st) == 0) {
+			prefix = strdup(hint);
+		}
+		free(fn);
+	}
+	return prefix;
+}
+
+bwt_t* bwa_idx_load_bwt_file_with_time(const char* hint, const char* bwt_suffix, int need_log, FILE* log_file) {
 	char* tmp;
 	char* prefix;
 	bwt_t* bwt;
@@ -250,23 +891,29 @@ bwt_t* bwa_idx_load_bwt_with_time(const char* hint, int need_log, FILE* log_file
 		return 0;
 	}
 	clock_t t = clock();
-	tmp = calloc(strlen(prefix) + 5, 1);
-	strcat(strcpy(tmp, prefix), ".bwt");
-	bwt = bwt_restore_bwt(tmp);
+	tmp = calloc(strlen(prefix) + strlen(bwt_suffix) + 5, 1);
+	strcat(strcpy(tmp, prefix), bwt_suffix);
+	bwt = bwt_restore_bwt_any_width(tmp);
 	if (need_log) {
 		fprintf(log_file, "bwt_loading\t%.2fs\n", (float)(clock() - t) / CLOCKS_PER_SEC);
+		fprintf(log_file, "bwt_pages\t%s\n", index_pages_backing(bwt->bwt));
 	}
 	t = clock();
 	strcat(strcpy(tmp, prefix), ".sa");
-	bwt_restore_sa(tmp, bwt);
+	bwt_restore_sa_any_width(tmp, bwt);
 	if (need_log) {
 		fprintf(log_file, "sa_loading\t%.2fs\n", (float)(clock() - t) / CLOCKS_PER_SEC);
+		fprintf(log_file, "sa_pages\t%s\n", index_pages_backing(bwt->sa));
 	}
 	free(tmp);
 	free(prefix);
 	return bwt;
 }
 
+bwt_t* bwa_idx_load_bwt_with_time(const char* hint, int need_log, FILE* log_file) {
+	return bwa_idx_load_bwt_file_with_time(hint, ".bwt", need_log, log_file);
+}
+
 bwaidx_t* bwa_idx_load_partial(const char* hint, int which, int need_log, FILE* log_file) {
 	bwaidx_t* idx;
 	char* prefix;
@@ -306,7 +953,7 @@ bwt_t* bwa_idx_load_bwt_without_sa(const char* hint) {
 	}
 	tmp = calloc(strlen(prefix) + 5, 1);
 	strcat(strcpy(tmp, prefix), ".bwt");
-	bwt = bwt_restore_bwt(tmp);
+	bwt = bwt_restore_bwt_any_width(tmp);
 	free(tmp);
 	free(prefix);
 	return bwt;
@@ -315,6 +962,21 @@ bwt_t* bwa_idx_load_bwt_without_sa(const char* hint) {
 void bwt_destroy_without_sa(bwt_t* bwt) {
 	if (bwt == 0)
 		return;
-	free(bwt->bwt);
+	if (bwt->rl) {
+		index_free(bwt->rl->starts);
+		index_free(bwt->rl->chars);
+		index_free(bwt->rl->cnt);
+		index_free(bwt->rl->dir);
+		free(bwt->rl);
+	}
+	index_free(bwt->bwt);
 	free(bwt);
 }
+
+void bwt_destroy_index(bwt_t* bwt) {
+	if (bwt == 0)
+		return;
+	index_free(bwt->sa);
+	index_free(bwt->sa_marks);
+	bwt_destroy_without_sa(bwt);
+}
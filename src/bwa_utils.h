@@ -11,14 +11,75 @@
 #include "bwt.h"
 #include "prophex_utils.h"
 
+// arrays of the index (BWT, SA, k-LCP) can be backed by huge pages to reduce TLB misses: reserved 1 GB or 2 MB pages
+// when available, transparent huge pages otherwise; index_free must be used for them
+void index_set_huge_pages(int huge_pages);
+void* index_malloc(size_t size);
+void index_free(void* p);
+// "hugetlb-1G", "hugetlb-2M", "thp" or "normal"
+const char* index_pages_backing(const void* p);
+// reads size bytes of an index array from the current position of fp, large arrays in parallel chunks
+void index_read(FILE* fp, size_t size, void* a);
+
 void bwa_destroy_unused_fields(bwaidx_t* idx);
 void bns_destroy_without_names_and_anno(bntseq_t* bns);
 void bwa_idx_destroy_without_bns_name_and_anno(bwaidx_t* idx);
 bntseq_t* bns_restore_core_partial(const char* ann_filename, const char* amb_filename, const char* pac_filename);
+// loads the annotations from <prefix>.bann if it is present and up to date, otherwise parses .ann and .amb
 bntseq_t* bns_restore_partial(const char* prefix);
+// writes <prefix>.bann, the annotations of .ann and .amb with the contig names replaced by node numbers
+void bns_dump_binary(const char* prefix);
+bntseq_t* bns_restore_binary(const char* prefix);
 bntseq_t* bns_restore_ann_only(const char* prefix);
+// BWT and SA of texts shorter than 2^32 can be stored with 32-bit Occ counters and SA samples, and Occ counters
+// can be sampled at another interval than 128; the loaders below accept both these and the BWA files
+bwt_t* bwt_restore_bwt_any_width(const char* fn);
+// the run-length encoded BWT (built by bwt_rl_build) is written to .rlbwt files and restored by the loader above
+void bwt_dump_rlbwt(const char* fn, const bwt_t* bwt);
+// memory taken by the run-length encoded BWT, in bytes
+size_t bwt_rl_size(const bwt_t* bwt);
+void bwt_dump_bwt_compact(const char* fn, const bwt_t* bwt);
+// adds Occ counters every 2^occ_intv_shift bases to the BWT written by bwtgen, 32-bit ones if occ32 and the text is short enough
+void bwt_build_occ(bwt_t* bwt, int occ_intv_shift, int occ32);
+void bwt_restore_sa_any_width(const char* fn, bwt_t* bwt);
+// SA samples read without their BWT, so that both files can be loaded at the same time; bwt_attach_sa moves them into
+// the BWT after checking that the two files belong together
+typedef struct {
+	bwtint_t primary, seq_len, sa_intv, n_sa;
+	int sa32, sa_width;
+	bwtint_t* sa;
+	uint64_t* sa_marks;
+} bwt_sa_t;
+bwt_sa_t* bwt_restore_sa_only(const char* fn);
+void bwt_attach_sa(bwt_t* bwt, bwt_sa_t* sa);
+// writes 32-bit SA samples if the BWT has 32-bit Occ counters, so that the whole index has one width, or bit-packed
+// samples of the fewest bits for the text length if packed
+void bwt_dump_sa_compact(const char* fn, const bwt_t* bwt, int packed);
+// index construction steps producing the compact format when possible
+void bwa_bwtupdate_compact(const char* fn_bwt, int occ_intv_shift);
+// SA is sampled every sa_intv text positions if text_order, otherwise every sa_intv rows
+void bwa_bwt2sa_compact(const char* fn_bwt, const char* fn_sa, int sa_intv, int packed, int text_order);
+// contig of every SA sample (.san), so that positions within the contig of their sample are resolved to contigs without
+// searching the annotations
+typedef struct {
+	bwtint_t n_sa, seq_len, sa_intv;
+	int text_order;
+	int32_t* contigs;
+} sa_contigs_t;
+void sa_contigs_dump(const char* prefix);
+sa_contigs_t* sa_contigs_restore(const char* fn);
+// whether the contigs belong to the current SA samples of the BWT, .sa may have been rebuilt after .san
+int sa_contigs_match(const sa_contigs_t* sa_contigs, const bwt_t* bwt);
+void sa_contigs_destroy(sa_contigs_t* sa_contigs);
+// the same as bwa_idx_infer_prefix, also accepting an index whose BWT is only run-length encoded
+char* index_infer_prefix(const char* hint);
+bwt_t* bwa_idx_load_bwt_with_time(const char* hint, int need_log, FILE* log_file);
+// loads the BWT from the file with the given suffix instead of .bwt, e.g. one in the interleaved layout
+bwt_t* bwa_idx_load_bwt_file_with_time(const char* hint, const char* bwt_suffix, int need_log, FILE* log_file);
 bwaidx_t* bwa_idx_load_partial(const char* hint, int which, int need_log, FILE* log_file);
 bwt_t* bwa_idx_load_bwt_without_sa(const char* hint);
 void bwt_destroy_without_sa(bwt_t* bwt);
+// destroys a BWT with SA loaded by the functions above
+void bwt_destroy_index(bwt_t* bwt);
 
 #endif  // BWAUTILS_H
@@ -22,6 +22,10 @@ int get_node_from_contig(int contig) {
 
 char* get_node_name(int node) { return node_names[node]; }
 
+int get_contigs_count() { return contigs_count; }
+
+int get_nodes_count() { return nodes_count; }
+
 int get_node_name_length(int node) { return node_name_lengths[node]; }
 
 void add_contig(char* contig, int contig_number) {
@@ -50,3 +54,30 @@ void add_contig(char* contig, int contig_number) {
 		contig_to_node[contig_number] = nodes_count - 1;
 	}
 }
+
+void add_contigs(const int32_t* contig_nodes, int contigs_cnt, char* names, int nodes_cnt) {
+	xassert(contigs_count + contigs_cnt <= MAX_CONTIGS_COUNT,
+	        "[prophex] there are more than MAX_CONTIGS_COUNT contigs, try to increase MAX_CONTIGS_COUNT in contig_node_translator.c\n");
+	// the first node continues the last one of the previous index if they have the same name, as in add_contig
+	int first_node = nodes_count;
+	if (nodes_count > 0 && nodes_cnt > 0 && strcmp(names, node_names[nodes_count - 1]) == 0) {
+		--first_node;
+	}
+	xassert(first_node + nodes_cnt <= MAX_NODES_COUNT,
+	        "[prophex] there are more than MAX_NODES_COUNT nodes, try to increase MAX_NODES_COUNT in contig_node_translator.c\n");
+	int i;
+	char* name = names;
+	for (i = 0; i < nodes_cnt; ++i) {
+		int length = strlen(name);
+		if (first_node + i >= nodes_count) {
+			node_names[first_node + i] = name;
+			node_name_lengths[first_node + i] = length;
+		}
+		name += length + 1;
+	}
+	nodes_count = first_node + nodes_cnt;
+	for (i = 0; i < contigs_cnt; ++i) {
+		contig_to_node[contigs_count + i] = first_node + contig_nodes[i];
+	}
+	contigs_count += contigs_cnt;
+}
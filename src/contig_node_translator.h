@@ -13,5 +13,10 @@ int get_node_from_contig(int contig);
 char* get_node_name(int node);
 int get_node_name_length(int node);
 void add_contig(char* contig, int contig_number);
+// adds the contigs of one index at once: contig i belongs to the node contig_nodes[i], nodes are numbered in the index
+// and named by the consecutive zero-terminated strings of names (which are kept), as written to .bann files
+void add_contigs(const int32_t* contig_nodes, int contigs_cnt, char* names, int nodes_cnt);
+int get_contigs_count();
+int get_nodes_count();
 
 #endif  // CONTIG_NODE_TRANSLATOR_H
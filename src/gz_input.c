@@ -0,0 +1,292 @@
+#include "gz_input.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "utils.h"
+
+// BGZF blocks inflated together by the threads, per thread
+#define GZ_INPUT_BLOCKS_PER_THREAD 16
+// size of the chunks inflated ahead from gzip files
+#define GZ_INPUT_CHUNK_SIZE (1 << 20)
+#define BGZF_HEADER_SIZE 12
+#define BGZF_TRAILER_SIZE 8
+// limit of both the compressed and the uncompressed size of a block
+#define BGZF_MAX_BLOCK_SIZE 0x10000
+
+extern void kt_for(int n_threads, void (*func)(void*, int, int), void* data, int n);
+extern void kt_pipeline(int n_threads, void* (*func)(void*, int, void*), void* shared_data, int n_steps);
+
+typedef struct {
+	uint8_t* data;
+	size_t len;
+	// BGZF: compressed blocks data[offsets[i]], ..., data[offsets[i + 1] - 1] inflated to udata + uoffsets[i]
+	size_t* offsets;
+	size_t* uoffsets;
+	uint8_t* udata;
+	int blocks_cnt;
+	// the input is broken after this chunk
+	int failed;
+} gz_input_chunk_t;
+
+typedef struct {
+	gz_input_t* input;
+	z_stream* streams;
+	int max_blocks;
+	// the pipe was closed by the parser
+	int stopped;
+	int is_broken;
+} gz_input_reader_t;
+
+static int read_full(int fd, void* buf, size_t len) {
+	size_t done = 0;
+	while (done < len) {
+		ssize_t r = read(fd, (uint8_t*)buf + done, len - done);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			break;
+		}
+		done += r;
+	}
+	return done;
+}
+
+static int write_full(int fd, const void* buf, size_t len) {
+	size_t done = 0;
+	while (done < len) {
+		ssize_t w = write(fd, (const uint8_t*)buf + done, len - done);
+		if (w < 0 && errno == EINTR) {
+			continue;
+		}
+		if (w < 0) {
+			return -1;
+		}
+		done += w;
+	}
+	return 0;
+}
+
+static uint32_t read_u32(const uint8_t* p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24; }
+
+// returns the size of the BGZF block starting with the header, 0 if it is not a BGZF block
+static int bgzf_block_size(const uint8_t* header, const uint8_t* extra, int xlen) {
+	if (header[0] != 0x1f || header[1] != 0x8b || header[2] != Z_DEFLATED || !(header[3] & 4)) {
+		return 0;
+	}
+	int i = 0;
+	while (i + 4 <= xlen) {
+		int slen = extra[i + 2] | extra[i + 3] << 8;
+		if (extra[i] == 'B' && extra[i + 1] == 'C' && slen == 2 && i + 6 <= xlen) {
+			return (extra[i + 4] | extra[i + 5] << 8) + 1;
+		}
+		i += 4 + slen;
+	}
+	return 0;
+}
+
+typedef struct {
+	gz_input_reader_t* reader;
+	gz_input_chunk_t* chunk;
+	int failed;
+} bgzf_inflate_t;
+
+static void inflate_block(void* data, int i, int tid) {
+	bgzf_inflate_t* task = (bgzf_inflate_t*)data;
+	gz_input_chunk_t* chunk = task->chunk;
+	z_stream* zs = &task->reader->streams[tid];
+	const uint8_t* block = chunk->data + chunk->offsets[i];
+	size_t block_size = chunk->offsets[i + 1] - chunk->offsets[i];
+	int xlen = block[10] | block[11] << 8;
+	size_t usize = chunk->uoffsets[i + 1] - chunk->uoffsets[i];
+	inflateReset(zs);
+	zs->next_in = (Bytef*)block + BGZF_HEADER_SIZE + xlen;
+	zs->avail_in = block_size - BGZF_HEADER_SIZE - xlen - BGZF_TRAILER_SIZE;
+	zs->next_out = chunk->udata + chunk->uoffsets[i];
+	zs->avail_out = usize;
+	int ret = inflate(zs, Z_FINISH);
+	if (ret != Z_STREAM_END || zs->avail_out != 0 ||
+	    crc32(crc32(0L, Z_NULL, 0), chunk->udata + chunk->uoffsets[i], usize) != read_u32(block + block_size - BGZF_TRAILER_SIZE)) {
+		task->failed = 1;
+	}
+}
+
+static void chunk_destroy(gz_input_chunk_t* chunk) {
+	free(chunk->data);
+	free(chunk->offsets);
+	free(chunk->uoffsets);
+	free(chunk->udata);
+	free(chunk);
+}
+
+// reads the next blocks and inflates them
+static gz_input_chunk_t* bgzf_read_chunk(gz_input_reader_t* reader) {
+	gz_input_t* input = reader->input;
+	gz_input_chunk_t* chunk = calloc(1, sizeof(gz_input_chunk_t));
+	size_t capacity = (size_t)reader->max_blocks * BGZF_MAX_BLOCK_SIZE;
+	chunk->data = malloc(capacity);
+	chunk->offsets = malloc((reader->max_blocks + 1) * sizeof(size_t));
+	chunk->uoffsets = malloc((reader->max_blocks + 1) * sizeof(size_t));
+	chunk->offsets[0] = chunk->uoffsets[0] = 0;
+	while (chunk->blocks_cnt < reader->max_blocks) {
+		uint8_t* block = chunk->data + chunk->len;
+		int read = read_full(input->in_fd, block, BGZF_HEADER_SIZE);
+		if (read == 0) {
+			break;
+		}
+		int xlen = read == BGZF_HEADER_SIZE ? block[10] | block[11] << 8 : 0;
+		int block_size = 0;
+		// a block never exceeds BGZF_MAX_BLOCK_SIZE, which is the space left for it in the chunk
+		if (read == BGZF_HEADER_SIZE && xlen <= BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE - BGZF_TRAILER_SIZE &&
+		    read_full(input->in_fd, block + BGZF_HEADER_SIZE, xlen) == xlen) {
+			block_size = bgzf_block_size(block, block + BGZF_HEADER_SIZE, xlen);
+		}
+		int rest = block_size - BGZF_HEADER_SIZE - xlen;
+		if (rest < BGZF_TRAILER_SIZE || read_full(input->in_fd, block + BGZF_HEADER_SIZE + xlen, rest) != rest ||
+		    read_u32(block + block_size - 4) > BGZF_MAX_BLOCK_SIZE) {
+			chunk->failed = 1;
+			break;
+		}
+		chunk->len += block_size;
+		chunk->offsets[chunk->blocks_cnt + 1] = chunk->len;
+		chunk->uoffsets[chunk->blocks_cnt + 1] = chunk->uoffsets[chunk->blocks_cnt] + read_u32(chunk->data + chunk->len - 4);
+		++chunk->blocks_cnt;
+	}
+	if (chunk->failed) {
+		fprintf(stderr, "[prophex:%s] the input is not a valid BGZF file, it is read only up to the broken block\n", __func__);
+	}
+	chunk->udata = malloc(chunk->uoffsets[chunk->blocks_cnt] + 1);
+	bgzf_inflate_t task = {reader, chunk, 0};
+	kt_for(input->n_threads, inflate_block, &task, chunk->blocks_cnt);
+	if (task.failed) {
+		fprintf(stderr, "[prophex:%s] a BGZF block of the input can not be inflated, the input is read only up to its chunk\n", __func__);
+		chunk->failed = 1;
+		chunk->blocks_cnt = 0;
+	}
+	chunk->len = chunk->uoffsets[chunk->blocks_cnt];
+	return chunk;
+}
+
+// inflates the next part of a gzip file
+static gz_input_chunk_t* gzip_read_chunk(gz_input_reader_t* reader) {
+	gz_input_chunk_t* chunk = calloc(1, sizeof(gz_input_chunk_t));
+	chunk->udata = malloc(GZ_INPUT_CHUNK_SIZE);
+	int read = gzread(reader->input->in_gz, chunk->udata, GZ_INPUT_CHUNK_SIZE);
+	if (read < 0) {
+		int errnum;
+		fprintf(stderr, "[prophex:%s] the input can not be decompressed: %s\n", __func__, gzerror(reader->input->in_gz, &errnum));
+		chunk->failed = 1;
+		read = 0;
+	}
+	chunk->len = read;
+	return chunk;
+}
+
+// step 0 reads and inflates a chunk, step 1 writes it to the pipe
+static void* gz_input_step(void* shared, int step, void* data) {
+	gz_input_reader_t* reader = (gz_input_reader_t*)shared;
+	gz_input_t* input = reader->input;
+	if (step == 0) {
+		if (reader->stopped || reader->is_broken) {
+			return NULL;
+		}
+		double rtime = realtime();
+		gz_input_chunk_t* chunk = input->format == GZ_INPUT_BGZF ? bgzf_read_chunk(reader) : gzip_read_chunk(reader);
+		input->decompression_time += realtime() - rtime;
+		reader->is_broken = chunk->failed;
+		if (chunk->len == 0) {
+			chunk_destroy(chunk);
+			return NULL;
+		}
+		return chunk;
+	}
+	gz_input_chunk_t* chunk = (gz_input_chunk_t*)data;
+	if (!reader->stopped && write_full(input->pipe_fd[1], chunk->udata, chunk->len) != 0) {
+		// the parser does not read any more
+		reader->stopped = 1;
+	}
+	chunk_destroy(chunk);
+	return NULL;
+}
+
+static void* gz_input_thread(void* data) {
+	gz_input_t* input = (gz_input_t*)data;
+	// writing to the pipe closed by the parser fails instead of killing the process
+	sigset_t sigpipe;
+	sigemptyset(&sigpipe);
+	sigaddset(&sigpipe, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+	gz_input_reader_t reader = {input, NULL, GZ_INPUT_BLOCKS_PER_THREAD * input->n_threads, 0, 0};
+	int i;
+	if (input->format == GZ_INPUT_BGZF) {
+		reader.streams = calloc(input->n_threads, sizeof(z_stream));
+		for (i = 0; i < input->n_threads; ++i) {
+			inflateInit2(&reader.streams[i], -15);
+		}
+	}
+	// the next chunk is decompressed while the previous one is written
+	kt_pipeline(2, gz_input_step, &reader, 2);
+	if (input->format == GZ_INPUT_BGZF) {
+		for (i = 0; i < input->n_threads; ++i) {
+			inflateEnd(&reader.streams[i]);
+		}
+		free(reader.streams);
+	} else {
+		gzclose(input->in_gz);
+	}
+	close(input->pipe_fd[1]);
+	return NULL;
+}
+
+gz_input_t* gz_input_open(int fd, int n_threads) {
+	gz_input_t* input = calloc(1, sizeof(gz_input_t));
+	input->n_threads = n_threads;
+	input->in_fd = fd;
+	input->format = GZ_INPUT_PLAIN;
+	// the format is detected only for regular files, where the header can be read without consuming it
+	struct stat st;
+	uint8_t header[BGZF_HEADER_SIZE + 6];
+	off_t offset = lseek(fd, 0, SEEK_CUR);
+	if (n_threads > 1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && offset >= 0 &&
+	    pread(fd, header, sizeof(header), offset) == sizeof(header) && header[0] == 0x1f && header[1] == 0x8b) {
+		int xlen = header[10] | header[11] << 8;
+		input->format = bgzf_block_size(header, header + BGZF_HEADER_SIZE, xlen < 6 ? xlen : 6) ? GZ_INPUT_BGZF : GZ_INPUT_GZIP;
+	}
+	if (input->format == GZ_INPUT_PLAIN) {
+		input->fp = gzdopen(fd, "r");
+		return input;
+	}
+	if (pipe(input->pipe_fd) != 0) {
+		fprintf(stderr, "[prophex:%s] can not create a pipe, the input is decompressed by one thread\n", __func__);
+		input->format = GZ_INPUT_PLAIN;
+		input->fp = gzdopen(fd, "r");
+		return input;
+	}
+	if (input->format == GZ_INPUT_GZIP) {
+		input->in_gz = gzdopen(dup(fd), "r");
+	}
+	input->fp = gzdopen(input->pipe_fd[0], "r");
+	pthread_create(&input->thread, NULL, gz_input_thread, input);
+	input->has_thread = 1;
+	return input;
+}
+
+void gz_input_close(gz_input_t* input) {
+	err_gzclose(input->fp);
+	if (input->has_thread) {
+		pthread_join(input->thread, NULL);
+		// otherwise fd was closed with fp
+		close(input->in_fd);
+	}
+	free(input);
+}
+
+const char* gz_input_format_name(const gz_input_t* input) {
+	static const char* names[] = {"plain", "gzip", "bgzf"};
+	return names[input->format];
+}
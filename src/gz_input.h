@@ -0,0 +1,41 @@
+/*
+    Input stage of query: reads are decompressed by a separate thread and passed through a pipe to the parser.
+    Licence: MIT
+
+    BGZF blocks (bgzip, samtools) are inflated in batches by several threads. Other gzip files are inflated by one
+    thread ahead of the parser. Uncompressed files and non-regular files (pipes, stdin) are read directly, as their
+    format can not be detected without consuming them.
+*/
+
+#ifndef GZ_INPUT_H
+#define GZ_INPUT_H
+
+#include <pthread.h>
+#include <zlib.h>
+
+#define GZ_INPUT_PLAIN 0
+#define GZ_INPUT_GZIP 1
+#define GZ_INPUT_BGZF 2
+
+typedef struct {
+	// decompressed reads, for kseq
+	gzFile fp;
+	int format;
+	// real time spent by the decompressing threads (the time of waiting for the parser is not included), in seconds
+	double decompression_time;
+	int n_threads;
+	int in_fd;
+	gzFile in_gz;
+	int pipe_fd[2];
+	pthread_t thread;
+	int has_thread;
+} gz_input_t;
+
+// starts the decompression of the file open as fd, with n_threads threads for BGZF blocks; with one thread, all files
+// are read directly; fd is owned by the input from now on
+gz_input_t* gz_input_open(int fd, int n_threads);
+// waits for the decompressing threads, fp and fd are closed
+void gz_input_close(gz_input_t* input);
+const char* gz_input_format_name(const gz_input_t* input);
+
+#endif  // GZ_INPUT_H
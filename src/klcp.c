@@ -1,7 +1,9 @@
 #include "klcp.h"
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include "bwa_utils.h"
 #include "utils.h"
 
 int32_t position_of_smallest_zero_bit[MAX_BITARRAY_BLOCK_VALUE + 1];
@@ -11,11 +13,57 @@ void destroy_klcp(klcp_t* klcp) {
 	if (klcp == 0) {
 		return;
 	}
-	destroy_bitarray(klcp->klcp);
+	// the blocks of a restored k-LCP are allocated as an index array
+	if (klcp->klcp) {
+		index_free(klcp->klcp->blocks);
+		free(klcp->klcp);
+	}
 	free(klcp);
 }
 
+// 32 k-LCP bits of an interleaved Occ block starting at position i (a multiple of 32), the first position in the highest bit
+#define klcp_interleaved_word(bwt, i) \
+	(bwt_occ_intv(bwt, i)[bwt_occ_cnt_words(bwt) + bwt_occ_bwt_words(bwt) + (((i)&bwt_occ_intv_mask(bwt)) >> 5)])
+
+// the same as decrease_sa_position, the k-LCP bits are next to the Occ counters of the same positions
+static uint64_t decrease_sa_position_interleaved(const bwt_t* bwt, uint64_t k) {
+	if (k == 0) {
+		return 0;
+	}
+	// the last position before k with the zero bit, the bits after k - 1 are masked out
+	uint64_t position = k - 1;
+	uint32_t zeros = ~klcp_interleaved_word(bwt, position & ~31ULL) & ~((1U << (31 - (position & 31))) - 1);
+	position &= ~31ULL;
+	while (!zeros) {
+		if (position == 0) {
+			return 0;
+		}
+		position -= 32;
+		zeros = ~klcp_interleaved_word(bwt, position);
+	}
+	return position + 31 - __builtin_ctz(zeros) + 1;
+}
+
+static uint64_t increase_sa_position_interleaved(const bwt_t* bwt, uint64_t l) {
+	if (l >= bwt->seq_len) {
+		return bwt->seq_len;
+	}
+	// the first position from l with the zero bit, the bits before l are masked out; the bits after the end are zero
+	uint64_t position = l;
+	uint32_t zeros = ~klcp_interleaved_word(bwt, position & ~31ULL) & (0xffffffffU >> (position & 31));
+	position &= ~31ULL;
+	while (!zeros) {
+		position += 32;
+		zeros = ~klcp_interleaved_word(bwt, position);
+	}
+	position += __builtin_clz(zeros);
+	return position < bwt->seq_len ? position : bwt->seq_len;
+}
+
 uint64_t decrease_sa_position(const klcp_t* klcp, uint64_t k) {
+	if (klcp->bwt) {
+		return decrease_sa_position_interleaved(klcp->bwt, k);
+	}
 	int64_t new_position = (int64_t)k - 1;
 	int new_position_found = 0;
 	bitarray_block_t value = klcp->klcp->blocks[new_position / BITS_IN_BLOCK];
@@ -43,6 +91,9 @@ uint64_t decrease_sa_position(const klcp_t* klcp, uint64_t k) {
 }
 
 uint64_t increase_sa_position(const klcp_t* klcp, uint64_t l) {
+	if (klcp->bwt) {
+		return increase_sa_position_interleaved(klcp->bwt, l);
+	}
 	int64_t new_position = (int64_t)l;
 	int new_position_found = 0;
 	bitarray_block_t value = klcp->klcp->blocks[new_position / BITS_IN_BLOCK];
@@ -111,19 +162,6 @@ void klcp_dump(const char* fn, const klcp_t* klcp) {
 	err_fclose(fp);
 }
 
-static bwtint_t fread_fix(FILE* fp, bwtint_t size, void* a) {
-	const int bufsize = 0x1000000;  // 16M block
-	bwtint_t offset = 0;
-	while (size) {
-		int x = bufsize < size ? bufsize : size;
-		if ((x = err_fread_noeof(a + offset, 1, x, fp)) == 0)
-			break;
-		size -= x;
-		offset += x;
-	}
-	return offset;
-}
-
 int32_t find_smallest_zero_index(bitarray_block_t value) {
 	int32_t position = 0;
 	while (position < BITS_IN_BLOCK) {
@@ -148,20 +186,28 @@ int32_t find_biggest_zero_index(bitarray_block_t value) {
 	return position;
 }
 
+static pthread_once_t zero_bit_tables_once = PTHREAD_ONCE_INIT;
+
+static void init_zero_bit_tables() {
+	uint64_t i;
+	for (i = 0; i <= MAX_BITARRAY_BLOCK_VALUE; ++i) {
+		position_of_smallest_zero_bit[i] = find_smallest_zero_index((bitarray_block_t)i);
+		position_of_biggest_zero_bit[i] = find_biggest_zero_index((bitarray_block_t)i);
+	}
+}
+
 void klcp_restore(const char* fn, klcp_t* klcp) {
 	FILE* fp;
 	fp = xopen(fn, "rb");
 	err_fread_noeof(&klcp->seq_len, sizeof(uint64_t), 1, fp);
+	klcp->bwt = NULL;
 	klcp->klcp->size = klcp->seq_len;
 	klcp->klcp->capacity = (klcp->seq_len + BITS_IN_BLOCK - 1) / BITS_IN_BLOCK;
-	klcp->klcp->blocks = (bitarray_block_t*)calloc(klcp->klcp->capacity, sizeof(bitarray_block_t));
-	fread_fix(fp, sizeof(bitarray_block_t) * klcp->klcp->capacity, klcp->klcp->blocks);
+	klcp->klcp->blocks = (bitarray_block_t*)index_malloc(klcp->klcp->capacity * sizeof(bitarray_block_t));
+	index_read(fp, sizeof(bitarray_block_t) * klcp->klcp->capacity, klcp->klcp->blocks);
 	err_fclose(fp);
-	uint64_t i;
-	for (i = 0; i <= MAX_BITARRAY_BLOCK_VALUE; ++i) {
-		position_of_smallest_zero_bit[i] = find_smallest_zero_index((bitarray_block_t)i);
-		position_of_biggest_zero_bit[i] = find_biggest_zero_index((bitarray_block_t)i);
-	}
+	// k-LCP arrays of several shards can be restored at the same time
+	pthread_once(&zero_bit_tables_once, init_zero_bit_tables);
 }
 
 klcp_t* construct_klcp(const bwt_t* bwt, const int kmer_length) {
@@ -171,6 +217,7 @@ klcp_t* construct_klcp(const bwt_t* bwt, const int kmer_length) {
 	klcp_t* klcp = malloc(sizeof(klcp_t));
 	klcp->seq_len = n;
 	klcp->klcp = create_bitarray(n);
+	klcp->bwt = NULL;
 	uint64_t i;
 	for (i = 0; i < klcp->klcp->capacity; ++i) {
 		klcp->klcp->blocks[i] = 0;
@@ -179,3 +226,53 @@ klcp_t* construct_klcp(const bwt_t* bwt, const int kmer_length) {
 	fprintf(stderr, "[prophex:%s] Real time: %.3f sec; CPU: %.3f sec\n", __func__, realtime() - t_real, cputime());
 	return klcp;
 }
+
+void klcp_interleave(bwt_t* bwt, const klcp_t* klcp, int kmer_length) {
+	xassert(klcp->seq_len == bwt->seq_len, "[prophex] k-LCP and BWT are of different lengths");
+	xassert(bwt->seq_len < UINT32_MAX, "[prophex] the interleaved layout is supported only for texts shorter than 2^32");
+	bwt_t il = *bwt;
+	il.occ32 = 1;
+	il.occ_intv_shift = OCC_INTV_SHIFT;
+	il.klcp_k = kmer_length;
+	// full blocks up to the end, so that the k-LCP bits of the last one are at the usual place
+	bwtint_t n_blocks = (bwt->seq_len >> OCC_INTV_SHIFT) + 1;
+	uint32_t block_words = bwt_occ_block_words(&il), bwt_words = bwt_occ_bwt_words(&il), cnt_words = bwt_occ_cnt_words(&il);
+	il.bwt_size = n_blocks * block_words;
+	void* buf;
+	xassert(posix_memalign(&buf, 64, il.bwt_size * 4) == 0, "[prophex] can not allocate memory for the interleaved BWT");
+	il.bwt = memset(buf, 0, il.bwt_size * 4);
+	bwtint_t b, cnt[4] = {0, 0, 0, 0};
+	for (b = 0; b < n_blocks; ++b) {
+		uint32_t* p = il.bwt + b * block_words;
+		uint32_t w;
+		for (w = 0; w < 4; ++w) {
+			p[w] = cnt[w];
+		}
+		for (w = 0; w < bwt_words; ++w) {
+			bwtint_t position = (b << OCC_INTV_SHIFT) + w * 16, j;
+			if (position >= bwt->seq_len) {
+				break;
+			}
+			uint32_t word = bwt_bwt(bwt, position);
+			p[cnt_words + w] = word;
+			for (j = 0; j < 16 && position + j < bwt->seq_len; ++j) {
+				++cnt[word >> ((15 - j) << 1) & 3];
+			}
+		}
+		for (w = 0; w < block_words - cnt_words - bwt_words; ++w) {
+			bwtint_t i = ((b << OCC_INTV_SHIFT) + w * 32) / BITS_IN_BLOCK;
+			if (i < klcp->klcp->capacity) {
+				p[cnt_words + bwt_words + w] = (uint32_t)klcp->klcp->blocks[i] << 16 | (i + 1 < klcp->klcp->capacity ? klcp->klcp->blocks[i + 1] : 0);
+			}
+		}
+	}
+	free(bwt->bwt);
+	*bwt = il;
+}
+
+klcp_t* klcp_from_interleaved_bwt(const bwt_t* bwt) {
+	klcp_t* klcp = calloc(1, sizeof(klcp_t));
+	klcp->seq_len = bwt->seq_len;
+	klcp->bwt = bwt;
+	return klcp;
+}
@@ -13,6 +13,8 @@
 typedef struct {
 	uint64_t seq_len;
 	bitarray_t* klcp;
+	// BWT in the interleaved layout holding the k-LCP bits in its Occ blocks (then klcp is NULL), or NULL
+	const bwt_t* bwt;
 } klcp_t;
 
 void destroy_klcp(klcp_t* klcp);
@@ -21,5 +23,9 @@ klcp_t* construct_klcp(const bwt_t* bwt, const int kmer_length);
 void klcp_restore(const char* fn, klcp_t* klcp);
 uint64_t decrease_sa_position(const klcp_t* klcp, uint64_t position);
 uint64_t increase_sa_position(const klcp_t* klcp, uint64_t position);
+// converts the BWT into the interleaved layout: 64-byte blocks of Occ counters, 128 BWT characters and their k-LCP bits
+void klcp_interleave(bwt_t* bwt, const klcp_t* klcp, int kmer_length);
+// k-LCP view of a BWT in the interleaved layout
+klcp_t* klcp_from_interleaved_bwt(const bwt_t* bwt);
 
 #endif  // KLCP_H
@@ -0,0 +1,172 @@
+#include "libprophex.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bntseq.h"
+#include "contig_node_translator.h"
+#include "klcp.h"
+#include "prophex_query.h"
+#include "prophex_utils.h"
+
+struct prophex_idx_s {
+	prophex_index_t* index;
+	prophex_opt_t* opt;
+};
+
+struct prophex_ctx_s {
+	const prophex_idx_t* idx;
+	prophex_query_aux_t aux_data;
+	// the read, 2-bit encoded and reversed as the reads of prophex query
+	ubyte_t* seq;
+	int seq_capacity;
+};
+
+prophex_idx_t* prophex_idx_load(const char** prefixes, int prefixes_cnt, int kmer_length, int flags) {
+	prophex_opt_t* opt = prophex_init_opt();
+	opt->kmer_length = kmer_length;
+	opt->use_klcp = (flags & PROPHEX_KLCP) != 0;
+	opt->use_fmd = (flags & PROPHEX_FMD) != 0;
+	opt->skip_positions_on_border = (flags & PROPHEX_BORDER_KMERS) == 0;
+	opt->huge_pages = (flags & PROPHEX_HUGE_PAGES) != 0;
+	const char* occ_kernel = getenv("PROPHEX_OCC_KERNEL");
+	if (bwt_occ_set_kernel(occ_kernel) < 0) {
+		fprintf(stderr, "[prophex:%s] Occ kernel %s is not supported, using the default one\n", __func__, occ_kernel);
+		bwt_occ_set_kernel(NULL);
+	}
+	if (opt->use_klcp && opt->use_fmd) {
+		fprintf(stderr, "[prophex:%s] PROPHEX_KLCP and PROPHEX_FMD can not be used together\n", __func__);
+		free(opt);
+		return NULL;
+	}
+	// every read is queried against all shards at once, so they are all kept in memory
+	prophex_index_t* index = query_index_load(prefixes, prefixes_cnt, opt);
+	if (index == NULL) {
+		free(opt);
+		return NULL;
+	}
+	prophex_idx_t* idx = malloc(sizeof(prophex_idx_t));
+	idx->index = index;
+	idx->opt = opt;
+	return idx;
+}
+
+int prophex_idx_attach_klcp(prophex_idx_t* idx, int kmer_length) {
+	prophex_index_t* index = idx->index;
+	if (idx->opt->use_fmd) {
+		fprintf(stderr, "[prophex:%s] k-LCP can not be used with bidirectional search\n", __func__);
+		return -1;
+	}
+	char* suffix = klcp_file_name("", kmer_length);
+	int s;
+	for (s = 0; s < index->shards_cnt; ++s) {
+		const prophex_shard_t* shard = &index->shards[s];
+		// k-LCP of an interleaved BWT is a part of it and can not be replaced
+		int is_interleaved = shard->idx->bwt->klcp_k != 0;
+		if ((is_interleaved && shard->idx->bwt->klcp_k != kmer_length) || (!is_interleaved && file_size(shard->prefix, suffix) <= 0)) {
+			fprintf(stderr, "[prophex:%s] %s has no k-LCP for k=%d\n", __func__, shard->prefix, kmer_length);
+			free(suffix);
+			return -1;
+		}
+	}
+	for (s = 0; s < index->shards_cnt; ++s) {
+		prophex_shard_t* shard = &index->shards[s];
+		if (shard->idx->bwt->klcp_k) {
+			continue;
+		}
+		if (shard->klcp) {
+			destroy_klcp(shard->klcp);
+		}
+		char* fn = klcp_file_name(shard->prefix, kmer_length);
+		shard->klcp = malloc(sizeof(klcp_t));
+		shard->klcp->klcp = malloc(sizeof(bitarray_t));
+		klcp_restore(fn, shard->klcp);
+		free(fn);
+	}
+	free(suffix);
+	idx->opt->kmer_length = kmer_length;
+	idx->opt->use_klcp = 1;
+	return 0;
+}
+
+void prophex_idx_destroy(prophex_idx_t* idx) {
+	if (!idx) {
+		return;
+	}
+	query_index_destroy(idx->index, idx->opt);
+	free(idx->opt);
+	free(idx);
+}
+
+int prophex_idx_kmer_length(const prophex_idx_t* idx) { return idx->opt->kmer_length; }
+
+int prophex_idx_nodes_count(const prophex_idx_t* idx) { return get_nodes_count(); }
+
+const char* prophex_idx_node_name(const prophex_idx_t* idx, int32_t node) { return get_node_name(node); }
+
+prophex_ctx_t* prophex_ctx_init(const prophex_idx_t* idx) {
+	prophex_ctx_t* ctx = calloc(1, sizeof(prophex_ctx_t));
+	ctx->idx = idx;
+	prophex_aux_data_init(&ctx->aux_data);
+	return ctx;
+}
+
+void prophex_ctx_destroy(prophex_ctx_t* ctx) {
+	if (!ctx) {
+		return;
+	}
+	prophex_aux_data_destroy(&ctx->aux_data);
+	free(ctx->seq);
+	free(ctx);
+}
+
+// k-mers are in the same streak if both have an ambiguous base or both have the same nodes
+static int is_same_streak(const kmer_node_sets_t* sets, const int8_t* is_ambiguous_kmer, int a, int b) {
+	if (is_ambiguous_kmer[a] || is_ambiguous_kmer[b]) {
+		return is_ambiguous_kmer[a] && is_ambiguous_kmer[b];
+	}
+	size_t nodes_cnt = sets->offsets[a + 1] - sets->offsets[a];
+	return nodes_cnt == sets->offsets[b + 1] - sets->offsets[b] &&
+	       memcmp(sets->nodes + sets->offsets[a], sets->nodes + sets->offsets[b], nodes_cnt * sizeof(int32_t)) == 0;
+}
+
+int prophex_query_read(prophex_ctx_t* ctx, const char* seq, int l_seq, prophex_kmer_f kmer_func, prophex_streak_f streak_func, void* data) {
+	const prophex_index_t* index = ctx->idx->index;
+	const prophex_opt_t* opt = ctx->idx->opt;
+	prophex_query_aux_t* aux_data = &ctx->aux_data;
+	int kmers_cnt = l_seq - opt->kmer_length + 1;
+	if (kmers_cnt <= 0) {
+		return 0;
+	}
+	if (l_seq > ctx->seq_capacity) {
+		ctx->seq_capacity = l_seq;
+		ctx->seq = realloc(ctx->seq, l_seq * sizeof(ubyte_t));
+	}
+	int i;
+	for (i = 0; i < l_seq; ++i) {
+		ctx->seq[l_seq - 1 - i] = nst_nt4_table[(int)(unsigned char)seq[i]];
+	}
+	bseq1_t read;
+	memset(&read, 0, sizeof(bseq1_t));
+	read.l_seq = l_seq;
+	read.seq = (char*)ctx->seq;
+	prepare_read_kmers(index->shards, index->shards_cnt, opt, &read, aux_data);
+	query_shards_kmers(index->shards, index->shards_cnt, opt, &read, aux_data);
+
+	// k-mers of the reversed read come in the reverse order
+	const kmer_node_sets_t* sets = &aux_data->merged_sets;
+	const int8_t* is_ambiguous_kmer = aux_data->is_ambiguous_kmer;
+	int streak_start = kmers_cnt - 1;
+	int start_pos;
+	for (start_pos = kmers_cnt - 1; start_pos >= 0; --start_pos) {
+		const int32_t* nodes = sets->nodes + sets->offsets[start_pos];
+		int nodes_cnt = is_ambiguous_kmer[start_pos] ? -1 : (int)(sets->offsets[start_pos + 1] - sets->offsets[start_pos]);
+		if (kmer_func) {
+			kmer_func(data, kmers_cnt - 1 - start_pos, nodes, nodes_cnt);
+		}
+		if (streak_func && (start_pos == 0 || !is_same_streak(sets, is_ambiguous_kmer, start_pos, start_pos - 1))) {
+			streak_func(data, nodes, nodes_cnt, streak_start - start_pos + 1);
+			streak_start = start_pos - 1;
+		}
+	}
+	return kmers_cnt;
+}
@@ -0,0 +1,60 @@
+/*
+    libprophex: querying a ProPhex index from other programs, without running prophex query and parsing its output.
+    Licence: MIT
+
+    An index is loaded once and queried by any number of threads, each with its own context:
+
+        prophex_idx_t* idx = prophex_idx_load(prefixes, prefixes_cnt, 31, PROPHEX_KLCP);
+        prophex_ctx_t* ctx = prophex_ctx_init(idx);
+        prophex_query_read(ctx, seq, l_seq, NULL, streak_func, data);
+        prophex_ctx_destroy(ctx);
+        prophex_idx_destroy(idx);
+
+    Link with libprophex.a -lm -lz -lpthread. Nodes are numbered in the order of the contig names of the index (their parts
+    before '@'), as in the output of prophex query. Only one index can be loaded in a process at a time. The Occ kernel is
+    selected when the index is loaded, as by prophex: by PROPHEX_OCC_KERNEL or the fastest one the CPU supports.
+*/
+
+#ifndef LIBPROPHEX_H
+#define LIBPROPHEX_H
+
+#include <stdint.h>
+
+// flags of prophex_idx_load, as the options of prophex query
+// use k-LCP (-u), the index must have it for the k-mer length
+#define PROPHEX_KLCP 0x1
+// use bidirectional search in the FMD-index (-d)
+#define PROPHEX_FMD 0x2
+// report the nodes of k-mers on the border of two contigs (-p)
+#define PROPHEX_BORDER_KMERS 0x4
+// back the index with huge pages (-H)
+#define PROPHEX_HUGE_PAGES 0x8
+
+typedef struct prophex_idx_s prophex_idx_t;
+typedef struct prophex_ctx_s prophex_ctx_t;
+
+// called for the k-th k-mer of the read with its sorted nodes, nodes_cnt is -1 for a k-mer with an ambiguous base
+typedef void (*prophex_kmer_f)(void* data, int kmer, const int32_t* nodes, int nodes_cnt);
+// called for every streak of consecutive k-mers with the same nodes (one line field of prophex query), in the read order;
+// nodes_cnt is -1 for a streak of k-mers with an ambiguous base
+typedef void (*prophex_streak_f)(void* data, const int32_t* nodes, int nodes_cnt, int kmers_cnt);
+
+// loads BWT, SA and annotations of all indexes (shards of one reference), and k-LCP with PROPHEX_KLCP; returns NULL on error
+prophex_idx_t* prophex_idx_load(const char** prefixes, int prefixes_cnt, int kmer_length, int flags);
+// loads the k-LCP of all shards for the k-mer length, which is then used for querying instead of the previous one;
+// must not be called while the index is queried, returns 0 on success
+int prophex_idx_attach_klcp(prophex_idx_t* idx, int kmer_length);
+void prophex_idx_destroy(prophex_idx_t* idx);
+int prophex_idx_kmer_length(const prophex_idx_t* idx);
+int prophex_idx_nodes_count(const prophex_idx_t* idx);
+const char* prophex_idx_node_name(const prophex_idx_t* idx, int32_t node);
+
+// buffers of one querying thread
+prophex_ctx_t* prophex_ctx_init(const prophex_idx_t* idx);
+void prophex_ctx_destroy(prophex_ctx_t* ctx);
+
+// queries all k-mers of the read (ACGT, other characters are ambiguous bases) and reports them to the functions which are
+// not NULL; the nodes passed to them are valid until the next query with the context; returns the number of k-mers
+int prophex_query_read(prophex_ctx_t* ctx, const char* seq, int l_seq, prophex_kmer_f kmer_func, prophex_streak_f streak_func, void* data);
+
+#endif  // LIBPROPHEX_H
@@ -20,6 +20,7 @@
 #include "bwa_utils.h"
 #include "prophex_build.h"
 #include "prophex_query.h"
+#include "prophex_serve.h"
 #include "version.h"
 
 static int usage() {
@@ -33,8 +34,11 @@ static int usage() {
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Command: index           construct a BWA index and k-LCP\n");
 	fprintf(stderr, "         query           query reads against index\n");
+	fprintf(stderr, "         serve           query reads coming over a Unix domain socket, with the index loaded once\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "         klcp            construct an additional k-LCP\n");
+	fprintf(stderr, "         interleave      merge BWT and k-LCP into a layout faster for querying with k-LCP\n");
+	fprintf(stderr, "         rlbwt           run-length encode BWT, smaller for references of many similar genomes\n");
 	fprintf(stderr, "         bwtdowngrade    downgrade .bwt to the old, more compact format without Occ\n");
 	fprintf(stderr, "         bwt2fa          reconstruct FASTA from BWT\n");
 	fprintf(stderr, "\n");
@@ -48,17 +52,48 @@ static int usage_klcp() {
 	fprintf(stderr, "Options: -k INT    length of k-mer\n");
 	fprintf(stderr, "         -s        construct k-LCP and SA in parallel\n");
 	fprintf(stderr, "         -i        sampling distance for SA\n");
+	fprintf(stderr, "         -c        bit-pack SA samples to the bits needed for the reference length (smaller .sa)\n");
+	fprintf(stderr, "         -T        sample SA every -i text positions instead of rows (at most -i - 1 LF steps per position, bit-packed)\n");
+	fprintf(stderr, "         -n        store the contig of every SA sample (.san), so that positions are resolved to contigs without search\n");
 	fprintf(stderr, "         -h        print help message\n");
 	fprintf(stderr, "\n");
 	return 1;
 }
 
+static int usage_interleave() {
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Usage:   prophex interleave [options] <idxbase>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Options: -k INT    length of k-mer of the k-LCP\n");
+	fprintf(stderr, "         -h        print help message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Writes <idxbase>.<k>.ibwt, used by query -u instead of .bwt and .<k>.klcp when present.\n");
+	fprintf(stderr, "\n");
+	return 1;
+}
+
+static int usage_rlbwt() {
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Usage:   prophex rlbwt [options] <idxbase>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Options: -h        print help message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Writes <idxbase>.rlbwt, used by query instead of .bwt when present (.bwt can then be removed).\n");
+	fprintf(stderr, "\n");
+	return 1;
+}
+
 static int usage_index() {
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Usage:   prophex index [options] <idxbase>\n");
 	fprintf(stderr, "Options: -k INT    k-mer length for k-LCP\n");
 	fprintf(stderr, "         -s        construct k-LCP and SA in parallel\n");
 	fprintf(stderr, "         -i        sampling distance for SA\n");
+	fprintf(stderr, "         -c        bit-pack SA samples to the bits needed for the reference length (smaller .sa)\n");
+	fprintf(stderr, "         -T        sample SA every -i text positions instead of rows (at most -i - 1 LF steps per position, bit-packed)\n");
+	fprintf(stderr, "         -n        store the contig of every SA sample (.san), so that positions are resolved to contigs without search\n");
+	fprintf(stderr, "         -f        index only the forward strand (half the memory, reverse complements are searched at query time)\n");
+	fprintf(stderr, "         -o INT    sampling interval of Occ counters: 64 (faster), 128, 256 or 512 (smaller) [128]\n");
 	fprintf(stderr, "         -h        print help message\n");
 	fprintf(stderr, "\n");
 	return 1;
@@ -82,27 +117,81 @@ static int usage_bwt2fa() {
 
 static int usage_query(int threads) {
 	fprintf(stderr, "\n");
-	fprintf(stderr, "Usage:   prophex query [options] <idxbase> <in.fq>\n");
+	fprintf(stderr, "Usage:   prophex query [options] <idxbase> [<idxbase> ...] <in.fq>\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Options: -k INT    length of k-mer\n");
 	fprintf(stderr, "         -u        use k-LCP for querying\n");
+	fprintf(stderr, "         -d        use bidirectional search in the FMD-index instead of k-LCP (both strands at once, no k-LCP needed)\n");
 	fprintf(stderr, "         -v        output set of chromosomes for every k-mer\n");
 	fprintf(stderr, "         -p        do not check whether k-mer is on border of two contigs, and show such k-mers in output\n");
 	fprintf(stderr, "         -b        print sequences and base qualities\n");
+	fprintf(stderr, "         -B        binary output: node-set IDs and lengths of streaks, with a dictionary of node sets (see README)\n");
+	fprintf(stderr, "         -W        do not write read names to the binary output\n");
+	fprintf(stderr, "         -z        compress the output (BGZF, readable by gzip), with all threads\n");
+	fprintf(stderr, "         -O        write reads as soon as they are matched, in any order, with their numbers in the input\n");
+	fprintf(stderr, "                   (from 0) as the last column\n");
+	fprintf(stderr, "         -A FILE   assign reads to the nodes of the Newick tree (columns 1 and 3, hits and covered bases of the\n");
+	fprintf(stderr, "                   best nodes are added as columns 6 and 7)\n");
+	fprintf(stderr, "         -M STR    measure of the assignment: h1 (k-mer hits) or c1 (covered bases) [h1]\n");
 	fprintf(stderr, "         -l STR    log file name to output statistics\n");
 	fprintf(stderr, "         -t INT    number of threads [%d]\n", threads);
+	fprintf(stderr, "         -L INT    reads with more k-mers are split into segments matched by separate threads [%d]\n", LONG_READ_SEGMENT);
+	fprintf(stderr, "         -C INT    base pairs of reads matched together, 0 = adaptive (sized by the matching time, up to %d) [0]\n",
+	        READ_CHUNK_SIZE);
+	fprintf(stderr, "         -m FLOAT  memory budget in MB for several index shards, shards exceeding it are queried in turn [0 = unlimited]\n");
+	fprintf(stderr, "         -H        back BWT, SA and k-LCP with huge pages (reserved 1 GB or 2 MB pages, transparent ones otherwise)\n");
+	fprintf(stderr, "         -N STR    NUMA placement: replicate (copy of the index on every node) or interleave (pages spread over nodes),\n");
+	fprintf(stderr, "                   threads are pinned to the nodes in turn\n");
 	fprintf(stderr, "         -h        print help message\n");
 	fprintf(stderr, "\n");
+	fprintf(stderr, "Several indexes (shards of one reference) can be given, k-mer matches are then merged over all of them.\n");
+	fprintf(stderr, "\n");
 	return 1;
 }
 
-int prophex_query(int argc, char *argv[]) {
+static int usage_serve(int threads) {
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Usage:   prophex serve [options] <idxbase> [<idxbase> ...] <socket>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Options: -k INT    length of k-mer\n");
+	fprintf(stderr, "         -u        use k-LCP for querying\n");
+	fprintf(stderr, "         -d        use bidirectional search in the FMD-index instead of k-LCP (both strands at once, no k-LCP needed)\n");
+	fprintf(stderr, "         -p        do not check whether k-mer is on border of two contigs, and show such k-mers in output\n");
+	fprintf(stderr, "         -b        print sequences and base qualities\n");
+	fprintf(stderr, "         -B        binary output: node-set IDs and lengths of streaks, with a dictionary of node sets (see README)\n");
+	fprintf(stderr, "         -W        do not write read names to the binary output\n");
+	fprintf(stderr, "         -z        compress the output (BGZF, readable by gzip), with all threads\n");
+	fprintf(stderr, "         -O        write reads as soon as they are matched, in any order, with their numbers in the input\n");
+	fprintf(stderr, "                   (from 0) as the last column\n");
+	fprintf(stderr, "         -A FILE   assign reads to the nodes of the Newick tree (columns 1 and 3, hits and covered bases of the\n");
+	fprintf(stderr, "                   best nodes are added as columns 6 and 7)\n");
+	fprintf(stderr, "         -M STR    measure of the assignment: h1 (k-mer hits) or c1 (covered bases) [h1]\n");
+	fprintf(stderr, "         -l STR    log file name to output statistics\n");
+	fprintf(stderr, "         -t INT    number of threads, shared by all connections [%d]\n", threads);
+	fprintf(stderr, "         -L INT    reads with more k-mers are split into segments matched by separate threads [%d]\n", LONG_READ_SEGMENT);
+	fprintf(stderr, "         -C INT    base pairs of reads matched together, 0 = adaptive (sized by the matching time, up to %d) [0]\n",
+	        READ_CHUNK_SIZE);
+	fprintf(stderr, "         -m FLOAT  memory budget in MB for several index shards, shards exceeding it are queried in turn [0 = unlimited]\n");
+	fprintf(stderr, "         -H        back BWT, SA and k-LCP with huge pages (reserved 1 GB or 2 MB pages, transparent ones otherwise)\n");
+	fprintf(stderr, "         -N STR    NUMA placement: replicate (copy of the index on every node) or interleave (pages spread over nodes),\n");
+	fprintf(stderr, "                   threads are pinned to the nodes in turn\n");
+	fprintf(stderr, "         -h        print help message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Loads the index once and listens on the Unix domain socket. Every connection sends reads (FASTA/FASTQ, possibly\n");
+	fprintf(stderr, "gzipped), shuts down its writing side and receives the output of prophex query for them. The output of every\n");
+	fprintf(stderr, "chunk of reads is sent as soon as it is matched, so clients must receive it while sending the reads (e.g., by\n");
+	fprintf(stderr, "another thread), otherwise both sides block once the output does not fit into the socket buffers.\n");
+	fprintf(stderr, "\n");
+	return 1;
+}
+
+// query and serve take the same options, serve answers reads coming over a socket instead of those of a file
+static int prophex_query_command(int argc, char *argv[], int is_serve) {
 	int c;
 	prophex_opt_t *opt;
-	char *prefix;
 	int usage = 0;
 	opt = prophex_init_opt();
-	while ((c = getopt(argc, argv, "l:psuvk:bt:h")) >= 0) {
+	while ((c = getopt(argc, argv, "l:psudvk:bBWzOA:M:t:L:C:m:HN:h")) >= 0) {
 		switch (c) {
 			case 'v': {
 				opt->output_old = 1;
@@ -111,6 +200,22 @@ int prophex_query(int argc, char *argv[]) {
 			case 'u':
 				opt->use_klcp = 1;
 				break;
+			case 'd':
+				opt->use_fmd = 1;
+				break;
+			case 'H':
+				opt->huge_pages = 1;
+				break;
+			case 'N':
+				if (strcmp(optarg, "replicate") == 0) {
+					opt->numa_mode = NUMA_REPLICATE;
+				} else if (strcmp(optarg, "interleave") == 0) {
+					opt->numa_mode = NUMA_INTERLEAVE;
+				} else {
+					fprintf(stderr, "[prophex:%s] NUMA placement must be replicate or interleave\n", __func__);
+					return 1;
+				}
+				break;
 			case 'k':
 				opt->kmer_length = atoi(optarg);
 				break;
@@ -128,9 +233,43 @@ int prophex_query(int argc, char *argv[]) {
 			case 'b':
 				opt->output_read_qual = 1;
 				break;
+			case 'B':
+				opt->output_binary = 1;
+				break;
+			case 'W':
+				opt->output_binary_names = 0;
+				break;
+			case 'z':
+				opt->output_compressed = 1;
+				break;
+			case 'O':
+				opt->output_unordered = 1;
+				break;
+			case 'A':
+				opt->tree_file_name = optarg;
+				break;
+			case 'M':
+				if (strcmp(optarg, "h1") == 0) {
+					opt->assign_measure = ASSIGN_H1;
+				} else if (strcmp(optarg, "c1") == 0) {
+					opt->assign_measure = ASSIGN_C1;
+				} else {
+					fprintf(stderr, "[prophex:%s] measure of the assignment must be h1 or c1\n", __func__);
+					return 1;
+				}
+				break;
 			case 't':
 				opt->n_threads = atoi(optarg);
 				break;
+			case 'L':
+				opt->long_read_segment = atoi(optarg);
+				break;
+			case 'C':
+				opt->read_chunk_size = atoi(optarg);
+				break;
+			case 'm':
+				opt->shards_memory_budget = (int64_t)(atof(optarg) * (1 << 20));
+				break;
 			case 'h':
 				usage = 1;
 				break;
@@ -139,29 +278,66 @@ int prophex_query(int argc, char *argv[]) {
 		}
 	}
 	if (usage) {
-		usage_query(opt->n_threads);
+		is_serve ? usage_serve(opt->n_threads) : usage_query(opt->n_threads);
 		return 0;
 	}
+	if (opt->output_old && is_serve) {
+		fprintf(stderr, "[prophex:%s] -v option can not be used with serve\n", __func__);
+		return 1;
+	}
 	if (opt->output_old && opt->n_threads > 1) {
 		fprintf(stderr, "[prophex:%s] -v option can be used only with one thread (-t 1)\n", __func__);
 		return 1;
 	}
+	if (opt->use_klcp && opt->use_fmd) {
+		fprintf(stderr, "[prophex:%s] -u and -d options can not be used together\n", __func__);
+		return 1;
+	}
+	if (opt->output_unordered && (opt->output_old || opt->output_binary)) {
+		fprintf(stderr, "[prophex:%s] -O option can not be used with -v or -B\n", __func__);
+		return 1;
+	}
+	if (opt->tree_file_name && (opt->output_old || opt->output_binary)) {
+		fprintf(stderr, "[prophex:%s] -A option can not be used with -v or -B\n", __func__);
+		return 1;
+	}
+	if (opt->output_binary && (opt->output_old || opt->output_read_qual)) {
+		fprintf(stderr, "[prophex:%s] -B option can not be used with -v or -b\n", __func__);
+		return 1;
+	}
 
 	if (optind + 2 > argc) {
-		usage_query(opt->n_threads);
+		is_serve ? usage_serve(opt->n_threads) : usage_query(opt->n_threads);
 		return 1;
 	}
-	if ((prefix = bwa_idx_infer_prefix(argv[optind])) == 0) {
-		fprintf(stderr, "[prophex:%s] fail to locate the index %s\n", __func__, argv[optind]);
-		free(opt);
-		return 1;
+	int prefixes_cnt = argc - optind - 1;
+	char **prefixes = malloc(prefixes_cnt * sizeof(char *));
+	int i;
+	for (i = 0; i < prefixes_cnt; ++i) {
+		if ((prefixes[i] = index_infer_prefix(argv[optind + i])) == 0) {
+			fprintf(stderr, "[prophex:%s] fail to locate the index %s\n", __func__, argv[optind + i]);
+			free(opt);
+			return 1;
+		}
+	}
+	int ret = 0;
+	if (is_serve) {
+		ret = serve((const char **)prefixes, prefixes_cnt, argv[argc - 1], opt);
+	} else {
+		ret = query((const char **)prefixes, prefixes_cnt, argv[argc - 1], opt);
+	}
+	for (i = 0; i < prefixes_cnt; ++i) {
+		free(prefixes[i]);
 	}
-	query(prefix, argv[optind + 1], opt);
+	free(prefixes);
 	free(opt);
-	free(prefix);
-	return 0;
+	return ret;
 }
 
+int prophex_query(int argc, char *argv[]) { return prophex_query_command(argc, argv, 0); }
+
+int prophex_serve(int argc, char *argv[]) { return prophex_query_command(argc, argv, 1); }
+
 int prophex_klcp(int argc, char *argv[]) {
 	int c;
 	prophex_opt_t *opt;
@@ -169,7 +345,7 @@ int prophex_klcp(int argc, char *argv[]) {
 	opt = prophex_init_opt();
 	int sa_intv = 32;
 	int usage = 0;
-	while ((c = getopt(argc, argv, "si:k:h")) >= 0) {
+	while ((c = getopt(argc, argv, "cTnsi:k:h")) >= 0) {
 		switch (c) {
 			case 'k':
 				opt->kmer_length = atoi(optarg);
@@ -180,6 +356,15 @@ int prophex_klcp(int argc, char *argv[]) {
 			case 's':
 				opt->construct_sa_parallel = 1;
 				break;
+			case 'c':
+				opt->pack_sa = 1;
+				break;
+			case 'T':
+				opt->text_sa = 1;
+				break;
+			case 'n':
+				opt->sa_contigs = 1;
+				break;
 			case 'h':
 				usage = 1;
 				break;
@@ -204,11 +389,73 @@ int prophex_klcp(int argc, char *argv[]) {
 	return 0;
 }
 
+int prophex_interleave(int argc, char *argv[]) {
+	int c;
+	char *prefix;
+	int kmer_length = 0;
+	int usage = 0;
+	while ((c = getopt(argc, argv, "k:h")) >= 0) {
+		switch (c) {
+			case 'k':
+				kmer_length = atoi(optarg);
+				break;
+			case 'h':
+				usage = 1;
+				break;
+			default:
+				return 1;
+		}
+	}
+	if (usage) {
+		usage_interleave();
+		return 0;
+	}
+	if (optind + 1 > argc || kmer_length <= 0) {
+		usage_interleave();
+		return 1;
+	}
+	if ((prefix = bwa_idx_infer_prefix(argv[optind])) == 0) {
+		fprintf(stderr, "[prophex:%s] fail to locate the index %s\n", __func__, argv[optind]);
+		return 1;
+	}
+	int ret = build_interleaved_bwt(prefix, kmer_length);
+	free(prefix);
+	return ret;
+}
+
+int prophex_rlbwt(int argc, char *argv[]) {
+	int c;
+	char *prefix;
+	int usage = 0;
+	while ((c = getopt(argc, argv, "h")) >= 0) {
+		switch (c) {
+			case 'h':
+				usage = 1;
+				break;
+			default:
+				return 1;
+		}
+	}
+	if (usage) {
+		usage_rlbwt();
+		return 0;
+	}
+	if (optind + 1 > argc) {
+		usage_rlbwt();
+		return 1;
+	}
+	if ((prefix = bwa_idx_infer_prefix(argv[optind])) == 0) {
+		fprintf(stderr, "[prophex:%s] fail to locate the index %s\n", __func__, argv[optind]);
+		return 1;
+	}
+	int ret = build_rlbwt(prefix);
+	free(prefix);
+	return ret;
+}
+
 int bwa_fa2pac(int argc, char *argv[]);
 int bwa_pac2bwt(int argc, char *argv[]);
 int bwt_bwtgen_main(int argc, char *argv[]);
-int bwa_bwtupdate(int argc, char *argv[]);
-int bwa_bwt2sa(int argc, char *argv[]);
 
 int prophex_index(int argc, char *argv[]) {
 	int c;
@@ -216,7 +463,9 @@ int prophex_index(int argc, char *argv[]) {
 	opt = prophex_init_opt();
 	int sa_intv = 32;
 	int usage = 0;
-	while ((c = getopt(argc, argv, "si:k:h")) >= 0) {
+	int forward_only = 0;
+	int occ_intv = 128;
+	while ((c = getopt(argc, argv, "fcTnsi:o:k:h")) >= 0) {
 		switch (c) {
 			case 'k':
 				opt->kmer_length = atoi(optarg);
@@ -227,6 +476,21 @@ int prophex_index(int argc, char *argv[]) {
 			case 's':
 				opt->construct_sa_parallel = 1;
 				break;
+			case 'c':
+				opt->pack_sa = 1;
+				break;
+			case 'T':
+				opt->text_sa = 1;
+				break;
+			case 'n':
+				opt->sa_contigs = 1;
+				break;
+			case 'f':
+				forward_only = 1;
+				break;
+			case 'o':
+				occ_intv = atoi(optarg);
+				break;
 			case 'h':
 				usage = 1;
 				break;
@@ -238,6 +502,13 @@ int prophex_index(int argc, char *argv[]) {
 		usage_index();
 		return 0;
 	}
+	int occ_intv_shift;
+	for (occ_intv_shift = 6; occ_intv_shift <= 9 && (1 << occ_intv_shift) != occ_intv; ++occ_intv_shift)
+		;
+	if (occ_intv_shift > 9) {
+		fprintf(stderr, "[prophex:%s] Occ sampling interval must be 64, 128, 256 or 512\n", __func__);
+		return 1;
+	}
 	if (optind + 1 > argc) {
 		usage_index();
 		return 1;
@@ -253,27 +524,31 @@ int prophex_index(int argc, char *argv[]) {
 	strcpy(arguments[1], prefix);
 	strcpy(arguments[2], prefix);
 	optind = 1;
-	bwa_fa2pac(3, arguments);
+	if (forward_only) {
+		char *fa2pac_arguments[4] = {arguments[0], "-f", arguments[1], arguments[2]};
+		bwa_fa2pac(4, fa2pac_arguments);
+	} else {
+		bwa_fa2pac(3, arguments);
+	}
+	// annotations in binary form, loaded much faster than .ann with many contigs
+	bns_dump_binary(prefix);
 	strcpy(arguments[0], "pac2bwt");
 	strcat(arguments[1], ".pac");
 	strcat(arguments[2], ".bwt");
 	optind = 1;
 	bwt_bwtgen_main(3, arguments);
-	strcpy(arguments[0], "bwtupdate");
 	strcpy(arguments[1], prefix);
 	strcat(arguments[1], ".bwt");
-	optind = 1;
-	bwa_bwtupdate(2, arguments);
+	bwa_bwtupdate_compact(arguments[1], occ_intv_shift);
 	if (opt->construct_sa_parallel) {
 		build_klcp(prefix, opt, sa_intv);
 	} else {
-		strcpy(arguments[0], "bwt2sa");
-		strcpy(arguments[1], prefix);
-		strcat(arguments[1], ".bwt");
 		strcpy(arguments[2], prefix);
 		strcat(arguments[2], ".sa");
-		optind = 1;
-		bwa_bwt2sa(3, arguments);
+		bwa_bwt2sa_compact(arguments[1], arguments[2], sa_intv, opt->pack_sa, opt->text_sa);
+		if (opt->sa_contigs) {
+			sa_contigs_dump(prefix);
+		}
 	}
 	free(prefix);
 	return 0;
@@ -329,12 +604,23 @@ int main(int argc, char *argv[]) {
 		usage();
 		return 0;
 	}
+	const char* occ_kernel = getenv("PROPHEX_OCC_KERNEL");
+	if (bwt_occ_set_kernel(occ_kernel) < 0) {
+		fprintf(stderr, "[prophex:%s] Occ kernel %s is not supported, using the default one\n", __func__, occ_kernel);
+		bwt_occ_set_kernel(NULL);
+	}
 	if (strcmp(argv[1], "klcp") == 0)
 		ret = prophex_klcp(argc - 1, argv + 1);
 	else if (strcmp(argv[1], "query") == 0)
 		ret = prophex_query(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "serve") == 0)
+		ret = prophex_serve(argc - 1, argv + 1);
 	else if (strcmp(argv[1], "index") == 0)
 		ret = prophex_index(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "interleave") == 0)
+		ret = prophex_interleave(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "rlbwt") == 0)
+		ret = prophex_rlbwt(argc - 1, argv + 1);
 	else if (strcmp(argv[1], "bwtdowngrade") == 0)
 		ret = prophex_bwtdowngrade(argc - 1, argv + 1);
 	else if (strcmp(argv[1], "bwt2fa") == 0)
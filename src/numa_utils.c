@@ -0,0 +1,99 @@
+#define _GNU_SOURCE
+#include "numa_utils.h"
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// memory policies of set_mempolicy(2)
+#define MPOL_DEFAULT 0
+#define MPOL_PREFERRED 1
+#define MPOL_INTERLEAVE 3
+#define MAX_NUMA_NODES 64
+
+// parses a list like "0-3,8,10-11" into the set, returns the number of items (bits) set
+static int parse_list(const char* fn, unsigned long long* nodes, cpu_set_t* cpus) {
+	FILE* fp = fopen(fn, "r");
+	if (fp == NULL) {
+		return 0;
+	}
+	int cnt = 0, first, last, c;
+	while (fscanf(fp, "%d", &first) == 1) {
+		last = first;
+		if ((c = fgetc(fp)) == '-') {
+			if (fscanf(fp, "%d", &last) != 1) {
+				break;
+			}
+			c = fgetc(fp);
+		}
+		for (; first <= last; ++first, ++cnt) {
+			if (nodes && first < MAX_NUMA_NODES) {
+				*nodes |= 1ULL << first;
+			}
+			if (cpus && first < CPU_SETSIZE) {
+				CPU_SET(first, cpus);
+			}
+		}
+		if (c != ',') {
+			break;
+		}
+	}
+	fclose(fp);
+	return cnt;
+}
+
+int numa_nodes_count() {
+	unsigned long long nodes = 0;
+	parse_list("/sys/devices/system/node/online", &nodes, NULL);
+	// only contiguously numbered nodes are used
+	int cnt = 0;
+	while (cnt < MAX_NUMA_NODES && (nodes >> cnt & 1)) {
+		++cnt;
+	}
+	return cnt > 0 ? cnt : 1;
+}
+
+static void set_memory_policy(int mode, unsigned long long nodes) {
+#ifdef SYS_set_mempolicy
+	if (syscall(SYS_set_mempolicy, mode, mode == MPOL_DEFAULT ? NULL : &nodes, mode == MPOL_DEFAULT ? 0 : MAX_NUMA_NODES + 1) != 0) {
+		fprintf(stderr, "[prophex:%s] memory policy could not be set, memory is placed by the default policy\n", __func__);
+	}
+#endif
+}
+
+void numa_prefer_node(int node) { set_memory_policy(MPOL_PREFERRED, 1ULL << node); }
+
+void numa_interleave_nodes() {
+	int cnt = numa_nodes_count();
+	set_memory_policy(MPOL_INTERLEAVE, cnt >= MAX_NUMA_NODES ? ~0ULL : (1ULL << cnt) - 1);
+}
+
+void numa_reset_memory_policy() { set_memory_policy(MPOL_DEFAULT, 0); }
+
+void numa_get_memory_policy(numa_policy_t* policy) {
+	policy->mode = MPOL_DEFAULT;
+	policy->nodes = 0;
+#ifdef SYS_get_mempolicy
+	if (syscall(SYS_get_mempolicy, &policy->mode, &policy->nodes, MAX_NUMA_NODES + 1, NULL, 0) != 0) {
+		policy->mode = MPOL_DEFAULT;
+	}
+#endif
+}
+
+void numa_set_memory_policy(const numa_policy_t* policy) {
+	if (policy->mode != MPOL_DEFAULT) {
+		set_memory_policy(policy->mode, policy->nodes);
+	}
+}
+
+void numa_pin_thread(int node) {
+	char fn[64];
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	sprintf(fn, "/sys/devices/system/node/node%d/cpulist", node);
+	if (parse_list(fn, NULL, &cpus) > 0) {
+		sched_setaffinity(0, sizeof(cpu_set_t), &cpus);
+	}
+}
@@ -0,0 +1,25 @@
+/*
+  NUMA topology, memory placement and thread pinning, without depending on libnuma.
+  Licence: MIT
+*/
+
+#ifndef NUMA_UTILS_H
+#define NUMA_UTILS_H
+
+// number of online NUMA nodes (1 if unknown), nodes are numbered 0, ..., count - 1
+int numa_nodes_count();
+// memory allocated by the calling thread is placed on the node (preferably), or interleaved over all nodes
+void numa_prefer_node(int node);
+void numa_interleave_nodes();
+void numa_reset_memory_policy();
+// memory policy of the calling thread, so that threads it starts can allocate memory in the same way
+typedef struct {
+	int mode;
+	unsigned long long nodes;
+} numa_policy_t;
+void numa_get_memory_policy(numa_policy_t* policy);
+void numa_set_memory_policy(const numa_policy_t* policy);
+// restricts the calling thread to the CPUs of the node
+void numa_pin_thread(int node);
+
+#endif  // NUMA_UTILS_H
@@ -16,6 +16,8 @@ typedef struct {
 	int kmer_length;
 	const char* prefix;
 	int sa_intv;
+	int pack_sa;
+	int text_sa;
 } klcp_data_t;
 
 void* construct_klcp_parallel(void* data) {
@@ -26,11 +28,15 @@ void* construct_klcp_parallel(void* data) {
 
 void* construct_sa_parallel(void* data) {
 	klcp_data_t* klcp_data = (klcp_data_t*)data;
-	bwt_cal_sa(klcp_data->bwt, klcp_data->sa_intv);
+	if (klcp_data->text_sa) {
+		bwt_cal_sa_text_order(klcp_data->bwt, klcp_data->sa_intv);
+	} else {
+		bwt_cal_sa(klcp_data->bwt, klcp_data->sa_intv);
+	}
 	char* fn = malloc((strlen(klcp_data->prefix) + 10) * sizeof(char));
 	strcpy(fn, klcp_data->prefix);
 	strcat(fn, ".sa");
-	bwt_dump_sa(fn, klcp_data->bwt);
+	bwt_dump_sa_compact(fn, klcp_data->bwt, klcp_data->pack_sa);
 	fprintf(stderr, "[prophex:%s] SA dumped\n", __func__);
 	return 0;
 }
@@ -51,6 +57,8 @@ void build_klcp(const char* prefix, const prophex_opt_t* opt, int sa_intv) {
 		klcp_data->kmer_length = opt->kmer_length;
 		klcp_data->prefix = prefix;
 		klcp_data->sa_intv = sa_intv;
+		klcp_data->pack_sa = opt->pack_sa;
+		klcp_data->text_sa = opt->text_sa;
 		pthread_t tid[2];
 		int status_klcp = pthread_create(&tid[0], NULL, construct_klcp_parallel, (void*)klcp_data);
 		int status_sa = pthread_create(&tid[1], NULL, construct_sa_parallel, (void*)klcp_data);
@@ -76,26 +84,79 @@ void build_klcp(const char* prefix, const prophex_opt_t* opt, int sa_intv) {
 	fprintf(stderr, "[prophex:%s] klcp dumped\n", __func__);
 	if (opt->construct_sa_parallel) {
 		bwt_destroy(bwt);
+		if (opt->sa_contigs) {
+			sa_contigs_dump(prefix);
+			fprintf(stderr, "[prophex:%s] contigs of SA samples dumped\n", __func__);
+		}
 	} else {
 		bwt_destroy_without_sa(bwt);
 	}
 }
 
+int build_interleaved_bwt(const char* prefix, int kmer_length) {
+	bwt_t* bwt;
+	if ((bwt = bwa_idx_load_bwt_without_sa(prefix)) == 0) {
+		fprintf(stderr, "[prophex:%s] Couldn't load idx from %s\n", __func__, prefix);
+		return 1;
+	}
+	if (bwt->seq_len >= UINT32_MAX) {
+		fprintf(stderr, "[prophex:%s] the interleaved layout is supported only for texts shorter than 2^32\n", __func__);
+		bwt_destroy_without_sa(bwt);
+		return 1;
+	}
+	char* fn = malloc((strlen(prefix) + 10) * sizeof(char));
+	sprintf(fn, "%s.%d.klcp", prefix, kmer_length);
+	klcp_t* klcp = malloc(sizeof(klcp_t));
+	klcp->klcp = malloc(sizeof(bitarray_t));
+	klcp_restore(fn, klcp);
+	klcp_interleave(bwt, klcp, kmer_length);
+	destroy_klcp(klcp);
+	sprintf(fn, "%s.%d.ibwt", prefix, kmer_length);
+	bwt_dump_bwt_compact(fn, bwt);
+	fprintf(stderr, "[prophex:%s] interleaved BWT and k-LCP written to %s\n", __func__, fn);
+	free(fn);
+	bwt_destroy_without_sa(bwt);
+	return 0;
+}
+
+int build_rlbwt(const char* prefix) {
+	bwt_t* bwt;
+	if ((bwt = bwa_idx_load_bwt_without_sa(prefix)) == 0) {
+		fprintf(stderr, "[prophex:%s] Couldn't load idx from %s\n", __func__, prefix);
+		return 1;
+	}
+	bwt->rl = bwt_rl_build(bwt);
+	char* fn = malloc((strlen(prefix) + 10) * sizeof(char));
+	sprintf(fn, "%s.rlbwt", prefix);
+	bwt_dump_rlbwt(fn, bwt);
+	fprintf(stderr, "[prophex:%s] %llu runs (%.1f bases per run), %.1f MB in memory instead of %.1f MB, written to %s\n", __func__,
+	        (unsigned long long)bwt->rl->n_runs, (double)bwt->seq_len / bwt->rl->n_runs, bwt_rl_size(bwt) / 1048576.0,
+	        bwt->bwt_size * 4 / 1048576.0, fn);
+	free(fn);
+	free(bwt->rl->starts);
+	free(bwt->rl->chars);
+	free(bwt->rl);
+	bwt->rl = NULL;
+	bwt_destroy_without_sa(bwt);
+	return 0;
+}
+
 int bwtdowngrade(const char* bwt_input_file, const char* bwt_output_file) {
 	bwtint_t i, k, n_occ;
 	uint32_t* buf;
-	bwt_t* bwt = bwt_restore_bwt(bwt_input_file);
-	n_occ = (bwt->seq_len + OCC_INTERVAL - 1) / OCC_INTERVAL + 1;
+	bwt_t* bwt = bwt_restore_bwt_any_width(bwt_input_file);
+	bwtint_t occ_intv = 1ULL << bwt->occ_intv_shift;
+	n_occ = (bwt->seq_len + occ_intv - 1) / occ_intv + 1;
 	// fprintf(stderr, "seq_len: %d n_occ: %d old_size: %d new_size: %d\n",
 	// 	bwt->seq_len, n_occ, bwt->bwt_size, bwt->bwt_size - n_occ * sizeof(bwtint_t));
-	bwt->bwt_size -= n_occ * sizeof(bwtint_t);  // the new size
+	bwt->bwt_size -= n_occ * bwt_occ_cnt_words(bwt);  // the new size
 	buf = (uint32_t*)calloc(bwt->bwt_size, 4);  // will be the new bwt
 	// c[0] = c[1] = c[2] = c[3] = 0;
 	for (i = k = 0; i < bwt->seq_len; ++i) {
 		// fprintf(stderr, "i: %d k: %d\n", i, k);
-		if (i % OCC_INTERVAL == 0) {
+		if (i % occ_intv == 0) {
 			// memcpy(buf + k, c, sizeof(bwtint_t) * 4);
-			k += sizeof(bwtint_t);  // in fact: sizeof(bwtint_t)=4*(sizeof(bwtint_t)/4)
+			k += bwt_occ_cnt_words(bwt);
 		}
 		if (i % 16 == 0)
 			buf[i / 16] = bwt->bwt[k++];  // 16 == sizeof(uint32_t)/2
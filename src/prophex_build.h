@@ -10,6 +10,10 @@
 #include "prophex_utils.h"
 
 void build_klcp(const char* prefix, const prophex_opt_t* opt, int sa_intv);
+// writes <prefix>.<k>.ibwt, the BWT with the k-LCP bits interleaved into its Occ blocks
+int build_interleaved_bwt(const char* prefix, int kmer_length);
+// writes <prefix>.rlbwt, the run-length encoded BWT
+int build_rlbwt(const char* prefix);
 int bwtdowngrade(const char* bwt_input_file, const char* bwt_output_file);
 int bwt2fa(const char* prefix, const char* output_filename);
 
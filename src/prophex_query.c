@@ -1,14 +1,20 @@
 #include "prophex_query.h"
 #include <inttypes.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "bgzf_output.h"
 #include "bwa.h"
 #include "bwa_utils.h"
 #include "bwase.h"
 #include "contig_node_translator.h"
+#include "gz_input.h"
 #include "klcp.h"
 #include "kseq.h"
 #include "kstring.h"
+#include "numa_utils.h"
 #include "utils.h"
 KSEQ_DECLARE(gzFile)
 
@@ -18,6 +24,8 @@ KSEQ_DECLARE(gzFile)
 #define MAX_STREAK_LENGTH 10000000
 // soft limit for the string representing the output for the read
 #define MAX_SOFT_STREAK_LENGTH 9000000
+// the lines of the reads finished by a thread are written once they are longer, in the unordered mode
+#define UNORDERED_OUTPUT_BUFFER_SIZE (1 << 16)
 
 void* kopen(const char* fn, int* _fd);
 int kclose(void* a);
@@ -59,20 +67,41 @@ int calculate_sa_interval_continue(const bwt_t* bwt, int len, const ubyte_t* str
 	return calculate_sa_interval(bwt, len, str, k, l, start_pos);
 }
 
-size_t get_positions(const bwaidx_t* idx, bwt_position_t* positions, const int query_length, const uint64_t k, const uint64_t l) {
-	uint64_t t;
-	for (t = k; t <= l; ++t) {
-		if (t - k >= MAX_POSSIBLE_SA_POSITIONS) {
-			fprintf(stderr, "[prophex:%s] translation from SA-pos to seq-pos is truncated, too many (%llu) positions\n", __func__, l - k + 1);
-			break;
+// rows of the interval are located BWT_SA_BATCH at a time by bwt_sa_batch, which interleaves their LF walks.
+// With the contigs of SA samples, a position gets the contig of its sample if it lies within that contig on the same
+// strand, which is checked from the offsets alone; other positions are left to bns_pos2rid in get_nodes_from_positions
+size_t get_positions(const prophex_shard_t* shard, bwt_position_t* positions, const int query_length, const uint64_t k, const uint64_t l) {
+	const bwaidx_t* idx = shard->idx;
+	const bntseq_t* bns = idx->bns;
+	uint64_t positions_cnt = l - k + 1;
+	if (positions_cnt > MAX_POSSIBLE_SA_POSITIONS) {
+		fprintf(stderr, "[prophex:%s] translation from SA-pos to seq-pos is truncated, too many (%llu) positions\n", __func__, l - k + 1);
+		positions_cnt = MAX_POSSIBLE_SA_POSITIONS;
+	}
+	bwtint_t sa[BWT_SA_BATCH], samples[BWT_SA_BATCH];
+	uint64_t start;
+	for (start = 0; start < positions_cnt; start += BWT_SA_BATCH) {
+		int batch_size = positions_cnt - start < BWT_SA_BATCH ? positions_cnt - start : BWT_SA_BATCH;
+		bwt_sa_batch(idx->bwt, k + start, batch_size, sa, samples);
+		int i;
+		for (i = 0; i < batch_size; ++i) {
+			uint64_t x = sa[i];
+			int rid = -1;
+			if (shard->sa_contigs) {
+				int c = shard->sa_contigs->contigs[samples[i]];
+				uint64_t begin = bns->anns[c].offset, end = begin + bns->anns[c].len;
+				// the reverse complement of the contig takes [2 * l_pac - end, 2 * l_pac - begin)
+				if (x < (uint64_t)bns->l_pac ? x >= begin && x + query_length <= end
+				                             : x + end >= 2 * (uint64_t)bns->l_pac && x + query_length + begin <= 2 * (uint64_t)bns->l_pac) {
+					rid = c;
+				}
+			}
+			bwt_position_t* position = &positions[start + i];
+			position->position = bwa_sa_value2pos(bns, x, query_length, &position->strand);
+			position->rid = rid;
 		}
-		int strand;
-		uint64_t pos = bwa_sa2pos(idx->bns, idx->bwt, t, query_length, &strand);  // bwt_sa(bwt, t);
-		positions[t - k].position = pos;
-		positions[t - k].strand = strand;
-		positions[t - k].rid = -1;
 	}
-	return (l - k + 1 < MAX_POSSIBLE_SA_POSITIONS ? l - k + 1 : MAX_POSSIBLE_SA_POSITIONS);
+	return positions_cnt;
 }
 
 int is_position_on_border(const bwaidx_t* idx, bwt_position_t* position, int query_length) {
@@ -94,8 +123,9 @@ void sort(int count, int** array) {
 	}
 }
 
-size_t get_nodes_from_positions(const bwaidx_t* idx, const int query_length, const int positions_cnt, bwt_position_t* positions, int32_t* seen_nodes,
-                                int8_t** seen_nodes_marks, int skip_positions_on_border) {
+size_t get_nodes_from_positions(const prophex_shard_t* shard, const int query_length, const int positions_cnt, bwt_position_t* positions,
+                                int32_t* seen_nodes, int8_t** seen_nodes_marks, int skip_positions_on_border) {
+	const bwaidx_t* idx = shard->idx;
 	size_t nodes_cnt = 0;
 	int i;
 	for (i = 0; i < positions_cnt; ++i) {
@@ -108,7 +138,7 @@ size_t get_nodes_from_positions(const bwaidx_t* idx, const int query_length, con
 			rid = bns_pos2rid(idx->bns, pos);
 			positions[i].rid = rid;
 		}
-		int node = get_node_from_contig(rid);
+		int node = get_node_from_contig(shard->contig_offset + rid);
 		positions[i].node = node;
 		int seen = (*seen_nodes_marks)[node];
 		if (!seen && node != -1 && (!skip_positions_on_border || !is_position_on_border(idx, &(positions[i]), query_length))) {
@@ -125,7 +155,7 @@ size_t get_nodes_from_positions(const bwaidx_t* idx, const int query_length, con
 	return nodes_cnt;
 }
 
-void output_old(int* seen_nodes, const int nodes_cnt) {
+void output_old(const int32_t* seen_nodes, const int nodes_cnt) {
 	fprintf(stdout, "%d ", nodes_cnt);
 	int r;
 	for (r = 0; r < nodes_cnt; ++r) {
@@ -146,7 +176,7 @@ void strncat_with_check(char* str, char* str_to_append, int* str_length, int str
 	}
 }
 
-void construct_streaks(char** all_streaks, char** current_streak, int* seen_nodes, int nodes_cnt, int streak_size, int is_ambiguous_streak,
+void construct_streaks(char** all_streaks, char** current_streak, const int32_t* seen_nodes, int nodes_cnt, int streak_size, int is_ambiguous_streak,
                        int* is_first_streak) {
 	if (*is_first_streak) {
 		*all_streaks[0] = '\0';
@@ -187,7 +217,7 @@ void construct_streaks(char** all_streaks, char** current_streak, int* seen_node
 	*is_first_streak = 0;
 }
 
-void print_streaks(char* streaks) { fprintf(stdout, "%s", streaks); }
+void print_streaks(FILE* out, char* streaks) { fprintf(out, "%s", streaks); }
 
 void shift_positions_by_one(const bwaidx_t* idx, int positions_cnt, bwt_position_t* positions, int query_length, uint64_t k, uint64_t l) {
 	int i;
@@ -216,45 +246,188 @@ int equal(int a_cnt, const int* a, int b_cnt, const int* b) {
 	return 1;
 }
 
-void print_read(const bseq1_t* p) {
+void print_read(FILE* out, const bseq1_t* p) {
 	int j;
 	for (j = (int)p->l_seq - 1; j >= 0; j--) {
-		fprintf(stdout, "%c", "ACGTN"[p->seq[j]]);
+		fprintf(out, "%c", "ACGTN"[p->seq[j]]);
 	}
 }
 
-void print_read_qual(const bseq1_t* p) {
+void print_read_qual(FILE* out, const bseq1_t* p) {
 	if (p->qual) {
 		int j;
 		for (j = 0; j < (int)p->l_seq; j++) {
-			fprintf(stdout, "%c", p->qual[j]);
+			fprintf(out, "%c", p->qual[j]);
 		}
 	} else {
-		fprintf(stdout, "*");
+		fprintf(out, "*");
+	}
+}
+
+void kmer_node_sets_clear(kmer_node_sets_t* sets) {
+	if (sets->kmers_capacity == 0) {
+		sets->kmers_capacity = 256;
+		sets->offsets = malloc((sets->kmers_capacity + 1) * sizeof(size_t));
+	}
+	sets->kmers_cnt = 0;
+	sets->nodes_cnt = 0;
+	sets->offsets[0] = 0;
+}
+
+void kmer_node_sets_reserve(kmer_node_sets_t* sets, int kmers_cnt, size_t nodes_cnt) {
+	if (kmers_cnt > sets->kmers_capacity) {
+		while (sets->kmers_capacity < kmers_cnt) {
+			sets->kmers_capacity *= 2;
+		}
+		sets->offsets = realloc(sets->offsets, (sets->kmers_capacity + 1) * sizeof(size_t));
+	}
+	if (nodes_cnt > sets->nodes_capacity) {
+		if (sets->nodes_capacity == 0) {
+			sets->nodes_capacity = 256;
+		}
+		while (sets->nodes_capacity < nodes_cnt) {
+			sets->nodes_capacity *= 2;
+		}
+		sets->nodes = realloc(sets->nodes, sets->nodes_capacity * sizeof(int32_t));
+	}
+}
+
+void kmer_node_sets_add(kmer_node_sets_t* sets, const int32_t* nodes, int nodes_cnt) {
+	kmer_node_sets_reserve(sets, sets->kmers_cnt + 1, sets->nodes_cnt + nodes_cnt);
+	memcpy(sets->nodes + sets->nodes_cnt, nodes, nodes_cnt * sizeof(int32_t));
+	sets->nodes_cnt += nodes_cnt;
+	sets->kmers_cnt++;
+	sets->offsets[sets->kmers_cnt] = sets->nodes_cnt;
+}
+
+// k-mer-wise union of two sequences of sorted node sets, k-mers of b can be stored in the reverse order
+void kmer_node_sets_union(const kmer_node_sets_t* a, const kmer_node_sets_t* b, int is_b_reversed, kmer_node_sets_t* result) {
+	xassert(a->kmers_cnt == b->kmers_cnt, "[prophex] node sets of different reads can not be merged");
+	kmer_node_sets_clear(result);
+	kmer_node_sets_reserve(result, a->kmers_cnt, a->nodes_cnt + b->nodes_cnt);
+	int kmer;
+	for (kmer = 0; kmer < a->kmers_cnt; ++kmer) {
+		int b_kmer = is_b_reversed ? b->kmers_cnt - 1 - kmer : kmer;
+		size_t i = a->offsets[kmer], j = b->offsets[b_kmer];
+		size_t a_end = a->offsets[kmer + 1], b_end = b->offsets[b_kmer + 1];
+		while (i < a_end || j < b_end) {
+			int32_t node;
+			if (j == b_end || (i < a_end && a->nodes[i] < b->nodes[j])) {
+				node = a->nodes[i++];
+			} else if (i == a_end || b->nodes[j] < a->nodes[i]) {
+				node = b->nodes[j++];
+			} else {
+				node = a->nodes[i++];
+				j++;
+			}
+			result->nodes[result->nodes_cnt++] = node;
+		}
+		result->offsets[kmer + 1] = result->nodes_cnt;
 	}
+	result->kmers_cnt = a->kmers_cnt;
 }
 
-prophex_worker_t* prophex_worker_init(const bwaidx_t* idx, int32_t seqs_cnt, const bseq1_t* seqs, const prophex_opt_t* opt, const klcp_t* klcp) {
+void kmer_node_sets_swap(kmer_node_sets_t* a, kmer_node_sets_t* b) {
+	kmer_node_sets_t tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+void kmer_node_sets_destroy(kmer_node_sets_t* sets) {
+	if (sets->nodes) {
+		free(sets->nodes);
+	}
+	if (sets->offsets) {
+		free(sets->offsets);
+	}
+}
+
+void prophex_aux_data_init(prophex_query_aux_t* aux_data) {
+	int contigs_cnt = get_contigs_count();
+	aux_data->positions = malloc(MAX_POSSIBLE_SA_POSITIONS * sizeof(bwt_position_t));
+	aux_data->all_streaks = malloc(MAX_STREAK_LENGTH * sizeof(char));
+	aux_data->current_streak = malloc(MAX_STREAK_LENGTH * sizeof(char));
+	aux_data->seen_nodes = malloc(MAX_POSSIBLE_SA_POSITIONS * sizeof(int32_t));
+	aux_data->prev_seen_nodes = malloc(MAX_POSSIBLE_SA_POSITIONS * sizeof(int32_t));
+	aux_data->seen_nodes_marks = malloc(contigs_cnt * sizeof(int8_t));
+	int index;
+	for (index = 0; index < contigs_cnt; ++index) {
+		aux_data->seen_nodes_marks[index] = 0;
+	}
+	aux_data->rids_computations = 0;
+	aux_data->using_prev_rids = 0;
+	aux_data->unordered_output.l = aux_data->unordered_output.m = 0;
+	aux_data->unordered_output.s = NULL;
+}
+
+// splits reads with more than opt->long_read_segment k-mers into segments of at most as many k-mers, each of them is a task
+// of process_sequence; such reads are converted to 2-bit encoding here, before their segments are matched concurrently
+static void split_long_reads(prophex_worker_t* prophex_worker) {
+	const prophex_opt_t* opt = prophex_worker->opt;
+	int segment_kmers = opt->long_read_segment;
+	int tasks_capacity = prophex_worker->seqs_cnt, seq_index, i;
+	prophex_worker->tasks = malloc(tasks_capacity * sizeof(read_task_t));
+	prophex_worker->long_reads = malloc(prophex_worker->seqs_cnt * sizeof(int));
+	prophex_worker->long_read_segments = malloc((prophex_worker->seqs_cnt + 1) * sizeof(int));
+	prophex_worker->long_read_segments[0] = 0;
+	int segments_cnt = 0;
+	for (seq_index = 0; seq_index < prophex_worker->seqs_cnt; ++seq_index) {
+		bseq1_t* seq = (bseq1_t*)&prophex_worker->seqs[seq_index];
+		int kmers_cnt = seq->l_seq - opt->kmer_length + 1;
+		int pieces_cnt = kmers_cnt > segment_kmers ? (kmers_cnt + segment_kmers - 1) / segment_kmers : 1;
+		if (prophex_worker->tasks_cnt + pieces_cnt > tasks_capacity) {
+			while (prophex_worker->tasks_cnt + pieces_cnt > tasks_capacity) {
+				tasks_capacity *= 2;
+			}
+			prophex_worker->tasks = realloc(prophex_worker->tasks, tasks_capacity * sizeof(read_task_t));
+		}
+		if (pieces_cnt == 1) {
+			read_task_t* task = &prophex_worker->tasks[prophex_worker->tasks_cnt++];
+			task->seq_index = seq_index;
+			task->from = 0;
+			task->to = kmers_cnt;
+			task->segment = -1;
+			continue;
+		}
+		for (i = 0; i < seq->l_seq; ++i) {
+			seq->seq[i] = seq->seq[i] < 4 ? seq->seq[i] : nst_nt4_table[(int)seq->seq[i]];
+		}
+		seq_reverse(seq->l_seq, (ubyte_t*)seq->seq, 0);
+		// segments of about the same size, consecutive ones share k - 1 bases
+		for (i = 0; i < pieces_cnt; ++i) {
+			read_task_t* task = &prophex_worker->tasks[prophex_worker->tasks_cnt++];
+			task->seq_index = seq_index;
+			task->from = (int)((int64_t)kmers_cnt * i / pieces_cnt);
+			task->to = (int)((int64_t)kmers_cnt * (i + 1) / pieces_cnt);
+			task->segment = segments_cnt++;
+		}
+		prophex_worker->long_reads[prophex_worker->long_reads_cnt++] = seq_index;
+		prophex_worker->long_read_segments[prophex_worker->long_reads_cnt] = segments_cnt;
+	}
+	prophex_worker->segment_sets = calloc(segments_cnt, sizeof(kmer_node_sets_t));
+	prophex_worker->segments_cnt = segments_cnt;
+}
+
+prophex_worker_t* prophex_worker_init(const prophex_shard_t* shards, int shards_cnt, int passes_cnt, int32_t seqs_cnt, const bseq1_t* seqs,
+                                      const prophex_opt_t* opt) {
 	prophex_worker_t* prophex_worker = malloc(1 * sizeof(prophex_worker_t));
-	prophex_worker->idx = idx;
+	prophex_worker->shards = shards;
+	prophex_worker->shards_cnt = shards_cnt;
+	prophex_worker->replicas = NULL;
+	prophex_worker->replicas_cnt = 1;
+	prophex_worker->first_shard = 0;
+	prophex_worker->numa_nodes_cnt = 1;
+	prophex_worker->pass = 0;
+	prophex_worker->passes_cnt = passes_cnt;
+	prophex_worker->stored_sets = passes_cnt > 1 ? calloc(seqs_cnt, sizeof(kmer_node_sets_t)) : NULL;
 	prophex_worker->seqs = seqs;
 	prophex_worker->opt = opt;
-	prophex_worker->klcp = klcp;
-	prophex_worker->aux_data = malloc(opt->n_threads * sizeof(prophex_query_aux_t));
+	prophex_worker->out = NULL;
+	prophex_worker->first_read_number = 0;
+	prophex_worker->aux_data = calloc(opt->n_threads, sizeof(prophex_query_aux_t));
 	int tid;
 	for (tid = 0; tid < opt->n_threads; ++tid) {
-		prophex_worker->aux_data[tid].positions = malloc(MAX_POSSIBLE_SA_POSITIONS * sizeof(bwt_position_t));
-		prophex_worker->aux_data[tid].all_streaks = malloc(MAX_STREAK_LENGTH * sizeof(char));
-		prophex_worker->aux_data[tid].current_streak = malloc(MAX_STREAK_LENGTH * sizeof(char));
-		prophex_worker->aux_data[tid].seen_nodes = malloc(MAX_POSSIBLE_SA_POSITIONS * sizeof(int32_t));
-		prophex_worker->aux_data[tid].prev_seen_nodes = malloc(MAX_POSSIBLE_SA_POSITIONS * sizeof(int32_t));
-		prophex_worker->aux_data[tid].seen_nodes_marks = malloc(idx->bns->n_seqs * sizeof(int8_t));
-		int index;
-		for (index = 0; index < idx->bns->n_seqs; ++index) {
-			prophex_worker->aux_data[tid].seen_nodes_marks[index] = 0;
-		}
-		prophex_worker->aux_data[tid].rids_computations = 0;
-		prophex_worker->aux_data[tid].using_prev_rids = 0;
+		prophex_aux_data_init(&prophex_worker->aux_data[tid]);
 	}
 	prophex_worker->seqs_cnt = seqs_cnt;
 	prophex_worker->output = malloc(seqs_cnt * sizeof(char*));
@@ -262,6 +435,27 @@ prophex_worker_t* prophex_worker_init(const bwaidx_t* idx, int32_t seqs_cnt, con
 	for (i = 0; i < seqs_cnt; ++i) {
 		prophex_worker->output[i] = NULL;
 	}
+	int is_assigned = opt->tree_file_name != NULL;
+	prophex_worker->streaks = opt->output_binary || is_assigned ? calloc(seqs_cnt, sizeof(read_streaks_t)) : NULL;
+	// the tree is set by the caller, reads shorter than k stay unassigned
+	prophex_worker->tree = NULL;
+	prophex_worker->assignments = is_assigned ? malloc(seqs_cnt * sizeof(read_assignment_t)) : NULL;
+	for (i = 0; i < seqs_cnt && is_assigned; ++i) {
+		prophex_worker->assignments[i].node = -1;
+		prophex_worker->assignments[i].h1 = 0;
+		prophex_worker->assignments[i].c1 = 0;
+	}
+	prophex_worker->tasks = NULL;
+	prophex_worker->tasks_cnt = 0;
+	prophex_worker->long_reads = NULL;
+	prophex_worker->long_reads_cnt = 0;
+	prophex_worker->long_read_segments = NULL;
+	prophex_worker->segment_sets = NULL;
+	prophex_worker->segments_cnt = 0;
+	// the old output is printed k-mer by k-mer, so its reads are never split
+	if (opt->n_threads > 1 && opt->long_read_segment > 0 && !opt->output_old) {
+		split_long_reads(prophex_worker);
+	}
 	return prophex_worker;
 }
 
@@ -284,6 +478,27 @@ void prophex_aux_data_destroy(prophex_query_aux_t* prophex_query_aux_data) {
 	if (prophex_query_aux_data->seen_nodes_marks) {
 		free(prophex_query_aux_data->seen_nodes_marks);
 	}
+	if (prophex_query_aux_data->is_ambiguous_kmer) {
+		free(prophex_query_aux_data->is_ambiguous_kmer);
+	}
+	if (prophex_query_aux_data->is_restarted_kmer) {
+		free(prophex_query_aux_data->is_restarted_kmer);
+	}
+	if (prophex_query_aux_data->rc_seq) {
+		free(prophex_query_aux_data->rc_seq);
+	}
+	if (prophex_query_aux_data->rc_is_ambiguous_kmer) {
+		free(prophex_query_aux_data->rc_is_ambiguous_kmer);
+	}
+	if (prophex_query_aux_data->rc_is_restarted_kmer) {
+		free(prophex_query_aux_data->rc_is_restarted_kmer);
+	}
+	kmer_node_sets_destroy(&prophex_query_aux_data->shard_sets);
+	kmer_node_sets_destroy(&prophex_query_aux_data->rc_sets);
+	kmer_node_sets_destroy(&prophex_query_aux_data->merged_sets);
+	kmer_node_sets_destroy(&prophex_query_aux_data->tmp_sets);
+	assignment_aux_destroy(&prophex_query_aux_data->assign_aux);
+	free(prophex_query_aux_data->unordered_output.s);
 }
 
 void prophex_worker_destroy(prophex_worker_t* prophex_worker) {
@@ -297,6 +512,12 @@ void prophex_worker_destroy(prophex_worker_t* prophex_worker) {
 	if (prophex_worker->aux_data) {
 		free(prophex_worker->aux_data);
 	}
+	if (prophex_worker->stored_sets) {
+		for (i = 0; i < prophex_worker->seqs_cnt; ++i) {
+			kmer_node_sets_destroy(&prophex_worker->stored_sets[i]);
+		}
+		free(prophex_worker->stored_sets);
+	}
 	if (prophex_worker->output) {
 		for (i = 0; i < prophex_worker->seqs_cnt; ++i) {
 			if (prophex_worker->output[i]) {
@@ -307,169 +528,608 @@ void prophex_worker_destroy(prophex_worker_t* prophex_worker) {
 			free(prophex_worker->output);
 		}
 	}
+	if (prophex_worker->streaks) {
+		for (i = 0; i < prophex_worker->seqs_cnt; ++i) {
+			read_streaks_destroy(&prophex_worker->streaks[i]);
+		}
+		free(prophex_worker->streaks);
+	}
+	free(prophex_worker->assignments);
+	for (i = 0; i < prophex_worker->segments_cnt; ++i) {
+		kmer_node_sets_destroy(&prophex_worker->segment_sets[i]);
+	}
+	free(prophex_worker->segment_sets);
+	free(prophex_worker->tasks);
+	free(prophex_worker->long_reads);
+	free(prophex_worker->long_read_segments);
 	free(prophex_worker);
 }
 
-void process_sequence(void* data, int seq_index, int tid) {
-	prophex_worker_t* prophex_worker = (prophex_worker_t*)data;
-	const bwaidx_t* idx = prophex_worker->idx;
-	bseq1_t seq = prophex_worker->seqs[seq_index];
-	const prophex_opt_t* opt = prophex_worker->opt;
-	const klcp_t* klcp = prophex_worker->klcp;
-	prophex_query_aux_t aux_data = prophex_worker->aux_data[tid];
-	char* current_streak = aux_data.current_streak;
-	char* all_streaks = aux_data.all_streaks;
-	int32_t* seen_nodes = aux_data.seen_nodes;
-	int32_t* prev_seen_nodes = aux_data.prev_seen_nodes;
-	int8_t* seen_nodes_marks = aux_data.seen_nodes_marks;
-	int i;
+// state of the k-mer search in one shard, carried between consecutive k-mers of a read
+typedef struct {
+	uint64_t k, l;
+	uint64_t prev_k, prev_l;
+	uint64_t decreased_k, increased_l;
+	size_t positions_cnt;
+} kmer_search_state_t;
 
-	for (i = 0; i < seq.l_seq; ++i)  // convert to 2-bit encoding if we have not done so
-		seq.seq[i] = seq.seq[i] < 4 ? seq.seq[i] : nst_nt4_table[(int)seq.seq[i]];
-	seq_reverse(seq.l_seq, seq.seq, 0);
+void kmer_search_state_init(kmer_search_state_t* state) {
+	state->k = 0;
+	state->l = 0;
+	state->prev_k = 1;
+	state->prev_l = 0;
+	state->decreased_k = 1;
+	state->increased_l = 0;
+	state->positions_cnt = 0;
+}
 
-	if (opt->output_old) {
-		fprintf(stdout, "#");
-		print_read(&seq);
-		fprintf(stdout, "\n");
+void aux_data_reserve(prophex_query_aux_t* aux_data, int l_seq) {
+	if (l_seq > aux_data->kmer_flags_capacity) {
+		aux_data->kmer_flags_capacity = l_seq;
+		aux_data->is_ambiguous_kmer = realloc(aux_data->is_ambiguous_kmer, l_seq * sizeof(int8_t));
+		aux_data->is_restarted_kmer = realloc(aux_data->is_restarted_kmer, l_seq * sizeof(int8_t));
+		aux_data->rc_seq = realloc(aux_data->rc_seq, l_seq * sizeof(ubyte_t));
+		aux_data->rc_is_ambiguous_kmer = realloc(aux_data->rc_is_ambiguous_kmer, l_seq * sizeof(int8_t));
+		aux_data->rc_is_restarted_kmer = realloc(aux_data->rc_is_restarted_kmer, l_seq * sizeof(int8_t));
 	}
-	bwt_t* bwt = idx->bwt;
-	uint64_t k = 0, l = 0, prev_k = 1, prev_l = 0;
-	int current_streak_size = 0;
-	int prev_nodes_count = 0;
-	int start_pos = 0;
-	size_t positions_cnt = 0;
-	uint64_t decreased_k = 1;
-	uint64_t increased_l = 0;
-	int is_first_streak = 1;
+}
+
+// marks k-mers from, ..., to - 1 containing an ambiguous base and those which have to be searched from scratch
+void mark_kmers_range(const ubyte_t* seq, const prophex_opt_t* opt, int from, int to, int8_t* is_ambiguous_kmer, int8_t* is_restarted_kmer) {
 	int last_ambiguous_index = 0 - opt->kmer_length;
-	int is_ambiguous_streak = 0;
-	int ambiguous_streak_just_ended = 0;
-	if (start_pos + opt->kmer_length > seq.l_seq) {
+	int index;
+	// a k-mer following an ambiguous base is restarted
+	for (index = from > 0 ? from - 1 : 0; index < from + opt->kmer_length; ++index) {
+		if (seq[index] > 3) {
+			last_ambiguous_index = index;
+		}
+	}
+	int start_pos;
+	for (start_pos = from; start_pos < to; ++start_pos) {
+		int end_pos = start_pos + opt->kmer_length - 1;
+		is_ambiguous_kmer[start_pos] = 0;
+		is_restarted_kmer[start_pos] = (start_pos == 0);
 		if (opt->output) {
-			prophex_worker->output[seq_index] = malloc(5 * sizeof(char));
-			strncpy(prophex_worker->output[seq_index], "0:0", 5);
+			if (start_pos > from && seq[end_pos] > 3) {
+				last_ambiguous_index = end_pos;
+			}
+			is_ambiguous_kmer[start_pos] = (end_pos - last_ambiguous_index < opt->kmer_length);
+			is_restarted_kmer[start_pos] |= (end_pos - last_ambiguous_index == opt->kmer_length);
 		}
+	}
+}
+
+void mark_kmers(const ubyte_t* seq, int l_seq, const prophex_opt_t* opt, int8_t* is_ambiguous_kmer, int8_t* is_restarted_kmer) {
+	mark_kmers_range(seq, opt, 0, l_seq - opt->kmer_length + 1, is_ambiguous_kmer, is_restarted_kmer);
+}
+
+// finds the nodes of the k-mer starting at start_pos in one shard, returns the number of nodes
+int query_kmer(const prophex_shard_t* shard, const prophex_opt_t* opt, const ubyte_t* seq, int start_pos, int is_restarted,
+               kmer_search_state_t* state, prophex_query_aux_t* aux_data, int32_t* seen_nodes) {
+	const bwaidx_t* idx = shard->idx;
+	if (is_restarted) {
+		state->prev_k = 1;
+		state->prev_l = 0;
+	}
+	if (is_restarted || !opt->use_klcp || state->k > state->l) {
+		state->k = 0;
+		state->l = 0;
+		calculate_sa_interval_restart(idx->bwt, opt->kmer_length, seq, &state->k, &state->l, start_pos);
 	} else {
-		int index = 0;
-		for (index = 0; index < opt->kmer_length; ++index) {
-			if (seq.seq[index] > 3) {
-				last_ambiguous_index = index;
+		calculate_sa_interval_continue(idx->bwt, 1, seq, &state->k, &state->l, &state->decreased_k, &state->increased_l,
+		                               start_pos + opt->kmer_length - 1, shard->klcp);
+	}
+	uint64_t k = state->k, l = state->l;
+	int nodes_cnt = 0;
+	if (k <= l) {
+		if (state->prev_l - state->prev_k == l - k && state->increased_l - state->decreased_k == l - k) {
+			aux_data->using_prev_rids++;
+			shift_positions_by_one(idx, state->positions_cnt, aux_data->positions, opt->kmer_length, k, l);
+		} else {
+			aux_data->rids_computations++;
+			state->positions_cnt = get_positions(shard, aux_data->positions, opt->kmer_length, k, l);
+		}
+		nodes_cnt = get_nodes_from_positions(shard, opt->kmer_length, state->positions_cnt, aux_data->positions, seen_nodes,
+		                                     &aux_data->seen_nodes_marks, opt->skip_positions_on_border);
+	}
+	state->prev_k = k;
+	state->prev_l = l;
+	return nodes_cnt;
+}
+
+// finds the nodes of the k-mers from, ..., to - 1 of the sequence in one shard, the search starts from scratch at from
+void query_kmers(const prophex_shard_t* shard, const prophex_opt_t* opt, const ubyte_t* seq, int from, int to, const int8_t* is_ambiguous_kmer,
+                 const int8_t* is_restarted_kmer, prophex_query_aux_t* aux_data, kmer_node_sets_t* sets) {
+	kmer_search_state_t state;
+	kmer_search_state_init(&state);
+	kmer_node_sets_clear(sets);
+	int start_pos;
+	for (start_pos = from; start_pos < to; ++start_pos) {
+		int nodes_cnt = 0;
+		if (!is_ambiguous_kmer[start_pos]) {
+			nodes_cnt = query_kmer(shard, opt, seq, start_pos, is_restarted_kmer[start_pos] || start_pos == from, &state, aux_data,
+			                       aux_data->seen_nodes);
+		}
+		kmer_node_sets_add(sets, aux_data->seen_nodes, nodes_cnt);
+	}
+}
+
+// extends the bi-interval of a pattern by one base on the left (is_back) or on the right, an empty interval stays empty
+void fmd_extend(const bwt_t* bwt, bwtintv_t* ik, ubyte_t c, int is_back) {
+	if (c > 3 || ik->x[2] == 0) {
+		ik->x[2] = 0;
+		return;
+	}
+	bwtintv_t ok[4];
+	bwt_extend(bwt, ik, ok, is_back);
+	// forward extension by c is the backward extension of the reverse complement by 3 - c
+	*ik = ok[is_back ? c : 3 - c];
+}
+
+// finds the nodes of all k-mers of the sequence in one shard using bidirectional search in the FMD-index (both strands in one BWT).
+// Consecutive k-mers are processed in blocks of b, all of them contain a common core of k - b + 1 bases; the core is searched once,
+// then extended by one base to the left for every next k-mer of the block, and each k-mer is completed by extensions to the right.
+// This costs about k / b + b / 2 extensions per k-mer and needs no k-LCP. Only the k-mers from, ..., to - 1 are searched.
+void query_kmers_fmd(const prophex_shard_t* shard, const prophex_opt_t* opt, const ubyte_t* seq, int kmers_cnt, int from, int to,
+                     const int8_t* is_ambiguous_kmer, prophex_query_aux_t* aux_data, kmer_node_sets_t* sets) {
+	const bwaidx_t* idx = shard->idx;
+	const int k = opt->kmer_length;
+	const int n = kmers_cnt + k - 1;
+	// seq is the reversed read, so the k-mer starting at start_pos of seq is orig[n - k - start_pos], ..., orig[n - 1 - start_pos]
+#define orig(i) (seq[n - 1 - (i)])
+	int block_size = (int)round(sqrt(2.0 * k));
+	if (block_size < 1) {
+		block_size = 1;
+	}
+	kmer_node_sets_clear(sets);
+	int block_start;
+	for (block_start = from; block_start < to; block_start += block_size) {
+		int b = to - block_start < block_size ? to - block_start : block_size;
+		// k-mers of the block start at orig positions first_pos, first_pos - 1, ..., first_pos - b + 1
+		int first_pos = n - k - block_start;
+		int core_begin = first_pos, core_end = first_pos - b + k;
+		bwtintv_t core;
+		core.x[2] = 0;
+		if (orig(core_end - 1) < 4) {
+			bwt_set_intv(idx->bwt, orig(core_end - 1), core);
+			int i;
+			for (i = core_end - 2; i >= core_begin; --i) {
+				fmd_extend(idx->bwt, &core, orig(i), 1);
 			}
 		}
-		while (start_pos + opt->kmer_length <= seq.l_seq) {
-			int end_pos = start_pos + opt->kmer_length - 1;
-			if (opt->output) {
-				if (start_pos > 0 && seq.seq[end_pos] > 3) {
-					last_ambiguous_index = end_pos;
+		// sizes of the SA intervals of the previous k-mer and of its overlap with the current one, used as in query_kmer to reuse positions
+		uint64_t prev_size = 0, overlap_size = 0;
+		size_t positions_cnt = 0;
+		int u;
+		for (u = 0; u < b; ++u) {
+			int start_pos = block_start + u;
+			if (u > 0) {
+				fmd_extend(idx->bwt, &core, orig(first_pos - u), 1);
+			}
+			int nodes_cnt = 0;
+			uint64_t size = 0, next_overlap_size = 0;
+			if (!is_ambiguous_kmer[start_pos]) {
+				bwtintv_t kmer = core;
+				int i;
+				for (i = core_end; i < first_pos - u + k; ++i) {
+					next_overlap_size = kmer.x[2];
+					fmd_extend(idx->bwt, &kmer, orig(i), 0);
 				}
-				if (end_pos - last_ambiguous_index < opt->kmer_length) {
-					if (!is_ambiguous_streak) {
-						construct_streaks(&all_streaks, &current_streak, prev_seen_nodes, prev_nodes_count, current_streak_size, is_ambiguous_streak,
-						                  &is_first_streak);
-						is_ambiguous_streak = 1;
-						current_streak_size = 1;
+				size = kmer.x[2];
+				if (size > 0) {
+					uint64_t sa_k = kmer.x[0], sa_l = kmer.x[0] + kmer.x[2] - 1;
+					if (prev_size == size && overlap_size == size) {
+						aux_data->using_prev_rids++;
+						shift_positions_by_one(idx, positions_cnt, aux_data->positions, k, sa_k, sa_l);
 					} else {
-						current_streak_size++;
+						aux_data->rids_computations++;
+						positions_cnt = get_positions(shard, aux_data->positions, k, sa_k, sa_l);
 					}
-					start_pos++;
-					continue;
-				} else {
-					if (is_ambiguous_streak && current_streak_size > 0) {
-						construct_streaks(&all_streaks, &current_streak, prev_seen_nodes, prev_nodes_count, current_streak_size, is_ambiguous_streak,
-						                  &is_first_streak);
-						is_ambiguous_streak = 0;
-						current_streak_size = 0;
-					}
-				}
-				if (end_pos - last_ambiguous_index == opt->kmer_length) {
-					k = 0;
-					l = 0;
-					prev_k = 1;
-					prev_l = 0;
-					prev_nodes_count = 0;
-					ambiguous_streak_just_ended = 1;
-				} else {
-					ambiguous_streak_just_ended = 0;
-				}
-			}
-			if (start_pos == 0 || ambiguous_streak_just_ended) {
-				k = 0;
-				l = 0;
-				calculate_sa_interval_restart(bwt, opt->kmer_length, seq.seq, &k, &l, start_pos);
-			} else {
-				if (opt->use_klcp && k <= l) {
-					calculate_sa_interval_continue(bwt, 1, seq.seq, &k, &l, &decreased_k, &increased_l, start_pos + opt->kmer_length - 1, klcp);
-				} else {
-					k = 0;
-					l = 0;
-					calculate_sa_interval_restart(bwt, opt->kmer_length, seq.seq, &k, &l, start_pos);
+					nodes_cnt = get_nodes_from_positions(shard, k, positions_cnt, aux_data->positions, aux_data->seen_nodes,
+					                                     &aux_data->seen_nodes_marks, opt->skip_positions_on_border);
 				}
 			}
+			prev_size = size;
+			overlap_size = next_overlap_size;
+			kmer_node_sets_add(sets, aux_data->seen_nodes, nodes_cnt);
+		}
+	}
+#undef orig
+}
+
+// finds the nodes of the k-mers from, ..., to - 1 of the read and, for a forward-only index, of their reverse complements
+void query_read_kmers(const prophex_shard_t* shard, const prophex_opt_t* opt, const bseq1_t* seq, int from, int to, prophex_query_aux_t* aux_data,
+                      kmer_node_sets_t* sets) {
+	int kmers_cnt = seq->l_seq - opt->kmer_length + 1;
+	if (opt->use_fmd && !shard->is_forward_only) {
+		query_kmers_fmd(shard, opt, (ubyte_t*)seq->seq, kmers_cnt, from, to, aux_data->is_ambiguous_kmer, aux_data, sets);
+		return;
+	}
+	query_kmers(shard, opt, (ubyte_t*)seq->seq, from, to, aux_data->is_ambiguous_kmer, aux_data->is_restarted_kmer, aux_data, sets);
+	if (shard->is_forward_only) {
+		// Backward search of the reverse complement of the reversed read goes over the complemented read in its original
+		// orientation, so that k-LCP sliding works for it too, only k-mers come in the reverse order.
+		query_kmers(shard, opt, aux_data->rc_seq, kmers_cnt - to, kmers_cnt - from, aux_data->rc_is_ambiguous_kmer,
+		            aux_data->rc_is_restarted_kmer, aux_data, &aux_data->rc_sets);
+		kmer_node_sets_union(sets, &aux_data->rc_sets, 1, &aux_data->tmp_sets);
+		kmer_node_sets_swap(sets, &aux_data->tmp_sets);
+	}
+}
+
+// prepare_read_kmers for the k-mers from, ..., to - 1
+static int prepare_read_kmers_range(const prophex_shard_t* shards, int shards_cnt, const prophex_opt_t* opt, const bseq1_t* seq, int from, int to,
+                                    prophex_query_aux_t* aux_data) {
+	int is_forward_only = 0;
+	int s, i;
+	for (s = 0; s < shards_cnt; ++s) {
+		is_forward_only |= shards[s].is_forward_only;
+	}
+	aux_data_reserve(aux_data, seq->l_seq);
+	mark_kmers_range((ubyte_t*)seq->seq, opt, from, to, aux_data->is_ambiguous_kmer, aux_data->is_restarted_kmer);
+	if (is_forward_only) {
+		// reverse complements of the k-mers are kmers_cnt - to, ..., kmers_cnt - from - 1 of rc_seq, with the preceding base
+		int kmers_cnt = seq->l_seq - opt->kmer_length + 1;
+		int rc_from = kmers_cnt - to, rc_to = kmers_cnt - from;
+		for (i = rc_from > 0 ? rc_from - 1 : 0; i < rc_to + opt->kmer_length - 1; ++i) {
+			ubyte_t c = seq->seq[seq->l_seq - 1 - i];
+			aux_data->rc_seq[i] = c < 4 ? 3 - c : c;
+		}
+		mark_kmers_range(aux_data->rc_seq, opt, rc_from, rc_to, aux_data->rc_is_ambiguous_kmer, aux_data->rc_is_restarted_kmer);
+	}
+	return is_forward_only;
+}
+
+int prepare_read_kmers(const prophex_shard_t* shards, int shards_cnt, const prophex_opt_t* opt, const bseq1_t* seq, prophex_query_aux_t* aux_data) {
+	return prepare_read_kmers_range(shards, shards_cnt, opt, seq, 0, seq->l_seq - opt->kmer_length + 1, aux_data);
+}
+
+// query_shards_kmers for the k-mers from, ..., to - 1
+static void query_shards_kmers_range(const prophex_shard_t* shards, int shards_cnt, const prophex_opt_t* opt, const bseq1_t* seq, int from, int to,
+                                     prophex_query_aux_t* aux_data) {
+	int s;
+	for (s = 0; s < shards_cnt; ++s) {
+		query_read_kmers(&shards[s], opt, seq, from, to, aux_data, &aux_data->shard_sets);
+		if (s == 0) {
+			kmer_node_sets_swap(&aux_data->merged_sets, &aux_data->shard_sets);
+		} else {
+			kmer_node_sets_union(&aux_data->merged_sets, &aux_data->shard_sets, 0, &aux_data->tmp_sets);
+			kmer_node_sets_swap(&aux_data->merged_sets, &aux_data->tmp_sets);
+		}
+	}
+}
+
+void query_shards_kmers(const prophex_shard_t* shards, int shards_cnt, const prophex_opt_t* opt, const bseq1_t* seq, prophex_query_aux_t* aux_data) {
+	query_shards_kmers_range(shards, shards_cnt, opt, seq, 0, seq->l_seq - opt->kmer_length + 1, aux_data);
+}
+
+// state of the output of one read, built k-mer by k-mer
+typedef struct {
+	char* all_streaks;
+	char* current_streak;
+	const int32_t* prev_seen_nodes;
+	int prev_nodes_count;
+	int current_streak_size;
+	int is_first_streak;
+	int is_ambiguous_streak;
+	// streaks stored for the binary output or the assignment, NULL if they are not needed
+	read_streaks_t* collected;
+	int build_text;
+} streaks_state_t;
+
+void streaks_state_init(streaks_state_t* streaks, prophex_query_aux_t* aux_data, read_streaks_t* collected, int build_text) {
+	streaks->all_streaks = aux_data->all_streaks;
+	streaks->current_streak = aux_data->current_streak;
+	streaks->prev_seen_nodes = aux_data->prev_seen_nodes;
+	streaks->prev_nodes_count = 0;
+	streaks->current_streak_size = 0;
+	streaks->is_first_streak = 1;
+	streaks->is_ambiguous_streak = 0;
+	streaks->collected = collected;
+	streaks->build_text = build_text;
+	if (collected) {
+		read_streaks_clear(collected);
+	}
+}
+
+// completes the current streak with the nodes of the previous k-mer
+void end_streak(streaks_state_t* streaks) {
+	if (streaks->collected) {
+		read_streaks_add(streaks->collected, streaks->prev_seen_nodes, streaks->prev_nodes_count, streaks->current_streak_size,
+		                 streaks->is_ambiguous_streak);
+	}
+	if (streaks->build_text) {
+		construct_streaks(&streaks->all_streaks, &streaks->current_streak, streaks->prev_seen_nodes, streaks->prev_nodes_count,
+		                  streaks->current_streak_size, streaks->is_ambiguous_streak, &streaks->is_first_streak);
+	}
+}
+
+// seen_nodes must stay unchanged until the next call, as they are compared with the nodes of the next k-mer
+void add_kmer_to_streaks(streaks_state_t* streaks, const prophex_opt_t* opt, int is_ambiguous, int is_restarted, const int32_t* seen_nodes,
+                         int nodes_cnt) {
+	if (is_ambiguous) {
+		if (!streaks->is_ambiguous_streak) {
+			end_streak(streaks);
+			streaks->is_ambiguous_streak = 1;
+			streaks->current_streak_size = 1;
+		} else {
+			streaks->current_streak_size++;
+		}
+		return;
+	}
+	if (streaks->is_ambiguous_streak && streaks->current_streak_size > 0) {
+		end_streak(streaks);
+		streaks->is_ambiguous_streak = 0;
+		streaks->current_streak_size = 0;
+	}
+	if (opt->output_old) {
+		output_old(seen_nodes, nodes_cnt);
+	} else if (opt->output) {
+		if (is_restarted || (equal(nodes_cnt, seen_nodes, streaks->prev_nodes_count, streaks->prev_seen_nodes))) {
+			streaks->current_streak_size++;
+		} else {
+			end_streak(streaks);
+			streaks->current_streak_size = 1;
+		}
+	}
+	streaks->prev_seen_nodes = seen_nodes;
+	streaks->prev_nodes_count = nodes_cnt;
+}
+
+void finish_streaks(streaks_state_t* streaks, char** output) {
+	if (streaks->current_streak_size > 0) {
+		end_streak(streaks);
+	}
+	if (output && streaks->build_text) {
+		size_t all_streaks_length = strlen(streaks->all_streaks);
+		*output = malloc((all_streaks_length + 1) * sizeof(char));
+		strncpy(*output, streaks->all_streaks, all_streaks_length + 1);
+	}
+}
+
+static void format_sequence(kstring_t* s, const prophex_worker_t* prophex_worker, int seq_index, const char* streaks);
+static void flush_unordered_output(prophex_worker_t* prophex_worker, prophex_query_aux_t* aux_data);
+
+// completes the output of the read and assigns it to a node of the tree, in the unordered mode the output is written
+void finish_read(prophex_worker_t* prophex_worker, int seq_index, streaks_state_t* streaks, char** output, prophex_query_aux_t* aux_data,
+                 int l_seq) {
+	finish_streaks(streaks, output);
+	const prophex_opt_t* opt = prophex_worker->opt;
+	if (prophex_worker->tree) {
+		assign_read(prophex_worker->tree, streaks->collected, l_seq, opt->kmer_length, opt->assign_measure, &aux_data->assign_aux,
+		            &prophex_worker->assignments[seq_index]);
+	}
+	if (opt->output && opt->output_unordered) {
+		format_sequence(&aux_data->unordered_output, prophex_worker, seq_index, streaks->all_streaks);
+		// each fwrite is atomic, so the lines of the threads are not interleaved
+		if (aux_data->unordered_output.l >= UNORDERED_OUTPUT_BUFFER_SIZE) {
+			flush_unordered_output(prophex_worker, aux_data);
+		}
+	}
+}
+
+// NUMA node the current worker thread is pinned to
+static __thread int pinned_numa_node = -1;
+
+// shards queried by the thread, which is pinned to its NUMA node first
+static const prophex_shard_t* thread_shards(const prophex_worker_t* prophex_worker, int tid) {
+	const prophex_shard_t* shards = prophex_worker->shards;
+	if (prophex_worker->numa_nodes_cnt > 1) {
+		int node = tid % prophex_worker->numa_nodes_cnt;
+		if (pinned_numa_node != node) {
+			numa_pin_thread(node);
+			pinned_numa_node = node;
+		}
+		if (prophex_worker->replicas_cnt > 1) {
+			shards = prophex_worker->replicas[node] + prophex_worker->first_shard;
+		}
+	}
+	return shards;
+}
+
+// finds the node sets of the k-mers of a segment of a long read and merges them with those of the previous passes
+static void process_segment(prophex_worker_t* prophex_worker, const read_task_t* task, int tid) {
+	const prophex_opt_t* opt = prophex_worker->opt;
+	const bseq1_t* seq = &prophex_worker->seqs[task->seq_index];
+	prophex_query_aux_t* aux_data = &prophex_worker->aux_data[tid];
+	const prophex_shard_t* shards = thread_shards(prophex_worker, tid);
+	prepare_read_kmers_range(shards, prophex_worker->shards_cnt, opt, seq, task->from, task->to, aux_data);
+	query_shards_kmers_range(shards, prophex_worker->shards_cnt, opt, seq, task->from, task->to, aux_data);
+	kmer_node_sets_t* segment_sets = &prophex_worker->segment_sets[task->segment];
+	if (prophex_worker->pass > 0) {
+		kmer_node_sets_union(segment_sets, &aux_data->merged_sets, 0, &aux_data->tmp_sets);
+		kmer_node_sets_swap(&aux_data->merged_sets, &aux_data->tmp_sets);
+	}
+	kmer_node_sets_swap(segment_sets, &aux_data->merged_sets);
+}
+
+// builds the streaks of a long read from the node sets of its segments, after the last pass
+void stitch_long_read(void* data, int long_read, int tid) {
+	prophex_worker_t* prophex_worker = (prophex_worker_t*)data;
+	const prophex_opt_t* opt = prophex_worker->opt;
+	int seq_index = prophex_worker->long_reads[long_read];
+	const bseq1_t* seq = &prophex_worker->seqs[seq_index];
+	prophex_query_aux_t* aux_data = &prophex_worker->aux_data[tid];
+	aux_data_reserve(aux_data, seq->l_seq);
+	mark_kmers((ubyte_t*)seq->seq, seq->l_seq, opt, aux_data->is_ambiguous_kmer, aux_data->is_restarted_kmer);
+	char** output = opt->output && !opt->output_unordered ? &prophex_worker->output[seq_index] : NULL;
+	streaks_state_t streaks;
+	streaks_state_init(&streaks, aux_data, prophex_worker->streaks ? &prophex_worker->streaks[seq_index] : NULL, !opt->output_binary);
+	int start_pos = 0, segment, i;
+	for (segment = prophex_worker->long_read_segments[long_read]; segment < prophex_worker->long_read_segments[long_read + 1]; ++segment) {
+		const kmer_node_sets_t* sets = &prophex_worker->segment_sets[segment];
+		for (i = 0; i < sets->kmers_cnt; ++i, ++start_pos) {
+			size_t offset = sets->offsets[i];
+			add_kmer_to_streaks(&streaks, opt, aux_data->is_ambiguous_kmer[start_pos], aux_data->is_restarted_kmer[start_pos],
+			                    sets->nodes + offset, sets->offsets[i + 1] - offset);
+		}
+	}
+	finish_read(prophex_worker, seq_index, &streaks, output, aux_data, seq->l_seq);
+}
+
+void process_sequence(void* data, int task_index, int tid) {
+	prophex_worker_t* prophex_worker = (prophex_worker_t*)data;
+	const read_task_t* task = prophex_worker->tasks ? &prophex_worker->tasks[task_index] : NULL;
+	if (task && task->segment >= 0) {
+		process_segment(prophex_worker, task, tid);
+		return;
+	}
+	int seq_index = task ? task->seq_index : task_index;
+	bseq1_t seq = prophex_worker->seqs[seq_index];
+	const prophex_opt_t* opt = prophex_worker->opt;
+	prophex_query_aux_t* aux_data = &prophex_worker->aux_data[tid];
+	int is_last_pass = prophex_worker->pass == prophex_worker->passes_cnt - 1;
+	int i;
+
+	if (prophex_worker->pass == 0) {
+		for (i = 0; i < seq.l_seq; ++i)  // convert to 2-bit encoding if we have not done so
+			seq.seq[i] = seq.seq[i] < 4 ? seq.seq[i] : nst_nt4_table[(int)seq.seq[i]];
+		seq_reverse(seq.l_seq, seq.seq, 0);
+	}
+
+	if (opt->output_old && is_last_pass) {
+		fprintf(stdout, "#");
+		print_read(stdout, &seq);
+		fprintf(stdout, "\n");
+	}
+	if (opt->kmer_length > seq.l_seq) {
+		if (prophex_worker->streaks && is_last_pass) {
+			read_streaks_clear(&prophex_worker->streaks[seq_index]);
+		}
+		if (opt->output && opt->output_unordered && is_last_pass) {
+			format_sequence(&aux_data->unordered_output, prophex_worker, seq_index, "0:0");
+		} else if (opt->output && !opt->output_binary && is_last_pass) {
+			prophex_worker->output[seq_index] = malloc(5 * sizeof(char));
+			strncpy(prophex_worker->output[seq_index], "0:0", 5);
+		}
+		return;
+	}
+	const prophex_shard_t* shards = thread_shards(prophex_worker, tid);
+	int is_forward_only = prepare_read_kmers(shards, prophex_worker->shards_cnt, opt, &seq, aux_data);
+	int kmers_cnt = seq.l_seq - opt->kmer_length + 1;
+	char** output = opt->output && !opt->output_unordered ? &prophex_worker->output[seq_index] : NULL;
+	streaks_state_t streaks;
+	streaks_state_init(&streaks, aux_data, prophex_worker->streaks ? &prophex_worker->streaks[seq_index] : NULL, !opt->output_binary);
+	int start_pos;
+
+	if (prophex_worker->shards_cnt == 1 && prophex_worker->passes_cnt == 1 && !is_forward_only && !opt->use_fmd) {
+		// a single index, node sets of k-mers are turned into streaks on the fly
+		kmer_search_state_t state;
+		kmer_search_state_init(&state);
+		int32_t* seen_nodes = aux_data->seen_nodes;
+		int32_t* prev_seen_nodes = aux_data->prev_seen_nodes;
+		for (start_pos = 0; start_pos < kmers_cnt; ++start_pos) {
 			int nodes_cnt = 0;
-			if (k <= l) {
-				if (prev_l - prev_k == l - k && increased_l - decreased_k == l - k) {
-					aux_data.using_prev_rids++;
-					shift_positions_by_one(idx, positions_cnt, aux_data.positions, opt->kmer_length, k, l);
-				} else {
-					aux_data.rids_computations++;
-					positions_cnt = get_positions(idx, aux_data.positions, opt->kmer_length, k, l);
-				}
-				nodes_cnt = get_nodes_from_positions(idx, opt->kmer_length, positions_cnt, aux_data.positions, seen_nodes, &seen_nodes_marks,
-				                                     opt->skip_positions_on_border);
+			if (!aux_data->is_ambiguous_kmer[start_pos]) {
+				nodes_cnt = query_kmer(&shards[0], opt, (ubyte_t*)seq.seq, start_pos, aux_data->is_restarted_kmer[start_pos],
+				                       &state, aux_data, seen_nodes);
 			}
-			if (opt->output_old) {
-				output_old(seen_nodes, nodes_cnt);
-			} else if (opt->output) {
-				if (start_pos == 0 || ambiguous_streak_just_ended || (equal(nodes_cnt, seen_nodes, prev_nodes_count, prev_seen_nodes))) {
-					current_streak_size++;
-				} else {
-					construct_streaks(&all_streaks, &current_streak, prev_seen_nodes, prev_nodes_count, current_streak_size, is_ambiguous_streak,
-					                  &is_first_streak);
-					current_streak_size = 1;
-				}
+			add_kmer_to_streaks(&streaks, opt, aux_data->is_ambiguous_kmer[start_pos], aux_data->is_restarted_kmer[start_pos], seen_nodes,
+			                    nodes_cnt);
+			if (!aux_data->is_ambiguous_kmer[start_pos]) {
+				int32_t* tmp = seen_nodes;
+				seen_nodes = prev_seen_nodes;
+				prev_seen_nodes = tmp;
 			}
-			int* tmp = seen_nodes;
-			seen_nodes = prev_seen_nodes;
-			prev_seen_nodes = tmp;
-			prev_nodes_count = nodes_cnt;
-			prev_k = k;
-			prev_l = l;
-			start_pos++;
-		}
-		if (current_streak_size > 0) {
-			construct_streaks(&all_streaks, &current_streak, prev_seen_nodes, prev_nodes_count, current_streak_size, is_ambiguous_streak,
-			                  &is_first_streak);
 		}
-		if (opt->output) {
-			size_t all_streaks_length = strlen(all_streaks);
-			prophex_worker->output[seq_index] = malloc((all_streaks_length + 1) * sizeof(char));
-			strncpy(prophex_worker->output[seq_index], all_streaks, all_streaks_length + 1);
+		finish_read(prophex_worker, seq_index, &streaks, output, aux_data, seq.l_seq);
+		return;
+	}
+
+	// several shards or strands, node sets of every k-mer are merged over all of them first
+	query_shards_kmers(shards, prophex_worker->shards_cnt, opt, &seq, aux_data);
+	if (prophex_worker->passes_cnt > 1) {
+		kmer_node_sets_t* stored_sets = &prophex_worker->stored_sets[seq_index];
+		if (prophex_worker->pass > 0) {
+			kmer_node_sets_union(stored_sets, &aux_data->merged_sets, 0, &aux_data->tmp_sets);
+			kmer_node_sets_swap(&aux_data->merged_sets, &aux_data->tmp_sets);
 		}
+		if (!is_last_pass) {
+			kmer_node_sets_swap(stored_sets, &aux_data->merged_sets);
+			return;
+		}
+	}
+	const kmer_node_sets_t* sets = &aux_data->merged_sets;
+	for (start_pos = 0; start_pos < kmers_cnt; ++start_pos) {
+		size_t offset = sets->offsets[start_pos];
+		add_kmer_to_streaks(&streaks, opt, aux_data->is_ambiguous_kmer[start_pos], aux_data->is_restarted_kmer[start_pos], sets->nodes + offset,
+		                    sets->offsets[start_pos + 1] - offset);
 	}
+	finish_read(prophex_worker, seq_index, &streaks, output, aux_data, seq.l_seq);
 }
 
-void process_sequences(const bwaidx_t* idx, int n_seqs, bseq1_t* seqs, const prophex_opt_t* opt, const klcp_t* klcp) {
-	extern void kt_for(int n_threads, void (*func)(void*, int, int), void* data, int n);
-	bwase_initialize();
-	prophex_worker_t* prophex_worker = prophex_worker_init(idx, n_seqs, seqs, opt, klcp);
-	kt_for(opt->n_threads, process_sequence, prophex_worker, n_seqs);
+// appends the output line of the read with the text of its streaks
+static void format_sequence(kstring_t* s, const prophex_worker_t* prophex_worker, int seq_index, const char* streaks) {
+	const prophex_opt_t* opt = prophex_worker->opt;
+	const bseq1_t* seq = &prophex_worker->seqs[seq_index];
+	const read_assignment_t* assignment = prophex_worker->tree ? &prophex_worker->assignments[seq_index] : NULL;
+	int j;
+	if (assignment && assignment->node >= 0) {
+		kputs("C\t", s);
+		kputs(seq->name, s);
+		kputc('\t', s);
+		kputs(prophex_worker->tree->names[assignment->node], s);
+	} else {
+		kputs("U\t", s);
+		kputs(seq->name, s);
+		kputs("\t0", s);
+	}
+	kputc('\t', s);
+	kputw(seq->l_seq, s);
+	kputc('\t', s);
+	kputs(streaks, s);
+	if (assignment) {
+		kputc('\t', s);
+		kputw(assignment->h1, s);
+		kputc('\t', s);
+		kputw(assignment->c1, s);
+	}
+	if (opt->output_read_qual) {
+		kputc('\t', s);
+		// the read is 2-bit encoded and reversed
+		for (j = seq->l_seq - 1; j >= 0; --j) {
+			kputc("ACGTN"[(int)seq->seq[j]], s);
+		}
+		kputc('\t', s);
+		if (seq->qual) {
+			kputsn(seq->qual, seq->l_seq, s);
+		} else {
+			kputc('*', s);
+		}
+	}
+	if (opt->output_unordered) {
+		kputc('\t', s);
+		kputl(prophex_worker->first_read_number + seq_index, s);
+	}
+	kputc('\n', s);
+}
+
+void print_sequences(FILE* out, int n_seqs, const bseq1_t* seqs, const prophex_worker_t* prophex_worker, const prophex_opt_t* opt) {
+	if (!opt->output) {
+		return;
+	}
+	kstring_t s = {0, 0, NULL};
 	int i;
 	for (i = 0; i < n_seqs; ++i) {
-		bseq1_t* seq = seqs + i;
-		if (opt->output) {
-			fprintf(stdout, "U\t%s\t0\t%d\t", seq->name, seq->l_seq);
-			print_streaks(prophex_worker->output[i]);
-			if (opt->output_read_qual) {
-				fprintf(stdout, "\t");
-				print_read(seq);
-				fprintf(stdout, "\t");
-				print_read_qual(seq);
-			}
-			fprintf(stdout, "\n");
-		}
+		s.l = 0;
+		format_sequence(&s, prophex_worker, i, prophex_worker->output[i]);
+		fwrite(s.s, 1, s.l, out);
+	}
+	free(s.s);
+}
+
+// writes the reads finished by the thread since the last flush
+static void flush_unordered_output(prophex_worker_t* prophex_worker, prophex_query_aux_t* aux_data) {
+	if (aux_data->unordered_output.l > 0) {
+		fwrite(aux_data->unordered_output.s, 1, aux_data->unordered_output.l, prophex_worker->out);
+		aux_data->unordered_output.l = 0;
+	}
+}
+
+static void flush_unordered_outputs(prophex_worker_t* prophex_worker) {
+	int tid;
+	for (tid = 0; tid < prophex_worker->opt->n_threads; ++tid) {
+		flush_unordered_output(prophex_worker, &prophex_worker->aux_data[tid]);
 	}
-	prophex_worker_destroy(prophex_worker);
 }
 
 void destroy_reads(int n_seqs, bseq1_t* seqs) {
@@ -495,51 +1155,583 @@ void destroy_reads(int n_seqs, bseq1_t* seqs) {
 	free(seqs);
 }
 
-void query(const char* prefix, const char* fn_fa, const prophex_opt_t* opt) {
-	extern bwa_seqio_t* bwa_open_reads(int mode, const char* fn_fa);
+char* klcp_file_name(const char* prefix, int kmer_length) {
+	char* fn = malloc((strlen(prefix) + 10) * sizeof(char));
+	strcpy(fn, prefix);
+	strcat(fn, ".");
+	char* kmer_length_str = malloc(5 * sizeof(char));
+	sprintf(kmer_length_str, "%d", kmer_length);
+	strcat(fn, kmer_length_str);
+	strcat(fn, ".klcp");
+	free(kmer_length_str);
+	return fn;
+}
 
-	int n_seqs;
-	bseq1_t* seqs;
-	bwaidx_t* idx;
-	int i;
+// the BWT with interleaved k-LCP bits written by prophex interleave
+char* interleaved_bwt_suffix(int kmer_length) {
+	char* suffix = malloc(20 * sizeof(char));
+	sprintf(suffix, ".%d.ibwt", kmer_length);
+	return suffix;
+}
+
+int64_t file_size(const char* prefix, const char* suffix) {
+	struct stat st;
+	char* fn = malloc((strlen(prefix) + strlen(suffix) + 1) * sizeof(char));
+	strcat(strcpy(fn, prefix), suffix);
+	int64_t size = stat(fn, &st) == 0 ? (int64_t)st.st_size : 0;
+	free(fn);
+	return size;
+}
+
+int64_t shard_size(const char* prefix, const prophex_opt_t* opt) {
+	int64_t size = file_size(prefix, ".sa");
+	int64_t interleaved_size = 0;
+	if (opt->use_klcp) {
+		char* suffix = interleaved_bwt_suffix(opt->kmer_length);
+		interleaved_size = file_size(prefix, suffix);
+		free(suffix);
+	}
+	if (interleaved_size > 0) {
+		return size + interleaved_size;
+	}
+	// the run-length encoded BWT takes a quarter more memory than its file, for the counts computed when it is loaded
+	int64_t rlbwt_size = file_size(prefix, ".rlbwt");
+	size += rlbwt_size > 0 ? rlbwt_size + rlbwt_size / 4 : file_size(prefix, ".bwt");
+	size += file_size(prefix, ".san");
+	if (opt->use_klcp) {
+		char* klcp_suffix = klcp_file_name("", opt->kmer_length);
+		size += file_size(prefix, klcp_suffix);
+		free(klcp_suffix);
+	}
+	return size;
+}
+
+// files of the index are loaded by separate threads; the annotations of all shards are parsed by one of them in the
+// order of the shards, since their contigs are numbered consecutively
+#define INDEX_LOADER_THREADS 8
+
+enum { LOAD_BNS, LOAD_BWT, LOAD_SA, LOAD_SA_CONTIGS, LOAD_KLCP };
+
+typedef struct {
+	int type;
+	prophex_shard_t* shard;
+	// replica of the shard, placed on the NUMA node with this number
+	int replica;
+	char* fn;
+	bwt_sa_t* sa;
+	// real time of loading, in seconds
+	double time;
+} index_load_task_t;
+
+typedef struct {
+	index_load_task_t* tasks;
+	prophex_shard_t* shards;
+	int shards_cnt;
+	const prophex_opt_t* opt;
 	FILE* log_file;
-	gzFile fp = 0;
-	void* ko = 0;
+} index_loader_t;
+
+void load_index_file(void* data, int i, int tid) {
+	index_loader_t* loader = (index_loader_t*)data;
+	index_load_task_t* task = &loader->tasks[i];
+	const prophex_opt_t* opt = loader->opt;
+	double rtime = realtime();
+	if (opt->numa_mode == NUMA_REPLICATE) {
+		numa_prefer_node(task->replica);
+	} else if (opt->numa_mode == NUMA_INTERLEAVE) {
+		numa_interleave_nodes();
+	}
+	if (task->type == LOAD_BNS) {
+		int s;
+		for (s = 0; s < loader->shards_cnt; ++s) {
+			double bns_rtime = realtime();
+			prophex_shard_t* shard = &loader->shards[s];
+			shard->contig_offset = get_contigs_count();
+			char* prefix = index_infer_prefix(shard->prefix);
+			shard->idx->bns = bns_restore_partial(prefix);
+			bwa_destroy_unused_fields(shard->idx);
+			free(prefix);
+			if (opt->need_log) {
+				fprintf(loader->log_file, "bns_loading\t%.2fs\n", realtime() - bns_rtime);
+			}
+		}
+	} else if (task->type == LOAD_BWT) {
+		task->shard->idx->bwt = bwt_restore_bwt_any_width(task->fn);
+	} else if (task->type == LOAD_SA) {
+		task->sa = bwt_restore_sa_only(task->fn);
+	} else if (task->type == LOAD_SA_CONTIGS) {
+		task->shard->sa_contigs = sa_contigs_restore(task->fn);
+	} else {
+		task->shard->klcp = malloc(sizeof(klcp_t));
+		task->shard->klcp->klcp = malloc(sizeof(bitarray_t));
+		klcp_restore(task->fn, task->shard->klcp);
+	}
+	if (opt->numa_mode != NUMA_OFF) {
+		numa_reset_memory_policy();
+	}
+	task->time = realtime() - rtime;
+}
+
+void add_index_load_task(index_load_task_t* tasks, int* tasks_cnt, int type, prophex_shard_t* shard, int replica, const char* prefix,
+                         const char* suffix) {
+	index_load_task_t* task = &tasks[(*tasks_cnt)++];
+	task->type = type;
+	task->shard = shard;
+	task->replica = replica;
+	task->fn = NULL;
+	if (prefix) {
+		task->fn = malloc(strlen(prefix) + strlen(suffix) + 1);
+		strcat(strcpy(task->fn, prefix), suffix);
+	}
+	task->sa = NULL;
+	task->time = 0;
+}
+
+// completes the shard whose files are loaded by the tasks
+void shard_finish_loading(prophex_shard_t* shard, index_load_task_t* tasks, int tasks_cnt, const prophex_opt_t* opt, FILE* log_file) {
+	int i;
+	for (i = 0; i < tasks_cnt; ++i) {
+		if (tasks[i].shard == shard && tasks[i].type == LOAD_SA) {
+			bwt_attach_sa(shard->idx->bwt, tasks[i].sa);
+		}
+	}
+	// BWT of a forward-only index (prophex index -f) has the same length as the reference
+	const bntann1_t* last_ann = &shard->idx->bns->anns[shard->idx->bns->n_seqs - 1];
+	shard->is_forward_only = shard->idx->bwt->seq_len == last_ann->offset + last_ann->len;
+	// If fa2pac was called only for doubled string, then set bns->l_pac = bwt->seq_len / 2, as it is for forward-only string
+	shard->idx->bns->l_pac = shard->is_forward_only ? shard->idx->bwt->seq_len : shard->idx->bwt->seq_len / 2;
+	if (opt->use_fmd && shard->is_forward_only) {
+		fprintf(stderr, "[prophex:%s] %s is a forward-only index, it will be queried without bidirectional search\n", __func__, shard->prefix);
+	}
+	if (shard->sa_contigs && !sa_contigs_match(shard->sa_contigs, shard->idx->bwt)) {
+		fprintf(stderr, "[prophex:%s] contigs of SA samples of %s were built for another .sa, they are not used\n", __func__, shard->prefix);
+		sa_contigs_destroy(shard->sa_contigs);
+		shard->sa_contigs = NULL;
+	}
+	if (shard->idx->bwt->klcp_k) {
+		// the k-LCP bits are already loaded with the BWT
+		shard->klcp = klcp_from_interleaved_bwt(shard->idx->bwt);
+	}
+	if (!opt->need_log) {
+		return;
+	}
+	for (i = 0; i < tasks_cnt; ++i) {
+		if (tasks[i].shard != shard) {
+			continue;
+		}
+		if (tasks[i].type == LOAD_BWT) {
+			fprintf(log_file, "bwt_loading\t%.2fs\n", tasks[i].time);
+			fprintf(log_file, "bwt_pages\t%s\n", index_pages_backing(shard->idx->bwt->rl ? (const void*)shard->idx->bwt->rl->starts : shard->idx->bwt->bwt));
+			if (shard->idx->bwt->rl) {
+				fprintf(log_file, "bwt_runs\t%" PRIu64 "\n", shard->idx->bwt->rl->n_runs);
+			}
+		} else if (tasks[i].type == LOAD_SA) {
+			fprintf(log_file, "sa_loading\t%.2fs\n", tasks[i].time);
+			fprintf(log_file, "sa_pages\t%s\n", index_pages_backing(shard->idx->bwt->sa));
+			fprintf(log_file, "sa_sampling\t%s %d\n", shard->idx->bwt->sa_marks ? "text" : "rows", shard->idx->bwt->sa_intv);
+			fprintf(log_file, "sa_samples\t%" PRIu64 "\n", (uint64_t)shard->idx->bwt->n_sa);
+		} else if (tasks[i].type == LOAD_SA_CONTIGS) {
+			fprintf(log_file, "sa_contigs_loading\t%.2fs\n", tasks[i].time);
+			fprintf(log_file, "sa_contigs\t%s\n", shard->sa_contigs ? "used" : "stale");
+		} else if (tasks[i].type == LOAD_KLCP) {
+			fprintf(log_file, "klcp_loading\t%.2fs\n", tasks[i].time);
+			fprintf(log_file, "klcp_pages\t%s\n", index_pages_backing(shard->klcp->klcp->blocks));
+		}
+	}
+	if (shard->idx->bwt->klcp_k) {
+		fprintf(log_file, "klcp_loading\tinterleaved\n");
+	}
+}
+
+// loads BWT, SA and k-LCP of the shards from..to - 1 of every replica (each on its NUMA node), and the annotations of
+// all shards if load_bns; the files are loaded at the same time, so the loading takes about as long as the slowest one
+void shards_load(prophex_shard_t** replicas, int replicas_cnt, int from, int to, int load_bns, int shards_cnt, const prophex_opt_t* opt,
+                 FILE* log_file) {
+	extern void kt_for(int n_threads, void (*func)(void*, int, int), void* data, int n);
+	double rtime = realtime();
+	index_load_task_t* tasks = malloc((4 * replicas_cnt * (to - from) + 1) * sizeof(index_load_task_t));
+	int tasks_cnt = 0;
+	int r, s, i;
+	// the annotations are parsed by the first thread, their parsing cannot be split
+	if (load_bns) {
+		add_index_load_task(tasks, &tasks_cnt, LOAD_BNS, NULL, 0, NULL, NULL);
+	}
+	char* interleaved_suffix = interleaved_bwt_suffix(opt->kmer_length);
+	char* klcp_suffix = klcp_file_name("", opt->kmer_length);
+	for (r = 0; r < replicas_cnt; ++r) {
+		for (s = from; s < to; ++s) {
+			prophex_shard_t* shard = &replicas[r][s];
+			char* prefix = index_infer_prefix(shard->prefix);
+			// BWT in the interleaved layout with -u, run-length encoded or plain, the first one present
+			int is_interleaved = opt->use_klcp && file_size(shard->prefix, interleaved_suffix) > 0;
+			const char* bwt_suffix = is_interleaved ? interleaved_suffix : file_size(shard->prefix, ".rlbwt") > 0 ? ".rlbwt" : ".bwt";
+			add_index_load_task(tasks, &tasks_cnt, LOAD_BWT, shard, r, prefix, bwt_suffix);
+			add_index_load_task(tasks, &tasks_cnt, LOAD_SA, shard, r, prefix, ".sa");
+			if (file_size(shard->prefix, ".san") > 0) {
+				add_index_load_task(tasks, &tasks_cnt, LOAD_SA_CONTIGS, shard, r, prefix, ".san");
+			}
+			if (opt->use_klcp && !is_interleaved) {
+				add_index_load_task(tasks, &tasks_cnt, LOAD_KLCP, shard, r, shard->prefix, klcp_suffix);
+			}
+			free(prefix);
+		}
+	}
+	free(interleaved_suffix);
+	free(klcp_suffix);
+	index_loader_t loader = {tasks, replicas[0], shards_cnt, opt, log_file};
+	kt_for(tasks_cnt < INDEX_LOADER_THREADS ? tasks_cnt : INDEX_LOADER_THREADS, load_index_file, &loader, tasks_cnt);
+	for (r = 1; r < replicas_cnt && load_bns; ++r) {
+		for (s = 0; s < shards_cnt; ++s) {
+			replicas[r][s].idx->bns = replicas[0][s].idx->bns;
+			replicas[r][s].contig_offset = replicas[0][s].contig_offset;
+		}
+	}
+	for (r = 0; r < replicas_cnt; ++r) {
+		for (s = from; s < to; ++s) {
+			shard_finish_loading(&replicas[r][s], tasks, tasks_cnt, opt, log_file);
+		}
+	}
+	if (opt->need_log) {
+		int slowest = 0;
+		for (i = 1; i < tasks_cnt; ++i) {
+			if (tasks[i].time > tasks[slowest].time) {
+				slowest = i;
+			}
+		}
+		fprintf(log_file, "index_loading\t%.2fs\n", realtime() - rtime);
+		fprintf(log_file, "index_loading_critical_path\t%s\t%.2fs\n", tasks[slowest].fn ? tasks[slowest].fn : "annotations",
+		        tasks[slowest].time);
+	}
+	for (i = 0; i < tasks_cnt; ++i) {
+		free(tasks[i].fn);
+	}
+	free(tasks);
+}
+
+void shard_unload(prophex_shard_t* shard) {
+	if (shard->idx->bwt) {
+		bwt_destroy_index(shard->idx->bwt);
+		shard->idx->bwt = 0;
+	}
+	if (shard->klcp) {
+		destroy_klcp(shard->klcp);
+		shard->klcp = 0;
+	}
+	sa_contigs_destroy(shard->sa_contigs);
+	shard->sa_contigs = 0;
+}
+
+void shards_unload(prophex_shard_t** replicas, int replicas_cnt, int from, int to) {
+	int r, s;
+	for (r = 0; r < replicas_cnt; ++r) {
+		for (s = from; s < to; ++s) {
+			shard_unload(&replicas[r][s]);
+		}
+	}
+}
+
+// splits shards into consecutive groups with total size within the memory budget, returns the number of groups
+int group_shards(const prophex_shard_t* shards, int shards_cnt, int64_t memory_budget, int* group_starts) {
+	int groups_cnt = 0;
+	int64_t group_size = 0;
+	int s;
+	for (s = 0; s < shards_cnt; ++s) {
+		if (s == 0 || (memory_budget > 0 && group_size + shards[s].size > memory_budget)) {
+			group_starts[groups_cnt++] = s;
+			group_size = 0;
+		}
+		group_size += shards[s].size;
+	}
+	group_starts[groups_cnt] = shards_cnt;
+	return groups_cnt;
+}
 
+prophex_index_t* query_index_load(const char** prefixes, int prefixes_cnt, const prophex_opt_t* opt) {
+	int s, r;
+	FILE* log_file;
 	if (opt->need_log) {
 		log_file = fopen(opt->log_file_name, "w");
 	} else {
 		log_file = stderr;
 	}
 
-	if ((idx = bwa_idx_load_partial(prefix, BWA_IDX_ALL, opt->need_log, log_file)) == 0) {
-		fprintf(stderr, "[prophex:%s] Couldn't load idx from %s\n", __func__, prefix);
+	index_set_huge_pages(opt->huge_pages);
+	prophex_shard_t* shards = calloc(prefixes_cnt, sizeof(prophex_shard_t));
+	for (s = 0; s < prefixes_cnt; ++s) {
+		shards[s].prefix = prefixes[s];
+		char* prefix = index_infer_prefix(prefixes[s]);
+		if (prefix == 0) {
+			fprintf(stderr, "[prophex:%s] Couldn't load idx from %s\n", __func__, prefixes[s]);
+			return NULL;
+		}
+		free(prefix);
+		// the annotations are loaded together with the first group of shards
+		shards[s].idx = calloc(1, sizeof(bwaidx_t));
+		shards[s].size = shard_size(prefixes[s], opt);
+	}
+	// with NUMA, every node gets a replica of BWT, SA and k-LCP (sharing the annotations), or their pages are interleaved
+	int numa_nodes_cnt = opt->numa_mode != NUMA_OFF ? numa_nodes_count() : 1;
+	if (opt->numa_mode != NUMA_OFF && numa_nodes_cnt == 1) {
+		fprintf(stderr, "[prophex:%s] only one NUMA node is available, NUMA placement has no effect\n", __func__);
+	}
+	int replicas_cnt = opt->numa_mode == NUMA_REPLICATE ? numa_nodes_cnt : 1;
+	prophex_shard_t** replicas = malloc(replicas_cnt * sizeof(prophex_shard_t*));
+	replicas[0] = shards;
+	for (r = 1; r < replicas_cnt; ++r) {
+		replicas[r] = malloc(prefixes_cnt * sizeof(prophex_shard_t));
+		for (s = 0; s < prefixes_cnt; ++s) {
+			replicas[r][s] = shards[s];
+			replicas[r][s].idx = malloc(sizeof(bwaidx_t));
+			*replicas[r][s].idx = *shards[s].idx;
+		}
+	}
+	for (s = 0; s < prefixes_cnt; ++s) {
+		shards[s].size *= replicas_cnt;
+	}
+	if (opt->need_log && opt->numa_mode != NUMA_OFF) {
+		fprintf(log_file, "numa_nodes\t%d\n", numa_nodes_cnt);
+		fprintf(log_file, "numa_replicas\t%d\n", replicas_cnt);
+	}
+	int* group_starts = malloc((prefixes_cnt + 1) * sizeof(int));
+	int groups_cnt = group_shards(shards, prefixes_cnt, opt->shards_memory_budget, group_starts);
+	if (groups_cnt > 1) {
+		fprintf(stderr, "[prophex:%s] %d shards do not fit into the memory budget, they will be queried in %d groups\n", __func__, prefixes_cnt,
+		        groups_cnt);
+	}
+	shards_load(replicas, replicas_cnt, 0, group_starts[1], 1, prefixes_cnt, opt, log_file);
+	bwase_initialize();
+	// the nodes of the tree are matched with those of the index, known once the annotations are loaded
+	prophex_tree_t* tree = NULL;
+	if (opt->tree_file_name && (tree = tree_load(opt->tree_file_name)) == NULL) {
+		return NULL;
+	}
+
+	prophex_index_t* index = calloc(1, sizeof(prophex_index_t));
+	index->shards = shards;
+	index->shards_cnt = prefixes_cnt;
+	index->replicas = replicas;
+	index->replicas_cnt = replicas_cnt;
+	index->numa_nodes_cnt = numa_nodes_cnt;
+	index->group_starts = group_starts;
+	index->groups_cnt = groups_cnt;
+	index->loaded_group = 0;
+	index->log_file = log_file;
+	index->tree = tree;
+	pthread_mutex_init(&index->lock, NULL);
+	return index;
+}
+
+void query_index_destroy(prophex_index_t* index, const prophex_opt_t* opt) {
+	int r, s;
+	if (opt->need_log) {
+		fclose(index->log_file);
+	}
+	shards_unload(index->replicas, index->replicas_cnt, 0, index->shards_cnt);
+	for (r = 1; r < index->replicas_cnt; ++r) {
+		for (s = 0; s < index->shards_cnt; ++s) {
+			free(index->replicas[r][s].idx);
+		}
+		free(index->replicas[r]);
+	}
+	free(index->replicas);
+	for (s = 0; s < index->shards_cnt; ++s) {
+		bwa_idx_destroy_without_bns_name_and_anno(index->shards[s].idx);
+	}
+	free(index->shards);
+	free(index->group_starts);
+	tree_destroy(index->tree);
+	pthread_mutex_destroy(&index->lock);
+	free(index);
+}
+
+// matches the chunk of reads against all groups of shards
+static void query_chunk(prophex_index_t* index, int n_seqs, bseq1_t* seqs, prophex_worker_t* prophex_worker, const prophex_opt_t* opt) {
+	extern void kt_for(int n_threads, void (*func)(void*, int, int), void* data, int n);
+	int groups_cnt = index->groups_cnt;
+	const int* group_starts = index->group_starts;
+	// start with the group which is still loaded from the previous chunk
+	int is_reversed_order = index->loaded_group > 0;
+	int pass;
+	for (pass = 0; pass < groups_cnt; ++pass) {
+		int group = is_reversed_order ? groups_cnt - 1 - pass : pass;
+		if (group != index->loaded_group) {
+			if (index->loaded_group >= 0) {
+				shards_unload(index->replicas, index->replicas_cnt, group_starts[index->loaded_group], group_starts[index->loaded_group + 1]);
+			}
+			shards_load(index->replicas, index->replicas_cnt, group_starts[group], group_starts[group + 1], 0, index->shards_cnt, opt,
+			            index->log_file);
+			index->loaded_group = group;
+		}
+		prophex_worker->shards = index->shards + group_starts[group];
+		prophex_worker->shards_cnt = group_starts[group + 1] - group_starts[group];
+		prophex_worker->replicas = index->replicas;
+		prophex_worker->replicas_cnt = index->replicas_cnt;
+		prophex_worker->first_shard = group_starts[group];
+		prophex_worker->numa_nodes_cnt = index->numa_nodes_cnt;
+		prophex_worker->pass = pass;
+		kt_for(opt->n_threads, process_sequence, prophex_worker, prophex_worker->tasks ? prophex_worker->tasks_cnt : n_seqs);
+	}
+	if (prophex_worker->long_reads_cnt > 0) {
+		kt_for(opt->n_threads, stitch_long_read, prophex_worker, prophex_worker->long_reads_cnt);
+	}
+}
+
+typedef struct {
+	prophex_index_t* index;
+	kseq_t* ks;
+	FILE* out;
+	const prophex_opt_t* opt;
+	binary_output_t* binary_output;
+	int64_t seqs_cnt;
+	int64_t kmers_cnt;
+	double reading_time;
+	// number of base pairs in the next chunk read, updated after every chunk is matched unless set by query -C
+	int chunk_size;
+	int min_chunk_size;
+	int max_chunk_size;
+	pthread_mutex_t chunk_size_lock;
+} query_pipeline_t;
+
+typedef struct {
+	int n_seqs;
+	bseq1_t* seqs;
+} query_pipeline_chunk_t;
+
+// sizes the next chunks so that they are matched in about READ_CHUNK_TIME, at most twice larger or smaller than the last one
+static void update_chunk_size(query_pipeline_t* pipeline, int64_t bases_cnt, double time) {
+	if (pipeline->opt->read_chunk_size > 0 || bases_cnt == 0) {
 		return;
 	}
+	double chunk_size = time > 0 ? bases_cnt * READ_CHUNK_TIME / time : pipeline->max_chunk_size;
+	if (chunk_size > 2.0 * bases_cnt) {
+		chunk_size = 2.0 * bases_cnt;
+	} else if (chunk_size < 0.5 * bases_cnt) {
+		chunk_size = 0.5 * bases_cnt;
+	}
+	if (chunk_size > pipeline->max_chunk_size) {
+		chunk_size = pipeline->max_chunk_size;
+	} else if (chunk_size < pipeline->min_chunk_size) {
+		chunk_size = pipeline->min_chunk_size;
+	}
+	pthread_mutex_lock(&pipeline->chunk_size_lock);
+	pipeline->chunk_size = (int)chunk_size;
+	pthread_mutex_unlock(&pipeline->chunk_size_lock);
+}
 
-	// If fa2pac was called only for doubled string, then set bns->l_pac = bwt->seq_len, as it is for forward-only string
-	idx->bns->l_pac = idx->bwt->seq_len / 2;
+// step 0 reads a chunk, step 1 matches it and writes its output
+static void* query_pipeline_step(void* shared, int step, void* data) {
+	query_pipeline_t* pipeline = (query_pipeline_t*)shared;
+	const prophex_opt_t* opt = pipeline->opt;
+	prophex_index_t* index = pipeline->index;
+	int i;
+	if (step == 0) {
+		double rtime = realtime();
+		pthread_mutex_lock(&pipeline->chunk_size_lock);
+		int chunk_size = pipeline->chunk_size;
+		pthread_mutex_unlock(&pipeline->chunk_size_lock);
+		query_pipeline_chunk_t* chunk = calloc(1, sizeof(query_pipeline_chunk_t));
+		chunk->seqs = bseq_read(chunk_size, &chunk->n_seqs, pipeline->ks, NULL);
+		pipeline->reading_time += realtime() - rtime;
+		if (chunk->seqs == 0) {
+			free(chunk);
+			return NULL;
+		}
+		return chunk;
+	}
+	query_pipeline_chunk_t* chunk = (query_pipeline_chunk_t*)data;
+	int n_seqs = chunk->n_seqs;
+	bseq1_t* seqs = chunk->seqs;
+	prophex_worker_t* prophex_worker = prophex_worker_init(index->shards, index->shards_cnt, index->groups_cnt, n_seqs, seqs, opt);
+	prophex_worker->tree = index->tree;
+	prophex_worker->out = pipeline->out;
+	prophex_worker->first_read_number = pipeline->seqs_cnt;
+	// the threads and the loaded group of shards are shared by all streams, reading and output are not
+	pthread_mutex_lock(&index->lock);
+	// the time of waiting for the other streams is not counted
+	double rtime = realtime();
+	query_chunk(index, n_seqs, seqs, prophex_worker, opt);
+	pthread_mutex_unlock(&index->lock);
+	if (opt->output_unordered) {
+		flush_unordered_outputs(prophex_worker);
+	} else if (pipeline->binary_output) {
+		for (i = 0; i < n_seqs; ++i) {
+			binary_output_read(pipeline->binary_output, seqs[i].name, seqs[i].l_seq, &prophex_worker->streaks[i]);
+		}
+		binary_output_flush(pipeline->binary_output);
+	} else {
+		print_sequences(pipeline->out, n_seqs, seqs, prophex_worker, opt);
+	}
+	prophex_worker_destroy(prophex_worker);
+	pipeline->seqs_cnt += n_seqs;
+	int64_t bases_cnt = 0;
+	for (i = 0; i < n_seqs; ++i) {
+		int seq_kmers_count = seqs[i].l_seq - opt->kmer_length + 1;
+		if (seq_kmers_count > 0) {
+			pipeline->kmers_cnt += seq_kmers_count;
+		}
+		bases_cnt += seqs[i].l_seq;
+	}
+	update_chunk_size(pipeline, bases_cnt, realtime() - rtime);
+	destroy_reads(n_seqs, seqs);
+	free(chunk);
+	return NULL;
+}
 
-	bwa_destroy_unused_fields(idx);
+int query_stream(prophex_index_t* index, gzFile in, FILE* out, const prophex_opt_t* opt, int64_t* seqs_cnt, int64_t* kmers_cnt,
+                 double* reading_time) {
+	extern void kt_pipeline(int n_threads, void* (*func)(void*, int, void*), void* shared_data, int n_steps);
+	query_pipeline_t pipeline = {index, kseq_init(in), out, opt, NULL, 0, 0, 0};
+	// adaptive chunks start small, so that the matching starts early, and grow with the speed of matching up to
+	// READ_CHUNK_SIZE, which bounds the memory of the reads and of their output; every chunk has work for all threads
+	pipeline.max_chunk_size = READ_CHUNK_SIZE;
+	pipeline.min_chunk_size = opt->n_threads * READ_CHUNK_MIN_SIZE < READ_CHUNK_SIZE ? opt->n_threads * READ_CHUNK_MIN_SIZE : READ_CHUNK_SIZE;
+	pipeline.chunk_size = opt->read_chunk_size > 0 ? opt->read_chunk_size : pipeline.min_chunk_size;
+	// with several groups of shards, every chunk loads all of them, so the chunks are as large as possible
+	if (opt->read_chunk_size == 0 && index->groups_cnt > 1) {
+		pipeline.chunk_size = pipeline.min_chunk_size = pipeline.max_chunk_size;
+	}
+	pthread_mutex_init(&pipeline.chunk_size_lock, NULL);
+	if (opt->output_compressed) {
+		pipeline.out = bgzf_output_open(out, opt->n_threads, Z_DEFAULT_COMPRESSION);
+		if (pipeline.out == NULL) {
+			fprintf(stderr, "[prophex:%s] the compressed output can not be created\n", __func__);
+			kseq_destroy(pipeline.ks);
+			pthread_mutex_destroy(&pipeline.chunk_size_lock);
+			return -1;
+		}
+	}
+	if (opt->output_binary) {
+		pipeline.binary_output = binary_output_init(pipeline.out, opt->output_binary_names, opt->kmer_length);
+	}
+	// with more threads, the next chunk is read while the previous one is matched
+	kt_pipeline(opt->n_threads > 1 ? 2 : 1, query_pipeline_step, &pipeline, 2);
+	if (pipeline.binary_output) {
+		binary_output_destroy(pipeline.binary_output);
+	}
+	int ret = 0;
+	if (opt->output_compressed && fclose(pipeline.out) != 0) {
+		ret = -1;
+	}
+	kseq_destroy(pipeline.ks);
+	pthread_mutex_destroy(&pipeline.chunk_size_lock);
+	*seqs_cnt += pipeline.seqs_cnt;
+	*kmers_cnt += pipeline.kmers_cnt;
+	if (reading_time) {
+		*reading_time += pipeline.reading_time;
+	}
+	return ret;
+}
 
-	double ctime, rtime;
-	ctime = cputime();
-	rtime = realtime();
-	klcp_t* klcp = malloc(sizeof(klcp_t));
-	klcp->klcp = malloc(sizeof(bitarray_t));
+int query(const char** prefixes, int prefixes_cnt, const char* fn_fa, const prophex_opt_t* opt) {
+	void* ko = 0;
 
-	if (opt->use_klcp) {
-		char* fn = malloc((strlen(prefix) + 10) * sizeof(char));
-		strcpy(fn, prefix);
-		strcat(fn, ".");
-		char* kmer_length_str = malloc(5 * sizeof(char));
-		sprintf(kmer_length_str, "%d", opt->kmer_length);
-		strcat(fn, kmer_length_str);
-		strcat(fn, ".klcp");
-		klcp_restore(fn, klcp);
-		free(fn);
-		fprintf(log_file, "klcp_loading\t%.2fs\n", realtime() - rtime);
+	prophex_index_t* index = query_index_load(prefixes, prefixes_cnt, opt);
+	if (index == NULL) {
+		return 1;
 	}
+	FILE* log_file = index->log_file;
+
+	double ctime, rtime;
 	float total_time = 0;
 	int64_t total_seqs = 0;
 	ctime = cputime();
@@ -550,22 +1742,11 @@ void query(const char* prefix, const char* fn_fa, const prophex_opt_t* opt) {
 	if (ko == 0) {
 		if (bwa_verbose >= 1)
 			fprintf(stderr, "[E::%s] fail to open file `%s'.\n", __func__, fn_fa);
-		return;
-	}
-	fp = gzdopen(fd, "r");
-	kseq_t* ks = kseq_init(fp);
-
-	while ((seqs = bseq_read(opt->read_chunk_size, &n_seqs, ks, NULL)) != 0) {
-		process_sequences(idx, n_seqs, seqs, opt, klcp);
-		total_seqs += n_seqs;
-		for (i = 0; i < n_seqs; ++i) {
-			int seq_kmers_count = seqs[i].l_seq - opt->kmer_length + 1;
-			if (seq_kmers_count > 0) {
-				total_kmers_count += seq_kmers_count;
-			}
-		}
-		destroy_reads(n_seqs, seqs);
+		return 1;
 	}
+	gz_input_t* input = gz_input_open(fd, opt->n_threads);
+	double reading_time = 0;
+	int ret = query_stream(index, input->fp, stdout, opt, &total_seqs, &total_kmers_count, &reading_time) == 0 ? 0 : 1;
 	total_time = realtime() - rtime;
 
 	fprintf(stderr, "[prophex:%s] match time: %.2f sec\n", __func__, total_time);
@@ -577,19 +1758,14 @@ void query(const char* prefix, const char* fn_fa, const prophex_opt_t* opt) {
 		fprintf(log_file, "kmers\t%" PRId64 "\n", total_kmers_count);
 		fprintf(log_file, "rpm\t%" PRId64 "\n", (int64_t)(round(total_seqs * 60.0 / total_time)));
 		fprintf(log_file, "kpm\t%" PRId64 "\n", (int64_t)(round(total_kmers_count * 60.0 / total_time)));
+		fprintf(log_file, "occ_kernel\t%s\n", bwt_occ_kernel_name());
+		fprintf(log_file, "input_format\t%s\n", gz_input_format_name(input));
+		// both overlap with matching when several threads are used
+		fprintf(log_file, "decompression_time\t%.2fs\n", input->decompression_time);
+		fprintf(log_file, "reading_time\t%.2fs\n", reading_time);
 	}
-	if (opt->need_log) {
-		fclose(log_file);
-	}
-	if (opt->use_klcp) {
-		destroy_klcp(klcp);
-	} else {
-		free(klcp->klcp);
-		free(klcp);
-	}
-
-	bwa_idx_destroy_without_bns_name_and_anno(idx);
-	kseq_destroy(ks);
-	err_gzclose(fp);
+	query_index_destroy(index, opt);
+	gz_input_close(input);
 	kclose(ko);
+	return ret;
 }
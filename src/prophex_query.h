@@ -7,11 +7,18 @@
 #ifndef PROPHEX_QUERY_H
 #define PROPHEX_QUERY_H
 
+#include <pthread.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <zlib.h>
+#include "assignment.h"
+#include "binary_output.h"
 #include "bwa.h"
+#include "bwa_utils.h"
 #include "bwt.h"
 #include "bwtaln.h"
 #include "klcp.h"
+#include "kstring.h"
 #include "prophex_utils.h"
 
 typedef struct {
@@ -21,6 +28,32 @@ typedef struct {
 	int node;
 } bwt_position_t;
 
+// one index shard, i.e. an index built for a part of the reference
+typedef struct {
+	const char* prefix;
+	bwaidx_t* idx;
+	klcp_t* klcp;
+	// contigs of the SA samples, NULL if the index has none (prophex index -n)
+	sa_contigs_t* sa_contigs;
+	// global number of the first contig of the shard in contig_node_translator
+	int contig_offset;
+	// size of the files loaded for querying, in bytes
+	int64_t size;
+	// the index contains only the forward strand, reverse complements of k-mers are searched separately
+	int is_forward_only;
+} prophex_shard_t;
+
+// node sets of all k-mers of a read, stored in one flat array
+typedef struct {
+	int32_t* nodes;
+	// nodes of the i-th k-mer are nodes[offsets[i]], ..., nodes[offsets[i + 1] - 1]
+	size_t* offsets;
+	size_t nodes_cnt;
+	size_t nodes_capacity;
+	int kmers_cnt;
+	int kmers_capacity;
+} kmer_node_sets_t;
+
 typedef struct {
 	bwt_position_t* positions;
 	char* all_streaks;
@@ -28,20 +61,106 @@ typedef struct {
 	int32_t* seen_nodes;
 	int32_t* prev_seen_nodes;
 	int8_t* seen_nodes_marks;
+	int8_t* is_ambiguous_kmer;
+	int8_t* is_restarted_kmer;
+	// complement of the read in its original orientation, for forward-only indexes
+	ubyte_t* rc_seq;
+	int8_t* rc_is_ambiguous_kmer;
+	int8_t* rc_is_restarted_kmer;
+	int kmer_flags_capacity;
+	kmer_node_sets_t shard_sets;
+	kmer_node_sets_t rc_sets;
+	kmer_node_sets_t merged_sets;
+	kmer_node_sets_t tmp_sets;
+	assignment_aux_t assign_aux;
+	// lines of the reads finished by the thread and not yet written, in the unordered mode (query -O)
+	kstring_t unordered_output;
 	int rids_computations;
 	int using_prev_rids;
 } prophex_query_aux_t;
 
+// task of process_sequence: a whole read, or the k-mers from, ..., to - 1 of a long read split into segments (query -L)
 typedef struct {
-	const bwaidx_t* idx;
-	const klcp_t* klcp;
+	int seq_index;
+	int from;
+	int to;
+	// segment of the long read, -1 for a whole read
+	int segment;
+} read_task_t;
+
+typedef struct {
+	const prophex_shard_t* shards;
+	int shards_cnt;
+	// with NUMA, threads are pinned to the nodes in turn and those of node n query the shards replicas[n] + first_shard
+	prophex_shard_t** replicas;
+	int replicas_cnt;
+	int first_shard;
+	int numa_nodes_cnt;
+	// node sets of shards queried in previous passes, one per read (only when the shards are queried in several passes)
+	kmer_node_sets_t* stored_sets;
+	int pass;
+	int passes_cnt;
 	const prophex_opt_t* opt;
 	const bseq1_t* seqs;
 	prophex_query_aux_t* aux_data;
 	int32_t seqs_cnt;
+	// text of the streaks of every read, not used in the unordered mode
 	char** output;
+	// in the unordered mode (query -O), reads are written to out as they are finished, with their numbers in the stream
+	FILE* out;
+	int64_t first_read_number;
+	// streaks of every read for the binary output or the assignment, NULL if they are not needed
+	read_streaks_t* streaks;
+	// tree the reads are assigned to (query -A) and their assignments, or NULL
+	const prophex_tree_t* tree;
+	read_assignment_t* assignments;
+	// tasks of process_sequence if long reads are split into segments, NULL if every read is one task
+	read_task_t* tasks;
+	int tasks_cnt;
+	// reads split into segments, the segments of long_reads[i] are long_read_segments[i], ..., long_read_segments[i + 1] - 1
+	int* long_reads;
+	int long_reads_cnt;
+	int* long_read_segments;
+	// node sets of the k-mers of every segment
+	kmer_node_sets_t* segment_sets;
+	int segments_cnt;
 } prophex_worker_t;
 
-void query(const char* prefix, const char* fn_fa, const prophex_opt_t* opt);
+// index loaded for querying: the shards, their replicas on NUMA nodes and the groups of shards fitting the memory budget
+typedef struct {
+	prophex_shard_t* shards;
+	int shards_cnt;
+	prophex_shard_t** replicas;
+	int replicas_cnt;
+	int numa_nodes_cnt;
+	int* group_starts;
+	int groups_cnt;
+	// group of shards currently in memory
+	int loaded_group;
+	FILE* log_file;
+	// tree the reads are assigned to (query -A), or NULL
+	prophex_tree_t* tree;
+	// taken for matching a chunk of reads, so that streams queried at the same time share the threads and shards
+	pthread_mutex_t lock;
+} prophex_index_t;
+
+void prophex_aux_data_init(prophex_query_aux_t* aux_data);
+void prophex_aux_data_destroy(prophex_query_aux_t* aux_data);
+// marks the k-mers of the read (2-bit encoded and reversed) and prepares its reverse complement if a shard is forward-only,
+// returns whether one is
+int prepare_read_kmers(const prophex_shard_t* shards, int shards_cnt, const prophex_opt_t* opt, const bseq1_t* seq, prophex_query_aux_t* aux_data);
+// finds the node sets of all k-mers of the prepared read in the shards and merges them into aux_data->merged_sets
+void query_shards_kmers(const prophex_shard_t* shards, int shards_cnt, const prophex_opt_t* opt, const bseq1_t* seq, prophex_query_aux_t* aux_data);
+char* klcp_file_name(const char* prefix, int kmer_length);
+int64_t file_size(const char* prefix, const char* suffix);
+
+prophex_index_t* query_index_load(const char** prefixes, int prefixes_cnt, const prophex_opt_t* opt);
+void query_index_destroy(prophex_index_t* index, const prophex_opt_t* opt);
+// queries the reads of the stream in chunks, writes their output and adds up the numbers of reads and k-mers and the time
+// of reading the reads (if reading_time is not NULL); returns 0, or -1 if the compressed output could not be written
+int query_stream(prophex_index_t* index, gzFile in, FILE* out, const prophex_opt_t* opt, int64_t* seqs_cnt, int64_t* kmers_cnt,
+                 double* reading_time);
+// returns the exit status of prophex query
+int query(const char** prefixes, int prefixes_cnt, const char* fn_fa, const prophex_opt_t* opt);
 
 #endif  // PROPHEX_QUERY_H
@@ -0,0 +1,119 @@
+#include "prophex_serve.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "prophex_query.h"
+#include "utils.h"
+
+// maximum number of connections waiting to be accepted
+#define SERVE_BACKLOG 64
+
+typedef struct {
+	prophex_index_t* index;
+	const prophex_opt_t* opt;
+	int fd;
+	int64_t id;
+} connection_t;
+
+static const char* served_socket_path;
+
+static void stop_serving(int sig) {
+	unlink(served_socket_path);
+	_exit(0);
+}
+
+// a connection is read and answered by its own thread, its chunks of reads are matched by the threads of the index in turn
+// with those of the other connections
+static void* serve_connection(void* data) {
+	connection_t* connection = (connection_t*)data;
+	double rtime = realtime();
+	int64_t seqs_cnt = 0, kmers_cnt = 0;
+	int out_fd = dup(connection->fd);
+	gzFile in = gzdopen(connection->fd, "r");
+	FILE* out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+	if (in == NULL || out == NULL) {
+		fprintf(stderr, "[prophex:%s] connection %lld could not be opened: %s\n", __func__, (long long)connection->id, strerror(errno));
+	} else {
+		if (query_stream(connection->index, in, out, connection->opt, &seqs_cnt, &kmers_cnt, NULL) != 0) {
+			fprintf(stderr, "[prophex:%s] the output of connection %lld could not be written\n", __func__, (long long)connection->id);
+		}
+	}
+	if (out != NULL) {
+		fclose(out);
+	} else if (out_fd >= 0) {
+		close(out_fd);
+	}
+	if (in != NULL) {
+		gzclose(in);
+	} else {
+		close(connection->fd);
+	}
+	fprintf(stderr, "[prophex:%s] connection %lld: processed %lld reads in %.3f real sec\n", __func__, (long long)connection->id,
+	        (long long)seqs_cnt, realtime() - rtime);
+	free(connection);
+	return 0;
+}
+
+int serve(const char** prefixes, int prefixes_cnt, const char* socket_path, const prophex_opt_t* opt) {
+	struct sockaddr_un address;
+	if (strlen(socket_path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "[prophex:%s] socket path %s is too long\n", __func__, socket_path);
+		return 1;
+	}
+	prophex_index_t* index = query_index_load(prefixes, prefixes_cnt, opt);
+	if (index == NULL) {
+		return 1;
+	}
+	// the socket is created once the index is loaded, so that clients can wait for it to appear
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socket_path);
+	unlink(socket_path);
+	if (fd < 0 || bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, SERVE_BACKLOG) < 0) {
+		fprintf(stderr, "[prophex:%s] could not listen on %s: %s\n", __func__, socket_path, strerror(errno));
+		query_index_destroy(index, opt);
+		return 1;
+	}
+	served_socket_path = socket_path;
+	signal(SIGINT, stop_serving);
+	signal(SIGTERM, stop_serving);
+	// a client closing its connection early must not stop the server
+	signal(SIGPIPE, SIG_IGN);
+	fprintf(stderr, "[prophex:%s] listening on %s\n", __func__, socket_path);
+	int64_t connections_cnt = 0;
+	for (;;) {
+		int connection_fd = accept(fd, NULL, NULL);
+		if (connection_fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			fprintf(stderr, "[prophex:%s] could not accept a connection: %s\n", __func__, strerror(errno));
+			break;
+		}
+		connection_t* connection = malloc(sizeof(connection_t));
+		connection->index = index;
+		connection->opt = opt;
+		connection->fd = connection_fd;
+		connection->id = connections_cnt++;
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, serve_connection, connection) != 0) {
+			fprintf(stderr, "[prophex:%s] could not start a thread for connection %lld\n", __func__, (long long)connection->id);
+			close(connection_fd);
+			free(connection);
+			continue;
+		}
+		pthread_detach(tid);
+	}
+	close(fd);
+	unlink(socket_path);
+	query_index_destroy(index, opt);
+	return 1;
+}
@@ -0,0 +1,15 @@
+/*
+  prophex serve command: the index is loaded once and reads are queried over a Unix domain socket.
+  Licence: MIT
+*/
+
+#ifndef PROPHEX_SERVE_H
+#define PROPHEX_SERVE_H
+
+#include "prophex_utils.h"
+
+// loads the index and answers connections to the socket until the process is terminated, every connection sends
+// reads (FASTA/FASTQ, possibly gzipped) and gets the output of query for them once it shuts down its writing side
+int serve(const char** prefixes, int prefixes_cnt, const char* socket_path, const prophex_opt_t* opt);
+
+#endif  // PROPHEX_SERVE_H
@@ -9,13 +9,27 @@ prophex_opt_t* prophex_init_opt() {
 	o->trim_qual = 0;
 	o->kmer_length = 14;
 	o->use_klcp = 0;
+	o->use_fmd = 0;
 	o->output = 1;
 	o->output_read_qual = 0;
 	o->output_old = 0;
+	o->output_binary = 0;
+	o->output_binary_names = 1;
+	o->output_compressed = 0;
+	o->output_unordered = 0;
+	o->tree_file_name = NULL;
+	o->assign_measure = 0;
 	o->skip_positions_on_border = 1;
 	o->construct_sa_parallel = 0;
+	o->pack_sa = 0;
+	o->text_sa = 0;
+	o->sa_contigs = 0;
 	o->need_log = 0;
 	o->log_file_name = NULL;
-	o->read_chunk_size = READ_CHUNK_SIZE;
+	o->read_chunk_size = 0;
+	o->long_read_segment = LONG_READ_SEGMENT;
+	o->shards_memory_budget = 0;
+	o->huge_pages = 0;
+	o->numa_mode = NUMA_OFF;
 	return o;
 }
@@ -11,24 +11,59 @@
 #include <stdlib.h>
 #include "bwtaln.h"
 
-// maximum total number base pairs in reads in one chunk
+// maximum total number base pairs in reads in one chunk, unless set by query -C
 #define READ_CHUNK_SIZE 10000000
+// minimum number of base pairs in one chunk per thread
+#define READ_CHUNK_MIN_SIZE 50000
+// real time in seconds the chunks are sized for, from the matching time of the previous chunks
+#define READ_CHUNK_TIME 1.0
+// maximum number of k-mers of a read matched by one thread, longer reads are split into segments (query -L)
+#define LONG_READ_SEGMENT 20000
+
+// placement of the index on NUMA nodes (query -N)
+#define NUMA_OFF 0
+#define NUMA_REPLICATE 1
+#define NUMA_INTERLEAVE 2
 
 typedef struct {
 	int mode;
 	int n_threads;
 	int trim_qual;
 	int use_klcp;
+	int use_fmd;
 	int kmer_length;
 	int output;
 	int output_old;
 	int output_read_qual;
+	// binary output of streaks (query -B), with read names unless -W
+	int output_binary;
+	int output_binary_names;
+	// output compressed in BGZF blocks by the threads (query -z)
+	int output_compressed;
+	// reads written as soon as they are matched, with their numbers (query -O)
+	int output_unordered;
+	// Newick tree the reads are assigned to (query -A) and the measure of the assignment
+	char* tree_file_name;
+	int assign_measure;
 	int skip_after_fail;
 	int skip_positions_on_border;
 	int need_log;
 	char* log_file_name;
 	int construct_sa_parallel;
+	// bit-pack SA samples when building the index
+	int pack_sa;
+	// sample SA at text positions instead of rows when building the index
+	int text_sa;
+	// store the contigs of SA samples (.san) when building the index
+	int sa_contigs;
+	// number of base pairs in one chunk, 0 = adaptive
 	int read_chunk_size;
+	// reads with more k-mers are split into segments matched by separate threads, 0 = never
+	int long_read_segment;
+	int64_t shards_memory_budget;
+	// back the index arrays with huge pages
+	int huge_pages;
+	int numa_mode;
 } prophex_opt_t;
 
 prophex_opt_t* prophex_init_opt();
@@ -0,0 +1,65 @@
+/*
+    Prints the output of prophex query -u for reads, querying the index through libprophex.
+    Usage: query_lib [-a] <k> <idxbase> <in.fq>, with -a the k-LCP is attached after loading the index.
+    Licence: MIT
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+#include "kseq.h"
+#include "libprophex.h"
+
+KSEQ_INIT(gzFile, gzread)
+
+typedef struct {
+	const prophex_idx_t* idx;
+	int streaks_cnt;
+} read_output_t;
+
+static void print_streak(void* data, const int32_t* nodes, int nodes_cnt, int kmers_cnt) {
+	read_output_t* output = (read_output_t*)data;
+	if (output->streaks_cnt++ > 0) {
+		printf(" ");
+	}
+	if (nodes_cnt < 0) {
+		printf("A");
+	} else if (nodes_cnt == 0) {
+		printf("0");
+	}
+	int i;
+	for (i = 0; i < nodes_cnt; ++i) {
+		printf(i > 0 ? ",%s" : "%s", prophex_idx_node_name(output->idx, nodes[i]));
+	}
+	printf(":%d", kmers_cnt);
+}
+
+int main(int argc, char* argv[]) {
+	int attach = argc > 1 && strcmp(argv[1], "-a") == 0;
+	if (argc != 4 + attach) {
+		fprintf(stderr, "Usage: query_lib [-a] <k> <idxbase> <in.fq>\n");
+		return 1;
+	}
+	int k = atoi(argv[1 + attach]);
+	const char* prefix = argv[2 + attach];
+	prophex_idx_t* idx = prophex_idx_load(&prefix, 1, k, attach ? 0 : PROPHEX_KLCP);
+	if (idx == NULL || (attach && prophex_idx_attach_klcp(idx, k) != 0)) {
+		return 1;
+	}
+	prophex_ctx_t* ctx = prophex_ctx_init(idx);
+	gzFile in = gzopen(argv[3 + attach], "r");
+	kseq_t* ks = kseq_init(in);
+	while (kseq_read(ks) >= 0) {
+		read_output_t output = {idx, 0};
+		printf("U\t%s\t0\t%d\t", ks->name.s, (int)ks->seq.l);
+		if (prophex_query_read(ctx, ks->seq.s, ks->seq.l, NULL, print_streak, &output) == 0) {
+			printf("0:0");
+		}
+		printf("\n");
+	}
+	kseq_destroy(ks);
+	gzclose(in);
+	prophex_ctx_destroy(ctx);
+	prophex_idx_destroy(idx);
+	return 0;
+}
@@ -0,0 +1,108 @@
+#! /usr/bin/env python3
+"""Assign reads from the text output of prophex query to the nodes of a Newick tree (reference for query -A).
+
+A k-mer matching a node hits the node and all its descendants. h1 of a node is the number of k-mers of the read hitting
+it and c1 the number of bases covered by them. The read is assigned to the lowest common ancestor of the nodes with the
+highest measure.
+
+Licence: MIT
+"""
+
+import sys
+
+
+def parse_newick(s):
+    """Return names and parents of the nodes in pre-order."""
+    names, parents = [], []
+    pos = 0
+
+    def skip_label(pos):
+        begin = pos
+        if s[pos] == "'":
+            end = s.index("'", pos + 1)
+            name, pos = s[pos + 1:end], end + 1
+        else:
+            while s[pos] not in "(),:;[" and not s[pos].isspace():
+                pos += 1
+            name = s[begin:pos]
+        while True:
+            while s[pos].isspace():
+                pos += 1
+            if s[pos] == ":":
+                pos += 1
+                while s[pos] not in "(),;[" and not s[pos].isspace():
+                    pos += 1
+            elif s[pos] == "[":
+                pos = s.index("]", pos) + 1
+            else:
+                return name, pos
+
+    def node(pos, parent):
+        while s[pos].isspace():
+            pos += 1
+        v = len(names)
+        names.append(None)
+        parents.append(parent)
+        if s[pos] == "(":
+            pos = node(pos + 1, v)
+            while s[pos] == ",":
+                pos = node(pos + 1, v)
+            assert s[pos] == ")"
+            pos += 1
+        names[v], pos = skip_label(pos)
+        return pos
+
+    node(pos, -1)
+    return names, parents
+
+
+def main():
+    if len(sys.argv) != 5:
+        print("usage: assign_reads.py <tree.nw> <k> <h1|c1> <query_output.txt>", file=sys.stderr)
+        sys.exit(1)
+    with open(sys.argv[1]) as f:
+        names, parents = parse_newick(f.read())
+    k = int(sys.argv[2])
+    measure = sys.argv[3]
+    node_ids = {}
+    for v, name in enumerate(names):
+        node_ids.setdefault(name, v)
+    ancestors = []
+    for v in range(len(names)):
+        path, u = set(), v
+        while u >= 0:
+            path.add(u)
+            u = parents[u]
+        ancestors.append(path)
+
+    with open(sys.argv[4]) as f:
+        for line in f:
+            _, read_name, _, l_seq, streaks = line.rstrip("\n").split("\t")[:5]
+            l_seq = int(l_seq)
+            hits = [0] * len(names)
+            covered = [set() for _ in names]
+            kmer_start = 0
+            for streak in streaks.split(" "):
+                nodes, kmers_cnt = streak.rsplit(":", 1)
+                kmers_cnt = int(kmers_cnt)
+                if nodes not in ("0", "A"):
+                    streak_nodes = [node_ids[node] for node in nodes.split(",") if node in node_ids]
+                    for v in range(len(names)):
+                        if ancestors[v] & set(streak_nodes):
+                            hits[v] += kmers_cnt
+                            covered[v].update(range(kmer_start, kmer_start + kmers_cnt - 1 + k))
+                kmer_start += kmers_cnt
+            values = hits if measure == "h1" else [len(c) for c in covered]
+            best = max(values)
+            if best == 0:
+                print("U\t{}\t0\t{}\t{}\t0\t0".format(read_name, l_seq, streaks))
+                continue
+            best_nodes = [v for v in range(len(names)) if values[v] == best]
+            common = set.intersection(*(ancestors[v] for v in best_nodes))
+            lca = max(common)
+            print("C\t{}\t{}\t{}\t{}\t{}\t{}".format(read_name, names[lca], l_seq, streaks, hits[best_nodes[0]],
+                                                       len(covered[best_nodes[0]])))
+
+
+if __name__ == "__main__":
+    main()
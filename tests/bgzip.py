@@ -0,0 +1,39 @@
+#! /usr/bin/env python3
+"""Compress stdin to stdout in the BGZF format (like bgzip), with blocks of at most the given size.
+
+With "pad", every block is padded by another extra subfield to the maximum BGZF block size (64 kB).
+
+Licence: MIT
+"""
+
+import struct
+import sys
+import zlib
+
+
+def bgzf_block(data, pad):
+    compressor = zlib.compressobj(6, zlib.DEFLATED, -15)
+    cdata = compressor.compress(data) + compressor.flush()
+    padding = b""
+    if pad:
+        padding_len = (1 << 16) - (12 + 6 + 4 + len(cdata) + 8)
+        padding = struct.pack("<BBH", ord("P"), ord("D"), padding_len) + b"\0" * padding_len
+    # header with the BC extra subfield holding the block size - 1
+    xlen = 6 + len(padding)
+    header = struct.pack("<BBBBIBBHBBHH", 0x1f, 0x8b, 8, 4, 0, 0, 0xff, xlen, ord("B"), ord("C"), 2, 12 + xlen + len(cdata) + 8 - 1)
+    return header + padding + cdata + struct.pack("<II", zlib.crc32(data) & 0xffffffff, len(data))
+
+
+def main():
+    block_size = int(sys.argv[1]) if len(sys.argv) > 1 else 65280
+    pad = len(sys.argv) > 2 and sys.argv[2] == "pad"
+    data = sys.stdin.buffer.read()
+    out = sys.stdout.buffer
+    for i in range(0, len(data), block_size):
+        out.write(bgzf_block(data[i:i + block_size], pad))
+    # the empty block marking the end of the file
+    out.write(bgzf_block(b"", pad))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,69 @@
+#! /usr/bin/env python3
+"""Convert the binary output of prophex query -B into its text output (reads without names are named by their numbers).
+
+Licence: MIT
+"""
+
+import struct
+import sys
+
+
+def read_varint(data, pos):
+    """Read an unsigned LEB128 number, return it and the position after it."""
+    x, shift = 0, 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        x |= (byte & 0x7f) << shift
+        shift += 7
+        if byte < 0x80:
+            return x, pos
+
+
+def main():
+    if len(sys.argv) != 2:
+        print("usage: binary_to_text.py <output.bin>", file=sys.stderr)
+        sys.exit(1)
+    with open(sys.argv[1], "rb") as f:
+        data = f.read()
+    assert data[:8] == b"PXSTR001", "not a binary output of prophex query"
+    flags, k, nodes_cnt = struct.unpack_from("<IiI", data, 8)
+    pos = 20
+    nodes = []
+    for _ in range(nodes_cnt):
+        end = data.index(b"\0", pos)
+        nodes.append(data[pos:end].decode())
+        pos = end + 1
+    sets = ["0", "A"]
+    reads_cnt = 0
+    out = sys.stdout
+    while pos < len(data):
+        record_type = data[pos:pos + 1]
+        size, pos = read_varint(data, pos + 1)
+        payload, end = pos, pos + size
+        pos = end
+        if record_type == b"S":
+            m, payload = read_varint(data, payload)
+            set_nodes = []
+            for _ in range(m):
+                delta, payload = read_varint(data, payload)
+                set_nodes.append(delta + (set_nodes[-1] if set_nodes else 0))
+            sets.append(",".join(nodes[node] for node in set_nodes))
+        elif record_type == b"R":
+            l_seq, payload = read_varint(data, payload)
+            streaks_cnt, payload = read_varint(data, payload)
+            streaks = []
+            for _ in range(streaks_cnt):
+                set_id, payload = read_varint(data, payload)
+                kmers_cnt, payload = read_varint(data, payload)
+                streaks.append("{}:{}".format(sets[set_id], kmers_cnt))
+            name = str(reads_cnt)
+            if flags & 1:
+                name_len, payload = read_varint(data, payload)
+                name = data[payload:payload + name_len].decode()
+            out.write("U\t{}\t0\t{}\t{}\n".format(name, l_seq, " ".join(streaks) if streaks else "0:0"))
+            reads_cnt += 1
+
+
+if __name__ == "__main__":
+    main()
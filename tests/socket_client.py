@@ -0,0 +1,42 @@
+#! /usr/bin/env python3
+"""Send a file to a Unix domain socket, shut down the writing side and print everything received.
+
+The output is received while the file is being sent, as the server answers every chunk of reads as soon as it is
+matched and stops reading when its output is not read.
+
+Licence: MIT
+"""
+
+import socket
+import sys
+import threading
+
+
+def send_file(s, file_name):
+    with open(file_name, "rb") as f:
+        while True:
+            data = f.read(1 << 16)
+            if not data:
+                break
+            s.sendall(data)
+    s.shutdown(socket.SHUT_WR)
+
+
+def main():
+    if len(sys.argv) != 3:
+        print("usage: socket_client.py <socket> <file>", file=sys.stderr)
+        sys.exit(1)
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as s:
+        s.connect(sys.argv[1])
+        sender = threading.Thread(target=send_file, args=(s, sys.argv[2]))
+        sender.start()
+        while True:
+            data = s.recv(1 << 16)
+            if not data:
+                break
+            sys.stdout.buffer.write(data)
+        sender.join()
+
+
+if __name__ == "__main__":
+    main()